@@ -41,6 +41,14 @@ class CoreExport Channel : public Extensible
 	 */
  	typedef std::map<User*, insp::aligned_storage<Membership> > MemberMap;
 
+	/** A list of the local members of a channel, sorted by prefix rank, highest first
+	 */
+	typedef std::vector<Membership*> LocalMemberList;
+
+	/** A map of servers to the number of remote members on the channel they have
+	 */
+	typedef insp::flat_map<Server*, size_t> ServerMemberCount;
+
  private:
 	/** Set default modes for the channel on creation
 	 */
@@ -61,6 +69,14 @@ class CoreExport Channel : public Extensible
 	 */
 	void DelUser(const MemberMap::iterator& membiter);
 
+	/** Local members of the channel, kept in sync with userlist by AddUser() and DelUser().
+	 */
+	LocalMemberList localmembers;
+
+	/** Number of remote members on the channel per server, kept in sync with userlist by AddUser() and DelUser().
+	 */
+	ServerMemberCount servercounts;
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -177,6 +193,30 @@ class CoreExport Channel : public Extensible
 	 */
 	const MemberMap& GetUsers() const { return userlist; }
 
+	/** Obtain the local members of this channel.
+	 * Members with the highest prefix rank come first so callers looking
+	 * for a minimum rank can stop at the first member below it.
+	 * @return A list of the local members of this channel.
+	 */
+	const LocalMemberList& GetLocalMembers() const { return localmembers; }
+
+	/** Obtain the number of remote members on this channel for each server.
+	 * Servers with no members on the channel are not in the map.
+	 * @return A map of servers to the number of members they have on this channel.
+	 */
+	const ServerMemberCount& GetServerMemberCounts() const { return servercounts; }
+
+	/** Moves a local member to the right place in the local member list after its prefix rank changed.
+	 * Called by Membership::SetPrefix(), there is no need to call this manually.
+	 * @param memb The member whose rank changed.
+	 */
+	void UpdateMemberRank(Membership* memb);
+
+	/** Resorts the local member list of this channel.
+	 * Called when the rank of a prefix mode changes.
+	 */
+	void SortLocalMembers();
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -55,6 +55,16 @@ class ClientProtocol::TagSelection
 	std::bitset<64> selection;
 
  public:
+	TagSelection() { }
+
+	/** Create a selection from a bitmask.
+	 * @param mask Bitmask previously returned by GetMask().
+	 */
+	explicit TagSelection(unsigned long long mask)
+		: selection(mask)
+	{
+	}
+
 	/** Check if a tag is selected.
 	 * @param tags TagMap the tag is in. The TagMap must contain the same tags as it had when the tag
 	 * was selected with Select(), otherwise the result is not meaningful.
@@ -87,6 +97,14 @@ class ClientProtocol::TagSelection
 	{
 		return (this->selection == other.selection);
 	}
+
+	/** Get the selected tags as a bitmask, suitable for hashing.
+	 * @return Bitmask with bit N set if the Nth tag in the TagMap is selected.
+	 */
+	unsigned long long GetMask() const
+	{
+		return selection.to_ullong();
+	}
 };
 
 class ClientProtocol::MessageSource
@@ -205,6 +223,16 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		{
 			return ((serializer == other.serializer) && (tagwl == other.tagwl));
 		}
+
+		/** Hashes SerializedInfo objects for the serialization cache.
+		 */
+		struct Hash
+		{
+			size_t operator()(const SerializedInfo& info) const
+			{
+				return std::hash<unsigned long long>()(info.tagwl.GetMask()) ^ std::hash<const Serializer*>()(info.serializer);
+			}
+		};
 	};
 
 	class Param
@@ -279,7 +307,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	typedef std::vector<Param> ParamList;
 
  private:
-	typedef std::vector<std::pair<SerializedInfo, SerializedMessage> > SerializedList;
+	typedef std::unordered_map<SerializedInfo, SharedSerializedMessage, SerializedInfo::Hash> SerializedList;
 
 	ParamList params;
 	TagMap tags;
@@ -312,7 +340,6 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, sideeffect(false)
 	{
 		params.reserve(8);
-		serlist.reserve(8);
 	}
 
 	/** Constructor.
@@ -329,7 +356,6 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, sideeffect(false)
 	{
 		params.reserve(8);
-		serlist.reserve(8);
 	}
 
 	/** Get the parameters of this message.
@@ -411,9 +437,10 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	 * @param serializeinfo Information about which exact serialized form of the message is the caller asking for
 	 * (which serializer to use and which tags to include).
 	 * @return Serialized message according to serializeinfo. The returned reference remains valid until the
-	 * next call to this method.
+	 * next call to this method. The serialized message itself is shared and remains valid as long as a copy
+	 * of the returned pointer is held, e.g. by the send queue of a user.
 	 */
-	const SerializedMessage& GetSerialized(const SerializedInfo& serializeinfo) const;
+	const SharedSerializedMessage& GetSerialized(const SerializedInfo& serializeinfo) const;
 
 	/** Clear the parameter list and tags.
 	 */
@@ -531,6 +558,10 @@ class ClientProtocol::MessageTagProvider : public Events::ModuleEventListener
 	{
 	}
 
+	/** Destructor, invalidates all cached ShouldSendTag() results of this provider.
+	 */
+	virtual ~MessageTagProvider();
+
 	/** Called when a message is ready to be sent to give the tag provider a chance to add tags to the message.
 	 * To add tags call Message::AddTag(). If the provided tag or tags have been added already elsewhere or if the
 	 * provider doesn't want its tag(s) to be on the message, the implementation doesn't have to do anything special.
@@ -561,6 +592,14 @@ class ClientProtocol::MessageTagProvider : public Events::ModuleEventListener
 	 * @return True if the tag should be sent to the user, false otherwise.
 	 */
 	virtual bool ShouldSendTag(LocalUser* user, const MessageTagData& tagdata) = 0;
+
+	/** Check whether the result of ShouldSendTag() only depends on the user and not on the tag or the message.
+	 * If true, the result is cached for each user until the cache is invalidated with
+	 * Serializer::InvalidateTagCache(), which must be done whenever the result may change (e.g. on CAP REQ).
+	 * The default implementation returns false.
+	 * @return True if the result of ShouldSendTag() may be cached, false otherwise.
+	 */
+	virtual bool IsCacheable() const { return false; }
 };
 
 /** Base class for client protocol event hooks.
@@ -676,6 +715,9 @@ class CoreExport ClientProtocol::Serializer : public DataProvider
 	 */
 	TagSelection MakeTagWhitelist(LocalUser* user, const TagMap& tagmap) const;
 
+	/** Generation of the tag whitelist caches of users, see InvalidateTagCache(). */
+	static unsigned long tagcachegeneration;
+
  public:
 	/** Constructor.
 	 * @param mod Module owning the serializer.
@@ -697,9 +739,16 @@ class CoreExport ClientProtocol::Serializer : public DataProvider
 	 * @param msg Message to serialize.
 	 * @return Raw serialized message, only containing the appropriate tags for the user.
 	 * The reference is guaranteed to be valid as long as the Message object is alive and until the same
-	 * Message is serialized for another user.
+	 * Message is serialized for another user. The pointed-to message is shared between all users that
+	 * receive the same serialized form of the message.
 	 */
-	const SerializedMessage& SerializeForUser(LocalUser* user, Message& msg);
+	const SharedSerializedMessage& SerializeForUser(LocalUser* user, Message& msg);
+
+	/** Forget the cached results of MessageTagProvider::ShouldSendTag() for a user or for everyone.
+	 * Must be called whenever the result of a cacheable ShouldSendTag() may have changed.
+	 * @param user User whose cache to invalidate or NULL to invalidate the cache of every user.
+	 */
+	static void InvalidateTagCache(LocalUser* user = NULL);
 
 	/** Serialize a high level protocol message into wire format.
 	 * @param msg High level message to serialize. Contains all necessary information about the message, including all possible tags.
@@ -724,3 +773,9 @@ inline ClientProtocol::MessageTagData::MessageTagData(MessageTagProvider* prov,
 	, provdata(data)
 {
 }
+
+inline ClientProtocol::MessageTagProvider::~MessageTagProvider()
+{
+	// Another provider might be created at the same address
+	Serializer::InvalidateTagCache();
+}
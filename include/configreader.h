@@ -346,6 +346,19 @@ class CoreExport ServerConfig
 	 */
 	int MaxConn;
 
+	/** The number of threads used to read from the sockets of registered
+	 * users, or 0 to read from all sockets on the main thread. Only takes
+	 * effect if the socket engine supports I/O threads. Changing this
+	 * requires a restart once the threads have been started.
+	 */
+	unsigned int IOThreads;
+
+	/** The number of threads, including the main thread, used to match X-lines against the
+	 * local users when lines are added or E-lines are checked. The lines are always applied
+	 * on the main thread.
+	 */
+	unsigned int XLineThreads;
+
 	/** If we should check for clones during CheckClass() in AddUser()
 	 * Setting this to false allows to not trigger on maxclones for users
 	 * that may belong to another class after DNS-lookup is complete.
@@ -99,3 +99,19 @@ template<typename TOut> inline TOut ConvToNum(const std::string& in)
 		return 0;
 	return ret;
 }
+
+/** Specialisation of ConvToNum so istringstream does not treat the input as a character literal.
+ */
+template<> inline char ConvToNum<char>(const std::string& in)
+{
+	int16_t num = ConvToNum<int16_t>(in);
+	return num >= INT8_MIN && num <= INT8_MAX ? num : 0;
+}
+
+/** Specialisation of ConvToNum so istringstream does not treat the input as a character literal.
+ */
+template<> inline unsigned char ConvToNum<unsigned char>(const std::string& in)
+{
+	uint16_t num = ConvToNum<uint16_t>(in);
+	return num <= UINT8_MAX ? num : 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Computes the Levenshtein distance between one string and many others using
+ * Myers' bit-parallel algorithm, which handles 64 characters of the pattern per
+ * machine word instead of filling in the whole dynamic programming matrix. The
+ * pattern is prepared once and can then be compared against any number of texts.
+ */
+class CoreExport EditDistance
+{
+ private:
+	/** The number of pattern characters handled by one word. */
+	static const size_t WORD_BITS = 64;
+
+	/** The pattern which texts are compared against. */
+	std::string pattern;
+
+	/** The number of words needed for the pattern. */
+	size_t blocks;
+
+	/** For every byte value, the bits of the positions in the pattern where it occurs. */
+	std::vector<uint64_t> peq;
+
+	/** The positive vertical deltas of the current column, one word per block. */
+	std::vector<uint64_t> pv;
+
+	/** The negative vertical deltas of the current column, one word per block. */
+	std::vector<uint64_t> mv;
+
+ public:
+	EditDistance();
+
+	/** Prepares a new pattern for comparing against.
+	 * @param Pattern The pattern to compare against. Bytes are compared exactly so
+	 * fold its case first if the comparison should be case insensitive.
+	 */
+	void SetPattern(const std::string& Pattern);
+
+	/** Retrieves the pattern which texts are compared against. */
+	const std::string& GetPattern() const { return pattern; }
+
+	/** Computes the edit distance between the pattern and a text. The computation stops
+	 * as soon as the distance is known to be larger than the maximum.
+	 * @param text The text to compare with the pattern.
+	 * @param max The largest distance which is of interest.
+	 * @return The edit distance if it is at most max; otherwise, max + 1.
+	 */
+	size_t Compute(const std::string& text, size_t max);
+};
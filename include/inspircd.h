@@ -42,6 +42,7 @@
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <string>
@@ -81,10 +82,11 @@ struct fakederef
 #include "numeric.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
+#include "wildcard.h"
 #include "logger.h"
 #include "usermanager.h"
 #include "socket.h"
@@ -144,6 +146,12 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long Recv;
+	/** Number of times a message was sent using an already serialized form
+	 */
+	unsigned long SerializeHits;
+	/** Number of times a message had to be serialized before it could be sent
+	 */
+	unsigned long SerializeMisses;
 #ifdef _WIN32
 	/** Cpu usage at last sample
 	*/
@@ -166,7 +174,7 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0), SerializeHits(0), SerializeMisses(0)
 	{
 	}
 };
@@ -113,9 +113,88 @@ class CoreExport StreamSocket : public EventHandler
 	class SendQueue
 	{
 	 public:
-		/** One element of the queue, a continuous buffer
+		/** One element of the queue, a continuous buffer.
+		 * Elements are immutable, reference counted slices of a buffer. The same buffer may be
+		 * referenced by the send queues of many sockets at once, for example when a message is
+		 * sent to all members of a channel; consuming bytes from the front of an element only
+		 * moves the start of the slice and never modifies or copies the underlying buffer.
 		 */
-		typedef std::string Element;
+		class Element
+		{
+		 public:
+			typedef std::string::size_type size_type;
+			typedef std::string::const_iterator const_iterator;
+
+			/** Create an element containing a copy of a string.
+			 * @param str String to copy.
+			 */
+			Element(const std::string& str)
+				: buf(std::make_shared<const std::string>(str))
+				, offset(0)
+			{
+			}
+
+			/** Create an element by taking ownership of the contents of a string.
+			 * @param str String to move into the element.
+			 */
+			Element(std::string&& str)
+				: buf(std::make_shared<const std::string>(std::move(str)))
+				, offset(0)
+			{
+			}
+
+			/** Create an element containing a copy of a buffer.
+			 * @param str Buffer to copy.
+			 * @param len Length of the buffer.
+			 */
+			Element(const char* str, size_type len)
+				: buf(std::make_shared<const std::string>(str, len))
+				, offset(0)
+			{
+			}
+
+			/** Create an element referencing a shared buffer without copying it.
+			 * @param shared Buffer to reference, must not be NULL.
+			 */
+			Element(const std::shared_ptr<const std::string>& shared)
+				: buf(shared)
+				, offset(0)
+			{
+			}
+
+			/** Get a pointer to the first byte of the element.
+			 * @return Pointer to the data in this element.
+			 */
+			const char* data() const { return buf->data() + offset; }
+
+			/** Get the number of bytes in the element.
+			 * @return Length of the element in bytes.
+			 */
+			size_type length() const { return buf->length() - offset; }
+
+			/** Check whether the element contains no data.
+			 * @return True if the element is empty, false otherwise.
+			 */
+			bool empty() const { return (length() == 0); }
+
+			/** Get an iterator to the first byte of the element. */
+			const_iterator begin() const { return buf->begin() + offset; }
+
+			/** Get an iterator to one past the last byte of the element. */
+			const_iterator end() const { return buf->end(); }
+
+			/** Remove bytes from the beginning of the element.
+			 * @param n Number of bytes to remove, must not be more than length().
+			 */
+			void erase_front(size_type n) { offset += n; }
+
+		 private:
+			/** The buffer this element is a slice of, possibly shared with other elements. */
+			std::shared_ptr<const std::string> buf;
+
+			/** Offset of the first byte of this element in buf. */
+			size_type offset;
+		};
 
 		/** Sequence container of buffers in the queue
 		 */
@@ -173,7 +252,7 @@ class CoreExport StreamSocket : public EventHandler
 		void erase_front(Element::size_type n)
 		{
 			nbytes -= n;
-			data.front().erase(0, n);
+			data.front().erase_front(n);
 		}
 
 		/** Insert a new buffer at the beginning of the queue
@@ -210,7 +289,7 @@ class CoreExport StreamSocket : public EventHandler
 		}
 
 	 private:
-	 	/** Private send queue. Note that individual strings may be shared.
+	 	/** Private send queue. Note that individual buffers may be shared.
 		 */
 		Container data;
 
@@ -219,6 +298,145 @@ class CoreExport StreamSocket : public EventHandler
 		size_t nbytes;
 	};
 
+	/** Socket receive queue.
+	 * A contiguous buffer which data is appended to at the end and consumed from at the front.
+	 * Consuming data only moves the start of the queue; the remaining data is moved to the front
+	 * of the buffer lazily, when the space it frees up is needed and moving is cheaper than the
+	 * data already consumed. Sockets read into the free space at the end of the buffer directly.
+	 */
+	class CoreExport RecvQueue
+	{
+	 public:
+		typedef std::string::size_type size_type;
+		typedef const char* const_iterator;
+		static const size_type npos = std::string::npos;
+
+		RecvQueue() : start(0), finish(0) { }
+
+		/** Get a pointer to the first byte in the queue.
+		 * The pointer is invalidated when data is added to the queue.
+		 * @return Pointer to the data in the queue.
+		 */
+		const char* data() const { return buf.data() + start; }
+
+		/** Get the number of bytes in the queue.
+		 * @return Length of the queue in bytes.
+		 */
+		size_type length() const { return finish - start; }
+
+		/** Get the number of bytes in the queue.
+		 * @return Length of the queue in bytes.
+		 */
+		size_type size() const { return length(); }
+
+		/** Check whether the queue is empty.
+		 * @return True if the queue is empty, false otherwise.
+		 */
+		bool empty() const { return (start == finish); }
+
+		/** Access a byte in the queue.
+		 * @param pos Position of the byte, must be less than length().
+		 * @return The byte at the given position.
+		 */
+		const char& operator[](size_type pos) const { return buf[start + pos]; }
+
+		/** Get an iterator to the first byte of the queue. */
+		const_iterator begin() const { return data(); }
+
+		/** Get an iterator to one past the last byte of the queue. */
+		const_iterator end() const { return buf.data() + finish; }
+
+		/** Find the first occurrence of a byte in the queue.
+		 * @param chr Byte to search for.
+		 * @param pos Position to start searching at.
+		 * @return Position of the byte or npos if it was not found.
+		 */
+		size_type find(char chr, size_type pos = 0) const
+		{
+			if (pos >= length())
+				return npos;
+			const char* const found = static_cast<const char*>(memchr(data() + pos, chr, length() - pos));
+			return (found ? found - data() : npos);
+		}
+
+		/** Find the first occurrence of a string in the queue.
+		 * @param str String to search for.
+		 * @param pos Position to start searching at.
+		 * @return Position of the string or npos if it was not found.
+		 */
+		size_type find(const std::string& str, size_type pos = 0) const
+		{
+			if (pos > length())
+				return npos;
+			const const_iterator found = std::search(begin() + pos, end(), str.begin(), str.end());
+			return (found != end() ? found - begin() : npos);
+		}
+
+		/** Add data to the end of the queue.
+		 * @param str Data to add.
+		 * @param len Length of the data.
+		 */
+		void append(const char* str, size_type len)
+		{
+			if (buf.size() - finish < len)
+				reserve(len);
+			memcpy(&buf[finish], str, len);
+			finish += len;
+		}
+
+		/** Add data to the end of the queue.
+		 * @param str Data to add.
+		 */
+		void append(const std::string& str) { append(str.data(), str.length()); }
+
+		/** Add a single byte to the end of the queue.
+		 * @param chr Byte to add.
+		 */
+		void push_back(char chr) { append(&chr, 1); }
+
+		/** Remove bytes from the beginning of the queue in constant time.
+		 * @param n Number of bytes to remove, must not be more than length().
+		 */
+		void erase_front(size_type n)
+		{
+			start += n;
+			if (start == finish)
+				start = finish = 0;
+		}
+
+		/** Remove all data from the queue. The buffer is kept for reuse.
+		 */
+		void clear() { start = finish = 0; }
+
+		/** Get the free space at the end of the queue so data can be written into it directly.
+		 * The queue is never grown by this method, but the data in it may be moved to the front
+		 * of the buffer if that is cheap. Call commit() after writing to add the data to the queue.
+		 * @param avail Set to the number of bytes which may be written to the returned pointer.
+		 * @return Pointer to the free space at the end of the queue.
+		 */
+		char* get_tail(size_type& avail);
+
+		/** Add data written to the space returned by get_tail() to the end of the queue.
+		 * @param n Number of bytes written, must not be more than the available space.
+		 */
+		void commit(size_type n) { finish += n; }
+
+		/** Ensure there is room for at least the given number of bytes at the end of the queue.
+		 * @param n Number of bytes to make room for.
+		 */
+		void reserve(size_type n);
+
+	 private:
+		/** Buffer holding the queue. Only bytes between start and finish are part of the queue. */
+		std::vector<char> buf;
+
+		/** Position of the first byte of the queue in buf. */
+		size_type start;
+
+		/** Position one past the last byte of the queue in buf. */
+		size_type finish;
+	};
+
 	/** The type of socket this IOHook represents. */
 	enum Type
 	{
@@ -256,7 +474,7 @@ class CoreExport StreamSocket : public EventHandler
 	 * @param rq Receive queue to put incoming data into
 	 * @return < 0 on error or close, 0 if no new data is ready (but the socket is still connected), > 0 if data was read from the socket and put into the recvq
 	 */
-	int ReadToRecvQ(std::string& rq);
+	int ReadToRecvQ(RecvQueue& rq);
 
 	/** Read data from a hook chain recursively, starting at 'hook'.
 	 * If 'hook' is NULL, the recvq is filled with data from SocketEngine::Recv(), otherwise it is filled with data from the
@@ -266,10 +484,10 @@ class CoreExport StreamSocket : public EventHandler
 	 * @return < 0 on error or close, 0 if no new data is ready (but the socket is still connected), > 0 if data was read from
 	 the socket and put into the recvq
 	 */
-	int HookChainRead(IOHook* hook, std::string& rq);
+	int HookChainRead(IOHook* hook, RecvQueue& rq);
 
  protected:
-	std::string recvq;
+	RecvQueue recvq;
  public:
 	const Type type;
 	StreamSocket(Type sstype = SS_UNKNOWN)
@@ -298,6 +516,14 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	void OnEventHandlerError(int errcode) override;
 
+	/** Called by the socket engine on the main thread with data read from the socket by an I/O thread.
+	 * See SocketEngine::DelegateRead().
+	 * @param data Data read from the socket.
+	 * @param length Length of the data, 0 if the connection was closed or on error.
+	 * @param errnum Error code if reading from the socket failed, 0 otherwise.
+	 */
+	void OnThreadedRead(const char* data, size_t length, int errnum);
+
 	/** Sets the error message for this socket. Once set, the socket is dead. */
 	void SetError(const std::string& err) { if (error.empty()) error = err; }
 
@@ -319,6 +545,12 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+
+	/** Send the given buffer out the socket, either now or when writes unblock.
+	 * The buffer is not copied, it is referenced by the send queue until it has been sent.
+	 * @param data Buffer to send.
+	 */
+	void WriteData(const SendQueue::Element& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
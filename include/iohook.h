@@ -99,7 +99,7 @@ class IOHook : public classbase
 	 * @return 1 if new data has been read, 0 if no new data is ready (but the
 	 *  socket is still connected), -1 if there was an error or close
 	 */
-	virtual int OnStreamSocketRead(StreamSocket* sock, std::string& recvq) = 0;
+	virtual int OnStreamSocketRead(StreamSocket* sock, StreamSocket::RecvQueue& recvq) = 0;
 };
 
 class IOHookMiddle : public IOHook
@@ -110,7 +110,7 @@ class IOHookMiddle : public IOHook
 
 	/** Data waiting to go up the chain
 	 */
-	std::string precvq;
+	StreamSocket::RecvQueue precvq;
 
 	/** Next IOHook in the chain
 	 */
@@ -120,7 +120,7 @@ class IOHookMiddle : public IOHook
 	/** Get all queued up data which has not yet been passed up the hook chain
 	 * @return RecvQ containing the data
 	 */
-	std::string& GetRecvQ() { return precvq; }
+	StreamSocket::RecvQueue& GetRecvQ() { return precvq; }
 
 	/** Get all queued up data which is ready to go down the hook chain
 	 * @return SendQueue containing all data waiting to go down the hook chain
@@ -0,0 +1,77 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Vectorized scanning of buffers for protocol delimiters such as line
+ * terminators and NUL bytes. The fastest implementation supported by the
+ * CPU (AVX2, SSE2 or plain C++) is chosen when the server starts. Searches
+ * for a single byte should use memchr() or std::string::find() instead.
+ */
+namespace LineScan
+{
+	/** Finds the first occurrence of any of up to four bytes in a buffer.
+	 * Unused delimiters should repeat one of the used ones.
+	 */
+	typedef const char* (*FindFunc)(const char* begin, const char* end, char a, char b, char c, char d);
+
+	/** A scanner implementation. */
+	struct Implementation
+	{
+		/** Name of the implementation, e.g. "avx2". */
+		const char* name;
+
+		/** The search function of the implementation. */
+		FindFunc find;
+	};
+
+	/** Retrieves every implementation which is supported by the CPU, slowest first.
+	 * @return A list of supported implementations.
+	 */
+	CoreExport const std::vector<Implementation>& GetSupported();
+
+	/** Retrieves the implementation used by Find().
+	 * @return The fastest implementation supported by the CPU.
+	 */
+	CoreExport const Implementation& GetBest();
+
+	/** Finds the first occurrence of any of up to four bytes in a buffer.
+	 * @param begin The start of the buffer.
+	 * @param end One past the end of the buffer.
+	 * @param a A byte to search for.
+	 * @param b Another byte to search for.
+	 * @param c Another byte to search for.
+	 * @param d Another byte to search for.
+	 * @return A pointer to the first matching byte or end if there is none.
+	 */
+	inline const char* Find(const char* begin, const char* end, char a, char b, char c, char d)
+	{
+		return GetBest().find(begin, end, a, b, c, d);
+	}
+
+	/** @copydoc Find(const char*, const char*, char, char, char, char) */
+	inline const char* Find(const char* begin, const char* end, char a, char b)
+	{
+		return Find(begin, end, a, b, b, b);
+	}
+
+	/** @copydoc Find(const char*, const char*, char, char, char, char) */
+	inline const char* Find(const char* begin, const char* end, char a, char b, char c)
+	{
+		return Find(begin, end, a, b, c, c);
+	}
+}
@@ -39,6 +39,70 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	typedef std::vector<ListItem> ModeList;
 
+	/** The items of a channel's list prepared for matching users against them in the same
+	 * way as Channel::CheckBan() does. Masks in nick!ident\@host form are indexed by their
+	 * host part and extbans are kept apart so they can be checked without going through
+	 * every item.
+	 */
+	class CoreExport MaskIndex
+	{
+	 private:
+		/** A nick!ident\@host mask which has been split at the '@'. */
+		struct Entry
+		{
+			WildcardMask nickident;
+			WildcardMask host;
+
+			Entry(const std::string& mask, std::string::size_type at)
+				: nickident(mask.substr(0, at))
+				, host(mask.substr(at + 1))
+			{
+			}
+		};
+
+		/** The case map which was in use when the index was built. */
+		unsigned const char* map;
+
+		/** The masks in nick!ident\@host form. */
+		std::vector<Entry> entries;
+
+		/** The masks in nick!ident\@host form whose host part is not a CIDR range, by host. */
+		WildcardIndex<const Entry*> hosts;
+
+		/** The masks in nick!ident\@host form whose host part might be a CIDR range. */
+		std::vector<const Entry*> cidrs;
+
+		/** Every item which is an extban. */
+		std::vector<std::string> extbans;
+
+	 public:
+		/** Prepares the items of a list for matching.
+		 * @param list The list to prepare.
+		 */
+		MaskIndex(const ModeList& list);
+
+		/** Determines whether a user matches any of the masks in nick!ident\@host form. This
+		 * gives the same result as Channel::CheckBan() does for each of them when no module
+		 * handles them in OnCheckBan.
+		 * @param user The user to match.
+		 * @return True if the user matches one of the masks; otherwise, false.
+		 */
+		bool Matches(User* user) const;
+
+		/** Determines whether a nick!ident and a host match any of the masks in nick!ident\@host form.
+		 * @param nickident The nick!ident to match.
+		 * @param host The host to match.
+		 * @return True if they match one of the masks; otherwise, false.
+		 */
+		bool Matches(const std::string& nickident, const std::string& host) const;
+
+		/** Retrieves the case map which was in use when the index was built. */
+		unsigned const char* GetMap() const { return map; }
+
+		/** Retrieves every item which is an extban. */
+		const std::vector<std::string>& GetExtBans() const { return extbans; }
+	};
+
  private:
 	class ChanData
 	{
@@ -46,9 +110,29 @@ class CoreExport ListModeBase : public ModeHandler
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** The generation of the list, changed every time an item is added or removed. */
+		uint64_t generation;
+
+		/** The list prepared for matching or NULL if it has not been prepared since it last changed. */
+		MaskIndex* index;
+
+		ChanData() : maxitems(-1), generation(++lastgeneration), index(NULL) { }
+		~ChanData() { delete index; }
+
+		/** Records a change to the list. */
+		void Changed()
+		{
+			generation = ++lastgeneration;
+			delete index;
+			index = NULL;
+		}
 	};
 
+	/** The last generation which was given to a list. Generations are unique across every list
+	 * so that a result for one list is never mistaken for a result for another.
+	 */
+	static uint64_t lastgeneration;
+
 	/** The number of items a listmode's list may contain
 	 */
 	struct ListLimit
@@ -136,6 +220,25 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Retrieves the generation of the list set on the given channel. The generation changes every
+	 * time an item is added to or removed from the list so it can be used to find out whether a
+	 * result which was worked out from the list is still valid.
+	 * @param channel Channel to get the generation of the list of
+	 * @return The generation of the list or 0 if the channel has no list
+	 */
+	uint64_t GetGeneration(Channel* channel);
+
+	/** Retrieves the list set on the given channel prepared for matching users against it.
+	 * @param channel Channel to get the list from
+	 * @return The prepared list or NULL if the channel has no list. It is valid until the list changes.
+	 */
+	const MaskIndex* GetMasks(Channel* channel);
+
+	/** Changes the generation of the list on every channel. This should be called when something
+	 * other than the lists themselves changes the results which were worked out from them.
+	 */
+	void ChangeGenerations();
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -220,3 +323,12 @@ inline ListModeBase::ModeList* ListModeBase::GetList(Channel* channel)
 
 	return &cd->list;
 }
+
+inline uint64_t ListModeBase::GetGeneration(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return 0;
+
+	return cd->generation;
+}
@@ -31,6 +31,8 @@ enum LogLevel
 	LOG_NONE    = 50
 };
 
+class LogWriterThread;
+
 /** Simple wrapper providing periodic flushing to a disk-backed file.
  */
 class CoreExport FileWriter
@@ -49,17 +51,22 @@ class CoreExport FileWriter
 	 */
 	unsigned int writeops;
 
+	/** The thread which writes to the log file or NULL if it is written to on the main thread.
+	 */
+	LogWriterThread* writer;
+
  public:
 	/** The constructor takes an already opened logfile.
+	 * @param logfile The log file to write to.
+	 * @param flushcount The number of write operations after which the file should be flushed.
+	 * @param async If true then lines are written to the file by the log writer thread.
 	 */
-	FileWriter(FILE* logfile, unsigned int flushcount);
+	FileWriter(FILE* logfile, unsigned int flushcount, bool async = false);
 
 	/** Write one or more preformatted log lines.
-	 * If the data cannot be written immediately,
-	 * this class will insert itself into the
-	 * SocketEngine, and register a write event,
-	 * and when the write event occurs it will
-	 * attempt again to write the data.
+	 * If the writer is asynchronous, the lines are queued for the log writer
+	 * thread, which writes them in batches and flushes the file after each
+	 * batch. If the queue is full the lines are dropped and counted.
 	 */
 	void WriteLogLine(const std::string &line);
 
@@ -107,7 +114,11 @@ class CoreExport LogStream : public classbase
 	/** Changes the loglevel for this LogStream on-the-fly.
 	 * This is needed for -nofork. But other LogStreams could use it to change loglevels.
 	 */
-	void ChangeLevel(LogLevel lvl) { this->loglvl = lvl; }
+	void ChangeLevel(LogLevel lvl);
+
+	/** Retrieves the lowest level of messages which this LogStream logs.
+	 */
+	LogLevel GetLevel() const { return loglvl; }
 
 	/** Called when there is stuff to log for this particular logstream. The derived class may take no action with it, or do what it
 	 * wants with the output, basically. loglevel and type are primarily for informational purposes (the level and type of the event triggered)
@@ -142,6 +153,22 @@ class CoreExport LogManager : public fakederef<LogManager>
 	 */
 	FileLogMap FileLogs;
 
+	/** The thread which writes to asynchronous log files or NULL if it has not been started.
+	 */
+	LogWriterThread* writer;
+
+	/** The lowest level which a LogStream logs for each type which has LogStreams of its own or is excluded from a global LogStream.
+	 */
+	std::map<std::string, LogLevel> TypeLevels;
+
+	/** The lowest level which a global LogStream logs, used for types which are not in TypeLevels.
+	 */
+	LogLevel GlobalLevel;
+
+	/** The lowest level which any LogStream logs.
+	 */
+	LogLevel MinLevel;
+
  public:
 	LogManager();
 	~LogManager();
@@ -181,9 +208,41 @@ class CoreExport LogManager : public fakederef<LogManager>
 
 	/** Removes all LogStreams, meaning they have to be readded for logging to continue.
 	 * Only LogStreams that were listed in AllLogStreams are actually closed.
+	 * Waits a bounded amount of time for asynchronous log files to be written out.
 	 */
 	void CloseLogs();
 
+	/** Retrieves the log writer thread, starting it if it is not running yet.
+	 */
+	LogWriterThread* GetWriter();
+
+	/** Writes out everything which was queued for asynchronous log files and stops the log writer thread.
+	 */
+	void StopWriter();
+
+	/** Retrieves the number of log lines which were dropped because the queue of the log writer thread was full.
+	 */
+	unsigned long GetDroppedLines() const;
+
+	/** Rebuilds the table of the lowest level logged for each type.
+	 * This is called whenever a LogStream is added, removed or has its level changed.
+	 */
+	void UpdateLevels();
+
+	/** Checks whether any LogStream logs messages of a level.
+	 * This is a single comparison so it can be used to skip building log messages which will not be logged.
+	 * @param loglevel The level of the message.
+	 * @return True if the message might be logged; otherwise, false.
+	 */
+	bool IsEnabled(LogLevel loglevel) const { return loglevel >= MinLevel; }
+
+	/** Checks whether any LogStream logs messages of a type and level.
+	 * @param type The type of the message.
+	 * @param loglevel The level of the message.
+	 * @return True if the message will be logged; otherwise, false.
+	 */
+	bool IsEnabled(const std::string& type, LogLevel loglevel) const;
+
 	/** Adds a single LogStream to multiple logtypes.
 	 * This automatically handles things like "* -USERINPUT -USEROUTPUT" to mean all but USERINPUT and USEROUTPUT types.
 	 * It is not a good idea to mix values of autoclose for the same LogStream.
@@ -226,3 +285,11 @@ class CoreExport LogManager : public fakederef<LogManager>
 	 */
 	void Log(const std::string &type, LogLevel loglevel, const char *fmt, ...) CUSTOM_PRINTF(4, 5);
 };
+
+/** Logs a message if any LogStream logs messages of its level, without evaluating the arguments otherwise.
+ * Use this instead of calling LogManager::Log() directly for frequent debug messages.
+ */
+#define LOG_IF_ENABLED(type, level, ...) do { \
+	if (ServerInstance->Logs->IsEnabled(level)) \
+		ServerInstance->Logs->Log(type, level, __VA_ARGS__); \
+} while (false)
@@ -54,6 +54,21 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 */
 	Id id;
 
+	/** The generation of the ban list of the channel which #banned was worked out for or 0 if
+	 * it has not been worked out. Only used by Channel::IsBanned().
+	 */
+	uint64_t bangeneration;
+
+	/** The User::maskgeneration of the user which #banned was worked out for. Only used by
+	 * Channel::IsBanned().
+	 */
+	unsigned long banmaskgeneration;
+
+	/** Whether the user matches a ban which is not an extban. Only valid if #bangeneration
+	 * and #banmaskgeneration are current.
+	 */
+	bool banned;
+
 	/** Converts a string to a Membership::Id
 	 * @param str The string to convert
 	 * @return Raw value of type Membership::Id
@@ -68,7 +83,7 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 * Call Channel::JoinUser() or ForceJoin() to make a user join a channel instead of constructing
 	 * Membership objects directly.
 	 */
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c) : user(u), chan(c), bangeneration(0), banmaskgeneration(0), banned(false) {}
 
 	/** Check if this member has a given prefix mode set
 	 * @param pm Prefix mode to check
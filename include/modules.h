@@ -805,7 +805,11 @@ class CoreExport Module : public classbase, public usecountbase
 	virtual ModResult OnCheckChannelBan(User* user, Channel* chan);
 
 	/**
-	 * Checks for a user's match of a single ban
+	 * Checks for a user's match of a single ban. When checking whether a user is banned from a
+	 * channel this is only called for extbans; bans in nick!ident\@host form are matched by the
+	 * core against the user's nick, ident, real host, displayed host and IP address without
+	 * calling it. Modules which want normal bans to match other things should use
+	 * OnCheckChannelBan instead.
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
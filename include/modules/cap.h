@@ -210,6 +210,9 @@ namespace Cap
 				return;
 			Ext curr = extitem->get(user);
 			extitem->set(user, (val ? AddToMask(curr) : DelFromMask(curr)));
+			LocalUser* const localuser = IS_LOCAL(user);
+			if (localuser)
+				ClientProtocol::Serializer::InvalidateTagCache(localuser);
 		}
 
 		/** Activate or deactivate the capability.
@@ -31,6 +31,8 @@ namespace DNS
 		QUERY_A = 1,
 		/* A CNAME lookup */
 		QUERY_CNAME = 5,
+		/* Start of authority, only used for the TTL of negative answers */
+		QUERY_SOA = 6,
 		/* Reverse DNS lookup */
 		QUERY_PTR = 12,
 		/* TXT */
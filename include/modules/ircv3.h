@@ -75,6 +75,11 @@ class IRCv3::CapTag : public ClientProtocol::MessageTagProvider
 		return cap.get(user);
 	}
 
+	bool IsCacheable() const override
+	{
+		return true;
+	}
+
 	void OnClientProtocolPopulateTags(ClientProtocol::Message& msg) override
 	{
 		T& tag = static_cast<T&>(*this);
@@ -168,11 +168,12 @@ class SSLIOHook : public IOHook
 		tmp.reserve(std::min(targetsize, sendq.bytes())+1);
 		do
 		{
-			tmp.append(sendq.front());
+			const StreamSocket::SendQueue::Element& front = sendq.front();
+			tmp.append(front.data(), front.length());
 			sendq.pop_front();
 		}
 		while (!sendq.empty() && tmp.length() < targetsize);
-		sendq.push_front(tmp);
+		sendq.push_front(std::move(tmp));
 	}
 
  public:
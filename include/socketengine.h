@@ -37,6 +37,8 @@
 #define IOV_MAX 1024
 #endif
 
+class StreamSocket;
+
 /**
  * Event mask for SocketEngine events
  */
@@ -232,7 +234,7 @@ class CoreExport SocketEngine
 		/** Constructor, initializes member vars except indata and outdata because those are set to 0
 		 * in CheckFlush() the first time Update() or GetBandwidth() is called.
 		 */
-		Statistics() : lastempty(0), TotalEvents(0), ReadEvents(0), WriteEvents(0), ErrorEvents(0) { }
+		Statistics() : lastempty(0), TotalEvents(0), ReadEvents(0), WriteEvents(0), ErrorEvents(0), MaskChanges(0), MaskUpdates(0) { }
 
 		/** Update counters for network data received.
 		 * This should be called after every read-type syscall.
@@ -259,6 +261,17 @@ class CoreExport SocketEngine
 		unsigned long ReadEvents;
 		unsigned long WriteEvents;
 		unsigned long ErrorEvents;
+
+		/** Number of event mask changes which required the kernel to be told about them.
+		 * Only counted by socket engines which defer telling the kernel about changes.
+		 */
+		unsigned long MaskChanges;
+
+		/** Number of system calls made to apply the event mask changes counted in MaskChanges.
+		 * Changes to the same file descriptor in a single loop iteration are coalesced into
+		 * at most one system call, so the difference between the two is the number of saved calls.
+		 */
+		unsigned long MaskUpdates;
 	};
 
  private:
@@ -294,6 +307,11 @@ class CoreExport SocketEngine
 
 	static void DelFdRef(EventHandler* eh);
 
+	/** Pass the data read by the I/O threads to the sockets it was read from.
+	 * Only used by socket engines which support I/O threads.
+	 */
+	static void DispatchThreadedReads();
+
 	template <typename T>
 	static void ResizeDouble(std::vector<T>& vect)
 	{
@@ -370,6 +388,19 @@ public:
 	 */
 	static void DelFd(EventHandler* eh);
 
+	/** Hand reading from a stream socket over to an I/O thread.
+	 * From then on the socket is only read from by the I/O thread which passes the data
+	 * it reads back to the main thread where it is given to StreamSocket::OnThreadedRead().
+	 * Only the recv() calls move to the I/O thread; the data is still split into lines and
+	 * the socket is still written to on the main thread.
+	 * The socket must not have an IOHook and no IOHook may be added to it afterwards.
+	 * Reading goes back to normal when the socket is removed from the socket engine.
+	 * @param sock The socket to hand over.
+	 * @return True if an I/O thread now reads from the socket, false if the socket engine
+	 * does not support I/O threads or they are disabled in the config.
+	 */
+	static bool DelegateRead(StreamSocket* sock);
+
 	/** Returns true if a file descriptor exists in
 	 * the socket engine's list.
 	 * @param fd The event handler to look for
@@ -456,6 +487,16 @@ public:
 	static int WriteV(EventHandler* fd, const iovec* iov, int count);
 #endif
 
+	/** Abstraction for vector read function readv().
+	 * This function should emulate its namesake system call exactly.
+	 * @param fd EventHandler to read data with
+	 * @param iov Array of IOVectors describing the buffers to read into and their lengths in the
+	 * platform's native format.
+	 * @param count Number of elements in iov.
+	 * @return This method should return exactly the same values as the system call it emulates.
+	 */
+	static int ReadV(EventHandler* fd, const IOVector* iov, int count);
+
 	/** Abstraction for BSD sockets recv(2).
 	 * This function should emulate its namesake system call exactly.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
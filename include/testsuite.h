@@ -31,6 +31,11 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoLineScanTests();
+	bool DoWildcardMaskTests();
+	bool DoTimerTests();
+	bool DoLogLevelTests();
+	bool DoEditDistanceTests();
 };
 
 #endif
@@ -23,30 +23,45 @@
 
 class Module;
 
-/** Timer class for one-second resolution timers
+/** Timer class for one-shot and repeating timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
  * can be made to trigger at any time up to a one-second
- * resolution. To use Timer, inherit a class from
+ * resolution, or a finer resolution by using SetIntervalMs().
+ * To use Timer, inherit a class from
  * Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
  * at the given time.
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
 	/** The triggering time
 	 */
 	time_t trigger;
 
+	/** The triggering time in milliseconds on the monotonic clock (see TimerManager::GetMilliseconds())
+	 */
+	uint64_t deadline;
+
 	/** Number of seconds between triggers
 	 */
 	unsigned int secs;
 
+	/** Number of milliseconds between triggers
+	 */
+	unsigned long msecs;
+
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** The list in the timer wheel which this timer is in or NULL if it is not scheduled
+	 */
+	insp::intrusive_list<Timer>* slot;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -69,20 +84,25 @@ class CoreExport Timer
 	 * This does not update the bookkeeping in TimerManager, use SetInterval()
 	 * to change the interval between ticks while keeping TimerManager updated
 	 */
-	void SetTrigger(time_t nexttrigger)
-	{
-		trigger = nexttrigger;
-	}
+	void SetTrigger(time_t nexttrigger);
 
 	/** Sets the interval between two ticks.
 	 */
 	void SetInterval(unsigned int interval);
 
+	/** Sets the interval between two ticks in milliseconds.
+	 * Like SetInterval(), this (re)schedules the timer.
+	 */
+	void SetIntervalMs(unsigned long interval);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
 	 * @param TIME The current time.
 	 * @return True if the Timer object is still valid, false if it was destructed.
+	 * When a repeating timer returns true it is scheduled to tick again after its interval,
+	 * which Tick() may change with SetInterval() or SetIntervalMs(). A timer which is not
+	 * repeating only ticks again if Tick() calls one of those.
 	 */
 	virtual bool Tick(time_t TIME) = 0;
 
@@ -101,6 +121,14 @@ class CoreExport Timer
 		return secs;
 	}
 
+	/** Returns the interval in milliseconds between ticks
+	 * of this timer object.
+	 */
+	unsigned long GetIntervalMs() const
+	{
+		return msecs;
+	}
+
 	/** Cancels the repeat state of a repeating timer.
 	 * If you call this method, then the next time your
 	 * timer ticks, it will be removed immediately after.
@@ -114,17 +142,103 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel. The first level has a slot for
+ * every tick of TICK_MS milliseconds in the near future and each further level has
+ * slots which cover a whole turn of the level below it. Adding and removing a timer
+ * takes constant time; timers in the higher levels are moved down a level whenever
+ * the level below them has turned once.
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+ public:
+	/** The number of milliseconds in a tick of the timer wheel. */
+	static const unsigned int TICK_MS = 10;
+
+	/** Timer statistics
+	 */
+	struct Statistics
+	{
+		/** Number of timers which were added. */
+		unsigned long Added;
+
+		/** Number of timers which were removed before they ticked. */
+		unsigned long Cancelled;
+
+		/** Number of times Timer::Tick() was called. */
+		unsigned long Fired;
+
+		/** Number of times a timer was moved down a level of the wheel. */
+		unsigned long Cascaded;
+
+		/** Number of calls to TickTimers() which ticked at least one timer. */
+		unsigned long Runs;
 
-	/** A list of all pending timers
+		/** Total time spent in those calls in microseconds. */
+		unsigned long long RunTime;
+
+		/** The longest time spent in one of those calls in microseconds. */
+		unsigned long long MaxRunTime;
+
+		Statistics() : Added(0), Cancelled(0), Fired(0), Cascaded(0), Runs(0), RunTime(0), MaxRunTime(0) { }
+	};
+
+ private:
+	typedef insp::intrusive_list<Timer> TimerList;
+
+	/** The number of bits of the tick number which index the first level of the wheel. */
+	static const unsigned int ROOT_BITS = 8;
+
+	/** The number of bits of the tick number which index each further level of the wheel. */
+	static const unsigned int LEVEL_BITS = 6;
+
+	/** The number of levels above the first one. */
+	static const unsigned int LEVELS = 3;
+
+	static const unsigned int ROOT_SIZE = 1 << ROOT_BITS;
+	static const unsigned int LEVEL_SIZE = 1 << LEVEL_BITS;
+
+	/** The slots of the first level, one per tick. */
+	TimerList root[ROOT_SIZE];
+
+	/** The slots of the further levels. */
+	TimerList levels[LEVELS][LEVEL_SIZE];
+
+	/** The next tick which has not been run yet. */
+	uint64_t current;
+
+	/** Whether current has been set. */
+	bool started;
+
+	/** The number of scheduled timers. */
+	size_t count;
+
+	/** Timer statistics. */
+	Statistics stats;
+
+	/** Retrieves the current time in ticks. */
+	static uint64_t GetTick();
+
+	/** Reschedules every timer relative to the given tick instead of running each tick in between.
+	 * @param now The tick to move the wheel to.
+	 */
+	void Resync(uint64_t now);
+
+	/** Puts a timer in the slot of the wheel for its deadline. */
+	void Schedule(Timer* t);
+
+	/** Moves all timers in a slot of a higher level down to the levels below it.
+	 * @param level The level to move the timers from.
+	 * @param index The index of the slot in the level.
+	 * @return The index of the slot.
 	 */
-	TimerMap Timers;
+	unsigned int Cascade(unsigned int level, unsigned int index);
 
  public:
-	/** Tick all pending Timers
+	TimerManager();
+
+	/** Tick all pending Timers. Repeating timers whose Tick() returns true are scheduled
+	 * again after their interval, see Timer::Tick().
 	 * @param TIME the current system time
 	 */
 	void TickTimers(time_t TIME);
@@ -138,4 +252,22 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Retrieves the number of milliseconds until the next timer might be due.
+	 * Socket engines use this to wake up in time for timers with sub-second intervals.
+	 * @param max The maximum number of milliseconds to return.
+	 * @return The number of milliseconds to wait, at most max.
+	 */
+	int GetTimeout(int max) const;
+
+	/** Retrieves the current time in milliseconds on a monotonic clock. Timers are scheduled
+	 * using this so that steps of the system clock do not make them tick early or stall.
+	 */
+	static uint64_t GetMilliseconds();
+
+	/** Retrieves the number of scheduled timers. */
+	size_t GetCount() const { return count; }
+
+	/** Retrieves the timer statistics. */
+	const Statistics& GetStats() const { return stats; }
 };
@@ -61,6 +61,10 @@ namespace ClientProtocol
 	typedef std::vector<std::string> ParamList;
 	typedef std::string SerializedMessage;
 
+	/** A serialized message which can be referenced by the send queues of many users without being copied.
+	 */
+	typedef std::shared_ptr<const SerializedMessage> SharedSerializedMessage;
+
 	struct MessageTagData
 	{
 		MessageTagProvider* tagprov;
@@ -70,6 +74,37 @@ namespace ClientProtocol
 		MessageTagData(MessageTagProvider* prov, const std::string& val, void* data = NULL);
 	};
 
+	/** Results of MessageTagProvider::ShouldSendTag() cached for a single user.
+	 * Only providers which are cacheable (see MessageTagProvider::IsCacheable()) have entries.
+	 */
+	struct TagWhitelistCache
+	{
+		typedef std::vector<std::pair<const MessageTagProvider*, bool> > EntryList;
+
+		/** Entries are valid if this equals the generation of the serializer tag cache. */
+		unsigned long generation;
+
+		/** Providers and whether the user gets tags from them. */
+		EntryList entries;
+
+		/** The providers of the tags of the last message a whitelist was made for, in the order of
+		 * the tags. Empty if any of them is not cacheable.
+		 */
+		std::vector<const MessageTagProvider*> lastproviders;
+
+		/** The whitelist which was made for that message (see TagSelection::GetMask()). */
+		unsigned long long lastmask;
+
+		TagWhitelistCache() : generation(0), lastmask(0) { }
+
+		/** Forgets all cached results. */
+		void Clear()
+		{
+			entries.clear();
+			lastproviders.clear();
+		}
+	};
+
 	/** Map of message tag values and providers keyed by their name.
 	 * Sorted in descending order to ensure tag names beginning with symbols (such as '+') come later when iterating
 	 * the container than tags with a normal name.
@@ -351,6 +351,11 @@ class CoreExport User : public Extensible
 	 */
 	unsigned int quitting:1;
 
+	/** Incremented every time the cached nick, ident, host or IP address values of this user are
+	 * invalidated. Results which depend on these can be cached until this changes.
+	 */
+	unsigned long maskgeneration;
+
 	/** What type of user is this? */
 	const UserType usertype:2;
 
@@ -616,7 +621,41 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
 	 * @param data The data to add to the write buffer
 	 */
-	void AddWriteBuf(const std::string &data);
+	void AddWriteBuf(const StreamSocket::SendQueue::Element& data);
+};
+
+/** Checks the ping and registration timeouts of a local user and processes the commands
+ * they sent which were held back by fake lag. Each local user has one of these repeating
+ * timers and its interval is set to the time until the user next needs attention, so users
+ * who are idle cost nothing until they are due to be pinged.
+ */
+class CoreExport LocalUserTimer : public Timer
+{
+	LocalUser* const user;
+
+	/** The time at which held back commands should be processed or 0 if there are none. */
+	time_t replay;
+
+	/** Checks the timeouts of the user and processes their held back commands if they are due.
+	 * @param currtime The current time.
+	 * @return True if the user is still connected; otherwise, false.
+	 */
+	bool Check(time_t currtime);
+
+ public:
+	LocalUserTimer(LocalUser* me);
+
+	bool Tick(time_t currtime) override;
+
+	/** Schedules the timer for the next time the user needs attention.
+	 * This must be called when the ping time of the user is brought forward.
+	 */
+	void Reschedule();
+
+	/** Processes the commands which were held back at the given time.
+	 * @param when The time at which to process the held back commands.
+	 */
+	void Replay(time_t when);
 };
 
 typedef unsigned int already_sent_t;
@@ -624,9 +663,9 @@ typedef unsigned int already_sent_t;
 class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
 {
 	/** Add a serialized message to the send queue of the user.
-	 * @param serialized Bytes to add.
+	 * @param serialized Bytes to add. The message is referenced by the send queue, not copied.
 	 */
-	void Write(const ClientProtocol::SerializedMessage& serialized);
+	void Write(const ClientProtocol::SharedSerializedMessage& serialized);
 
 	/** Send a protocol event to the user, consisting of one or more messages.
 	 * @param protoev Event to send, may contain any number of messages.
@@ -649,6 +688,10 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	ClientProtocol::Serializer* serializer;
 
+	/** Cached message tag whitelist of the user, maintained by the serializer.
+	 */
+	ClientProtocol::TagWhitelistCache tagwlcache;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -716,12 +759,26 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	time_t idle_lastmsg;
 
 	/** This value contains how far into the penalty threshold the user is.
-	 * This is used either to enable fake lag or for excess flood quits
+	 * This is used either to enable fake lag or for excess flood quits.
+	 * It is only reduced when DecayPenalty() is called.
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** The time at which CommandFloodPenalty was last reduced.
+	 */
+	time_t lastdecay;
+
+	/** Times out the user and processes their held back commands.
+	 */
+	LocalUserTimer timer;
+
 	already_sent_t already_sent;
 
+	/** Reduces CommandFloodPenalty by the command rate of the connect class of the user for
+	 * every second since it was last reduced.
+	 */
+	void DecayPenalty();
+
 	/** Check if the user matches a G- or K-line, and disconnect them if they do.
 	 * @param doZline True if Z-lines should be checked (if IP has changed since initial connect)
 	 * Returns true if the user matched a ban, false else.
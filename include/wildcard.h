@@ -0,0 +1,266 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** A glob mask which has been prepared for being matched against many strings. The
+ * literal text at the start and end of the mask is extracted when it is created so
+ * most strings which do not match can be rejected without walking the whole mask.
+ * Matching gives the same result as InspIRCd::Match() with the same case map.
+ */
+class CoreExport WildcardMask
+{
+ private:
+	/** The mask as it was given. */
+	std::string mask;
+
+	/** The case map which is used to compare characters. */
+	unsigned const char* map;
+
+	/** The literal text at the start of the mask, case folded using the map. */
+	std::string prefix;
+
+	/** The literal text at the end of the mask after the last wildcard, case folded using the map. */
+	std::string suffix;
+
+	/** The minimum length of a string which can match the mask. */
+	size_t minlength;
+
+	/** Whether the mask contains a '*' and can therefore match strings longer than minlength. */
+	bool variable;
+
+	/** Whether the mask contains a '/' and might therefore be a CIDR range. */
+	bool cidr;
+
+ public:
+	/** Prepares a mask for matching.
+	 * @param Mask The mask to prepare.
+	 * @param Map The case map to compare with or NULL for the national_case_insensitive_map
+	 * which is in use when the mask is prepared.
+	 */
+	WildcardMask(const std::string& Mask, unsigned const char* Map = NULL);
+
+	/** Determines whether a string matches the mask.
+	 * @param str The string to match.
+	 * @return True if the string matches; otherwise, false.
+	 */
+	bool Match(const std::string& str) const;
+
+	/** Determines whether a string matches the mask, treating it as a CIDR range if it is one.
+	 * This is equivalent to InspIRCd::MatchCIDR().
+	 * @param str The string to match.
+	 * @return True if the string matches; otherwise, false.
+	 */
+	bool MatchCIDR(const std::string& str) const;
+
+	/** Retrieves the mask as it was given. */
+	const std::string& GetMask() const { return mask; }
+
+	/** Retrieves the case map which is used to compare characters. */
+	unsigned const char* GetMap() const { return map; }
+
+	/** Retrieves the case folded literal text at the start of the mask. */
+	const std::string& GetPrefix() const { return prefix; }
+
+	/** Retrieves the case folded literal text at the end of the mask. */
+	const std::string& GetSuffix() const { return suffix; }
+
+	/** Determines whether the mask might be a CIDR range. */
+	bool IsCIDR() const { return cidr; }
+};
+
+/** A set of wildcard masks which can be searched for the ones matching a string without
+ * trying every mask in turn. Masks are grouped by their literal prefix or suffix (up to
+ * KEY_LENGTH characters of it, whichever is longer) so a search only tries the masks which
+ * share a prefix or suffix with the string and the ones which have neither. Every mask in
+ * the set has to use the same case map as the set. The masks are not owned by the set.
+ */
+template<typename T>
+class WildcardIndex
+{
+ public:
+	/** The maximum number of characters of a literal prefix or suffix which are used as a key. */
+	static const size_t KEY_LENGTH = 32;
+
+ private:
+	typedef std::pair<const WildcardMask*, T> Entry;
+	typedef std::vector<Entry> EntryList;
+	typedef std::unordered_map<std::string, EntryList> EntryMap;
+
+	/** A group of masks which are keyed by one end of their literal text. */
+	struct Side
+	{
+		/** Masks by the case folded key. */
+		EntryMap entries;
+
+		/** The number of masks with each key length. */
+		size_t lengths[KEY_LENGTH + 1];
+
+		Side()
+		{
+			std::fill(lengths, lengths + KEY_LENGTH + 1, 0);
+		}
+	};
+
+	/** The case map which is used to fold keys. */
+	unsigned const char* map;
+
+	/** Masks keyed by their literal prefix. */
+	Side prefixes;
+
+	/** Masks keyed by their literal suffix. */
+	Side suffixes;
+
+	/** Masks which have no literal text at either end. */
+	EntryList others;
+
+	/** The number of masks in the index. */
+	size_t count;
+
+	/** Retrieves the list a mask is stored in.
+	 * @param mask The mask to look up.
+	 * @param create Whether to create the list if it does not exist.
+	 * @return The list or NULL if it does not exist and create is false.
+	 */
+	EntryList* GetList(const WildcardMask& mask, bool create)
+	{
+		const std::string& prefix = mask.GetPrefix();
+		const std::string& suffix = mask.GetSuffix();
+		if (prefix.empty() && suffix.empty())
+			return &others;
+
+		const bool useprefix = prefix.length() >= suffix.length();
+		Side& side = useprefix ? prefixes : suffixes;
+		const size_t keylength = std::min(useprefix ? prefix.length() : suffix.length(), KEY_LENGTH);
+		const std::string key = useprefix ? prefix.substr(0, keylength) : suffix.substr(suffix.length() - keylength);
+
+		typename EntryMap::iterator it = side.entries.find(key);
+		if (it != side.entries.end())
+			return &it->second;
+		if (!create)
+			return NULL;
+
+		side.lengths[keylength]++;
+		return &side.entries[key];
+	}
+
+	/** Removes an empty list from the index.
+	 * @param mask A mask which was stored in the list.
+	 */
+	void EraseList(const WildcardMask& mask)
+	{
+		const std::string& prefix = mask.GetPrefix();
+		const std::string& suffix = mask.GetSuffix();
+		if (prefix.empty() && suffix.empty())
+			return;
+
+		const bool useprefix = prefix.length() >= suffix.length();
+		Side& side = useprefix ? prefixes : suffixes;
+		const size_t keylength = std::min(useprefix ? prefix.length() : suffix.length(), KEY_LENGTH);
+		if (side.entries.erase(useprefix ? prefix.substr(0, keylength) : suffix.substr(suffix.length() - keylength)))
+			side.lengths[keylength]--;
+	}
+
+	/** Appends the values of the masks in a list which match a string. */
+	static void FindIn(const EntryList& list, const std::string& str, std::vector<T>& values)
+	{
+		for (typename EntryList::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			if (i->first->Match(str))
+				values.push_back(i->second);
+		}
+	}
+
+ public:
+	/** Creates an empty index.
+	 * @param Map The case map which the masks in the index use or NULL for national_case_insensitive_map.
+	 */
+	WildcardIndex(unsigned const char* Map = NULL)
+		: map(Map ? Map : national_case_insensitive_map)
+		, count(0)
+	{
+	}
+
+	/** Adds a mask to the index.
+	 * @param mask The mask to add. It must outlive its entry in the index.
+	 * @param value The value to return when the mask matches.
+	 */
+	void Add(const WildcardMask& mask, T value)
+	{
+		GetList(mask, true)->push_back(std::make_pair(&mask, value));
+		count++;
+	}
+
+	/** Removes a mask from the index.
+	 * @param mask The mask to remove.
+	 * @param value The value which the mask was added with.
+	 * @return True if the mask was removed; otherwise, false.
+	 */
+	bool Remove(const WildcardMask& mask, T value)
+	{
+		EntryList* list = GetList(mask, false);
+		if (!list || !stdalgo::vector::swaperase(*list, std::make_pair(&mask, value)))
+			return false;
+
+		count--;
+		if (list->empty())
+			EraseList(mask);
+		return true;
+	}
+
+	/** Finds every mask in the index which matches a string.
+	 * @param str The string to match.
+	 * @param values The list to append the values of the matching masks to.
+	 */
+	void Find(const std::string& str, std::vector<T>& values) const
+	{
+		std::string key;
+		const size_t maxlength = std::min(str.length(), KEY_LENGTH);
+		for (size_t length = 1; length <= maxlength; ++length)
+		{
+			if (prefixes.lengths[length])
+			{
+				key.resize(length);
+				for (size_t i = 0; i < length; ++i)
+					key[i] = map[static_cast<unsigned char>(str[i])];
+
+				typename EntryMap::const_iterator it = prefixes.entries.find(key);
+				if (it != prefixes.entries.end())
+					FindIn(it->second, str, values);
+			}
+
+			if (suffixes.lengths[length])
+			{
+				key.resize(length);
+				const size_t start = str.length() - length;
+				for (size_t i = 0; i < length; ++i)
+					key[i] = map[static_cast<unsigned char>(str[start + i])];
+
+				typename EntryMap::const_iterator it = suffixes.entries.find(key);
+				if (it != suffixes.entries.end())
+					FindIn(it->second, str, values);
+			}
+		}
+		FindIn(others, str, values);
+	}
+
+	/** Retrieves the number of masks in the index. */
+	size_t size() const { return count; }
+
+	/** Determines whether the index is empty. */
+	bool empty() const { return !count; }
+};
@@ -120,6 +120,28 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Retrieves the IP address range which a user has to be within for this line to
+	 * match them. Lines which have one are looked up by the address of the user rather
+	 * than being checked against every user in turn.
+	 * @param range The location to store the range in.
+	 * @return True if the line can only match users within the range; otherwise, false.
+	 */
+	virtual bool GetRange(irc::sockets::cidr_mask& range) { return false; }
+
+	/** Retrieves the mask which the host or IP address of a user has to match for this
+	 * line to match them. Lines which have one are looked up by the host of the user
+	 * rather than being checked against every user in turn.
+	 * @return The host mask or NULL if the line can not be looked up by host.
+	 */
+	virtual const WildcardMask* GetHostMask() { return NULL; }
+
+	/** Determines whether Matches(User*) can be called for different users on several threads
+	 * at once. It must then only read from the line and the user. Lines which are not thread
+	 * safe are only ever matched on the main thread.
+	 * @return True if the line can be matched on several threads at once; otherwise, false.
+	 */
+	virtual bool IsThreadSafe() { return false; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -167,6 +189,7 @@ class CoreExport KLine : public XLine
 	 */
 	KLine(time_t s_time, unsigned long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host)
 		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -182,10 +205,16 @@ class CoreExport KLine : public XLine
 
 	bool Matches(const std::string& str) override;
 
+	bool IsThreadSafe() override { return true; }
+
 	void Apply(User* u) override;
 
 	const std::string& Displayable() override;
 
+	bool GetRange(irc::sockets::cidr_mask& range) override;
+
+	const WildcardMask* GetHostMask() override;
+
 	bool IsBurstable() override;
 
 	/** Ident mask (ident part only)
@@ -195,6 +224,13 @@ class CoreExport KLine : public XLine
 	 */
 	std::string hostmask;
 
+	/** Ident mask prepared for matching
+	 */
+	WildcardMask identpattern;
+	/** Host mask prepared for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -213,6 +249,7 @@ class CoreExport GLine : public XLine
 	 */
 	GLine(time_t s_time, unsigned long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host)
 		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -228,10 +265,16 @@ class CoreExport GLine : public XLine
 
 	bool Matches(const std::string& str) override;
 
+	bool IsThreadSafe() override { return true; }
+
 	void Apply(User* u)  override;
 
 	const std::string& Displayable() override;
 
+	bool GetRange(irc::sockets::cidr_mask& range) override;
+
+	const WildcardMask* GetHostMask() override;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -239,6 +282,13 @@ class CoreExport GLine : public XLine
 	 */
 	std::string hostmask;
 
+	/** Ident mask prepared for matching
+	 */
+	WildcardMask identpattern;
+	/** Host mask prepared for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -257,6 +307,7 @@ class CoreExport ELine : public XLine
 	 */
 	ELine(time_t s_time, unsigned long d, const std::string& src, const std::string& re, const std::string& ident, const std::string& host)
 		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -270,12 +321,18 @@ class CoreExport ELine : public XLine
 
 	bool Matches(const std::string& str) override;
 
+	bool IsThreadSafe() override { return true; }
+
 	void Unset() override;
 
 	void OnAdd() override;
 
 	const std::string& Displayable() override;
 
+	bool GetRange(irc::sockets::cidr_mask& range) override;
+
+	const WildcardMask* GetHostMask() override;
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -283,6 +340,13 @@ class CoreExport ELine : public XLine
 	 */
 	std::string hostmask;
 
+	/** Ident mask prepared for matching
+	 */
+	WildcardMask identpattern;
+	/** Host mask prepared for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -313,10 +377,14 @@ class CoreExport ZLine : public XLine
 
 	bool Matches(const std::string& str) override;
 
+	bool IsThreadSafe() override { return true; }
+
 	void Apply(User* u) override;
 
 	const std::string& Displayable() override;
 
+	bool GetRange(irc::sockets::cidr_mask& range) override;
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -348,6 +416,8 @@ class CoreExport QLine : public XLine
 
 	bool Matches(const std::string& str) override;
 
+	bool IsThreadSafe() override { return true; }
+
 	void Apply(User* u) override;
 
 	const std::string& Displayable() override;
@@ -399,6 +469,55 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** A binary radix tree of X-lines keyed on the IP address range that they match. Finding
+ * the lines which might match an address takes time proportional to the length of the
+ * address rather than to the number of lines in the tree.
+ */
+class CoreExport XLineTrie
+{
+ private:
+	struct Node;
+
+	/** The roots of the trees for IPv4 and IPv6 addresses. */
+	Node* roots[2];
+
+	/** The number of lines in the tree. */
+	size_t count;
+
+	/** Retrieves the root of the tree for an address family.
+	 * @param family The address family to retrieve the root for.
+	 * @return The root of the tree or NULL if the address family is not supported.
+	 */
+	Node** GetRoot(int family);
+
+ public:
+	XLineTrie();
+	~XLineTrie();
+
+	/** Adds a line to the tree.
+	 * @param range The address range that the line matches.
+	 * @param line The line to add.
+	 * @return True if the line was added; otherwise, false.
+	 */
+	bool Add(const irc::sockets::cidr_mask& range, XLine* line);
+
+	/** Removes a line from the tree.
+	 * @param range The address range that the line was added with.
+	 * @param line The line to remove.
+	 * @return True if the line was removed; otherwise, false.
+	 */
+	bool Remove(const irc::sockets::cidr_mask& range, XLine* line);
+
+	/** Finds every line which was added with a range that contains an address.
+	 * @param addr The address to look up.
+	 * @param lines The list to append the lines to, broadest range first.
+	 */
+	void Find(const irc::sockets::sockaddrs& addr, std::vector<XLine*>& lines);
+
+	/** Retrieves the number of lines in the tree. */
+	size_t size() const { return count; }
+};
+
 /** XLineManager is a class used to manage G-lines, K-lines, E-lines, Z-lines and Q-lines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -415,12 +534,37 @@ class CoreExport XLineManager
 	XLineFactMap line_factory;
 
 	/** Container of all lines, this is a map of maps which
-	 * allows for fast lookup for add/remove of a line, and
-	 * the shortest possible timed O(n) for checking a user
-	 * against a line.
+	 * allows for fast lookup for add/remove of a line.
 	 */
 	XLineContainer lookup_lines;
 
+	/** Lines which match users within an IP address range, indexed by that range. */
+	std::map<std::string, XLineTrie> range_lines;
+
+	/** Lines which match users by a host mask with literal text at the start or end, indexed by that mask. */
+	std::map<std::string, WildcardIndex<XLine*> > host_lines;
+
+	/** Lines which have to be checked against every user in turn, indexed by type. */
+	XLineContainer other_lines;
+
+	/** Adds a line to the index it is matched against users with.
+	 * @param line The line to add.
+	 */
+	void IndexLine(XLine* line);
+
+	/** Removes a line from the index it is matched against users with.
+	 * @param line The line to remove.
+	 */
+	void UnindexLine(XLine* line);
+
+	/** Finds the lines of a type which might match a user using the range and host indexes.
+	 * Lines which are not in either of them are not included.
+	 * @param type The type of line to find.
+	 * @param user The user to find lines for.
+	 * @param lines The list to append the lines to.
+	 */
+	void FindIndexedLines(const std::string& type, User* user, std::vector<XLine*>& lines);
+
  public:
 
 	/** Constructor
@@ -0,0 +1,30 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main() {
+	// The io_uring socket engine needs IORING_ENTER_EXT_ARG (Linux 5.11) to wait with a timeout.
+	struct io_uring_getevents_arg arg = { 0, 0, 0, 0 };
+
+	// Kernels which support io_uring reject the NULL parameters with EFAULT.
+	syscall(__NR_io_uring_setup, 1, NULL);
+	return (errno == ENOSYS) || (arg.sigmask != 0);
+}
@@ -30,17 +30,17 @@
 classbase::classbase()
 {
 	if (ServerInstance)
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "classbase::+ @%p", (void*)this);
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "classbase::+ @%p", (void*)this);
 }
 
 CullResult classbase::cull()
 {
 	if (ServerInstance)
 #ifdef INSPIRCD_ENABLE_RTTI
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "classbase::-%s @%p",
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "classbase::-%s @%p",
 			typeid(*this).name(), (void*)this);
 #else
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "classbase::- @%p", (void*)this);
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "classbase::- @%p", (void*)this);
 #endif
 	return CullResult();
 }
@@ -48,7 +48,7 @@ CullResult classbase::cull()
 classbase::~classbase()
 {
 	if (ServerInstance)
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "classbase::~ @%p", (void*)this);
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "classbase::~ @%p", (void*)this);
 }
 
 CullResult::CullResult()
@@ -80,14 +80,14 @@ refcountbase::refcountbase() : refcount(0)
 refcountbase::~refcountbase()
 {
 	if (refcount && ServerInstance)
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "refcountbase::~ @%p with refcount %d",
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "refcountbase::~ @%p with refcount %d",
 			(void*)this, refcount);
 }
 
 usecountbase::~usecountbase()
 {
 	if (usecount && ServerInstance)
-		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "usecountbase::~ @%p with refcount %d",
+		LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "usecountbase::~ @%p with refcount %d",
 			(void*)this, usecount);
 }
 
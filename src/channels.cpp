@@ -29,6 +29,15 @@
 namespace
 {
 	ChanModeReference ban(NULL, "ban");
+
+	/** Orders members by prefix rank, highest first. */
+	struct HigherRank
+	{
+		bool operator()(Membership* lhs, Membership* rhs) const
+		{
+			return lhs->getRank() > rhs->getRank();
+		}
+	};
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
@@ -70,6 +79,13 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	Membership* memb = new(ret.first->second) Membership(user, this);
+
+	// New members have no prefix modes so they always go at the end of the local member list.
+	if (IS_LOCAL(user))
+		localmembers.push_back(memb);
+	else
+		servercounts[user->server]++;
+
 	return memb;
 }
 
@@ -103,6 +119,24 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const MemberMap::iterator& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+	{
+		// The position of the member is consistent with its current rank so only the
+		// members with the same rank need to be searched.
+		std::pair<LocalMemberList::iterator, LocalMemberList::iterator> range = std::equal_range(localmembers.begin(), localmembers.end(), memb, HigherRank());
+		LocalMemberList::iterator it = std::find(range.first, range.second, memb);
+		if (it == range.second)
+			it = std::find(localmembers.begin(), localmembers.end(), memb);
+		if (it != localmembers.end())
+			localmembers.erase(it);
+	}
+	else
+	{
+		ServerMemberCount::iterator it = servercounts.find(memb->user->server);
+		if ((it != servercounts.end()) && (--it->second == 0))
+			servercounts.erase(it);
+	}
+
 	memb->cull();
 	memb->~Membership();
 	userlist.erase(membiter);
@@ -111,6 +145,21 @@ void Channel::DelUser(const MemberMap::iterator& membiter)
 	CheckDestroy();
 }
 
+void Channel::UpdateMemberRank(Membership* memb)
+{
+	LocalMemberList::iterator it = std::find(localmembers.begin(), localmembers.end(), memb);
+	if (it == localmembers.end())
+		return;
+
+	localmembers.erase(it);
+	localmembers.insert(std::upper_bound(localmembers.begin(), localmembers.end(), memb, HigherRank()), memb);
+}
+
+void Channel::SortLocalMembers()
+{
+	std::stable_sort(localmembers.begin(), localmembers.end(), HigherRank());
+}
+
 Membership* Channel::GetUser(User* user)
 {
 	MemberMap::iterator i = userlist.find(user);
@@ -305,15 +354,42 @@ bool Channel::IsBanned(User* user)
 	if (!banlm)
 		return false;
 
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	const ListModeBase::MaskIndex* bans = banlm->GetMasks(this);
+	if (!bans)
+		return false;
+
+	// Whether a user matches a normal ban only depends on their nick, ident and hosts so the
+	// result is cached for members until either those or the ban list change.
+	Membership* memb = GetUser(user);
+	const uint64_t generation = banlm->GetGeneration(this);
+	bool banned;
+	if (memb && memb->bangeneration == generation && memb->banmaskgeneration == user->maskgeneration)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		banned = memb->banned;
+	}
+	else
+	{
+		// Modules only handle extbans in OnCheckBan so normal bans can always be matched
+		// using the index.
+		banned = bans->Matches(user);
+		if (memb)
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			memb->bangeneration = generation;
+			memb->banmaskgeneration = user->maskgeneration;
+			memb->banned = banned;
 		}
 	}
+
+	if (banned)
+		return true;
+
+	// Extbans can depend on anything about the user so they are checked every time.
+	const std::vector<std::string>& extbans = bans->GetExtBans();
+	for (std::vector<std::string>::const_iterator it = extbans.begin(); it != extbans.end(); ++it)
+	{
+		if (CheckBan(user, *it))
+			return true;
+	}
 	return false;
 }
 
@@ -356,15 +432,16 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 	if (!banlm)
 		return MOD_RES_PASSTHRU;
 
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
+	const ListModeBase::MaskIndex* bans = banlm->GetMasks(this);
 	if (bans)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+		const std::vector<std::string>& extbans = bans->GetExtBans();
+		for (std::vector<std::string>::const_iterator it = extbans.begin(); it != extbans.end(); ++it)
 		{
-			if (it->mask.length() <= 2 || it->mask[0] != type || it->mask[1] != ':')
+			if (it->length() <= 2 || (*it)[0] != type || (*it)[1] != ':')
 				continue;
 
-			if (CheckBan(user, it->mask.substr(2)))
+			if (CheckBan(user, it->substr(2)))
 				return MOD_RES_DENY;
 		}
 	}
@@ -419,17 +496,17 @@ void Channel::Write(ClientProtocol::Event& protoev, char status, const CUList& e
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
+	for (LocalMemberList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
 	{
-		LocalUser* user = IS_LOCAL(i->first);
-		if ((user) && (!except_list.count(user)))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
-				continue;
+		Membership* memb = *i;
+
+		/* The list is sorted by rank so nobody after this member has the status we're after */
+		if (minrank && memb->getRank() < minrank)
+			break;
 
+		LocalUser* user = static_cast<LocalUser*>(memb->user);
+		if (!except_list.count(user))
 			user->Send(protoev);
-		}
 	}
 }
 
@@ -532,6 +609,8 @@ unsigned int Channel::GetPrefixValue(User* user)
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
 	char prefix = delta_mh->GetModeChar();
+	bool changed = adding;
+	bool found = false;
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
 		char mchar = modes[i];
@@ -541,12 +620,18 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			changed = (adding != (mchar == prefix));
+			found = true;
+			break;
 		}
 	}
-	if (adding)
+	if (adding && !found)
 		modes.push_back(prefix);
-	return adding;
+
+	// Keep the local member list of the channel sorted by rank
+	if (changed && IS_LOCAL(user))
+		chan->UpdateMemberRank(this);
+	return changed;
 }
 
 
@@ -46,19 +46,86 @@ bool ClientProtocol::Serializer::HandleTag(LocalUser* user, const std::string& t
 	return true;
 }
 
+unsigned long ClientProtocol::Serializer::tagcachegeneration = 1;
+
+void ClientProtocol::Serializer::InvalidateTagCache(LocalUser* user)
+{
+	if (user)
+		user->tagwlcache.Clear();
+	else
+		tagcachegeneration++;
+}
+
 ClientProtocol::TagSelection ClientProtocol::Serializer::MakeTagWhitelist(LocalUser* user, const TagMap& tagmap) const
 {
+	TagWhitelistCache& cache = user->tagwlcache;
+	if (cache.generation != tagcachegeneration)
+	{
+		cache.Clear();
+		cache.generation = tagcachegeneration;
+	}
+
+	// Consecutive messages to a user (e.g. in a busy channel) usually have tags from the same
+	// providers so the whitelist of the last one can be reused if they were all cacheable.
+	if (!cache.lastproviders.empty() && cache.lastproviders.size() == tagmap.size())
+	{
+		std::vector<const MessageTagProvider*>::const_iterator prov = cache.lastproviders.begin();
+		TagMap::const_iterator i = tagmap.begin();
+		while ((i != tagmap.end()) && (i->second.tagprov == *prov))
+		{
+			++i;
+			++prov;
+		}
+
+		if (i == tagmap.end())
+			return TagSelection(cache.lastmask);
+	}
+
 	TagSelection tagwl;
+	bool cacheable = true;
 	for (TagMap::const_iterator i = tagmap.begin(); i != tagmap.end(); ++i)
 	{
 		const MessageTagData& tagdata = i->second;
-		if (tagdata.tagprov->ShouldSendTag(user, tagdata))
+		MessageTagProvider* const tagprov = tagdata.tagprov;
+		if (!tagprov->IsCacheable())
+		{
+			cacheable = false;
+			if (tagprov->ShouldSendTag(user, tagdata))
+				tagwl.Select(tagmap, i);
+			continue;
+		}
+
+		// There are only ever a handful of cacheable providers so a linear search is fine
+		TagWhitelistCache::EntryList::const_iterator entry = cache.entries.begin();
+		while ((entry != cache.entries.end()) && (entry->first != tagprov))
+			++entry;
+
+		bool send;
+		if (entry != cache.entries.end())
+		{
+			send = entry->second;
+		}
+		else
+		{
+			send = tagprov->ShouldSendTag(user, tagdata);
+			cache.entries.push_back(std::make_pair(tagprov, send));
+		}
+
+		if (send)
 			tagwl.Select(tagmap, i);
 	}
+
+	cache.lastproviders.clear();
+	if (cacheable && !tagmap.empty())
+	{
+		for (TagMap::const_iterator i = tagmap.begin(); i != tagmap.end(); ++i)
+			cache.lastproviders.push_back(i->second.tagprov);
+		cache.lastmask = tagwl.GetMask();
+	}
 	return tagwl;
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
+const ClientProtocol::SharedSerializedMessage& ClientProtocol::Serializer::SerializeForUser(LocalUser* user, Message& msg)
 {
 	if (!msg.msginit_done)
 	{
@@ -68,19 +135,21 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeFo
 	return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
 }
 
-const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
+const ClientProtocol::SharedSerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
 {
 	// First check if the serialized line they're asking for is in the cache
-	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
+	SerializedList::const_iterator it = serlist.find(serializeinfo);
+	if (it != serlist.end())
 	{
-		const SerializedInfo& curr = i->first;
-		if (curr == serializeinfo)
-			return i->second;
+		ServerInstance->stats.SerializeHits++;
+		return it->second;
 	}
 
 	// Not cached, generate it and put it in the cache for later use
-	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
-	return serlist.back().second;
+	ServerInstance->stats.SerializeMisses++;
+	SharedSerializedMessage& serialized = serlist[serializeinfo];
+	serialized = std::make_shared<const SerializedMessage>(serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl));
+	return serialized;
 }
 
 void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& messagelist)
@@ -336,6 +336,8 @@ void ServerConfig::Fill()
 	SoftLimit = ConfValue("performance")->getUInt("softlimit", (SocketEngine::GetMaxFds() > 0 ? SocketEngine::GetMaxFds() : LONG_MAX), 10);
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getUInt("somaxconn", SOMAXCONN);
+	IOThreads = ConfValue("performance")->getUInt("iothreads", 0, 0, 64);
+	XLineThreads = ConfValue("performance")->getUInt("xlinethreads", 0, 0, 64);
 	TimeSkipWarn = ConfValue("performance")->getDuration("timeskipwarn", 2, 0, 30);
 	XLineMessage = options->getString("xlinemessage", "You're banned!");
 	ServerDesc = server->getString("description", "Configure Me");
@@ -336,6 +336,17 @@ class CoreModChannel : public Module, public CheckExemption::EventListener
 		invapi.RemoveAll(chan);
 	}
 
+	void OnLoadModule(Module* mod) override
+	{
+		// Modules can change how bans are matched (e.g. the case map) so forget the cached results.
+		banmode.ChangeGenerations();
+	}
+
+	void OnUnloadModule(Module* mod) override
+	{
+		banmode.ChangeGenerations();
+	}
+
 	ModResult OnCheckExemption(User* user, Channel* chan, const std::string& restriction) override
 	{
 		if (!exemptions.count(restriction))
@@ -19,6 +19,7 @@
 
 #include "inspircd.h"
 #include "modules/dns.h"
+#include "modules/stats.h"
 #include <iostream>
 #include <fstream>
 
@@ -32,6 +33,19 @@ namespace DNS
 	/** Maximum value of a dns request id, 16 bits wide, 0xFFFF.
 	 */
 	const unsigned int MAX_REQUEST_ID = 0xFFFF;
+
+	/** Milliseconds to wait for an answer before asking again when the latency of the nameserver is not known yet.
+	 */
+	const unsigned long RETRY_MS = 1000;
+
+	/** Bounds of the number of milliseconds to wait for an answer before asking again.
+	 */
+	const unsigned long MIN_RETRY_MS = 250;
+	const unsigned long MAX_RETRY_MS = 4000;
+
+	/** Seconds to wait for a TCP connection to a nameserver.
+	 */
+	const unsigned int TCP_TIMEOUT = 5;
 }
 
 using namespace DNS;
@@ -45,7 +59,7 @@ class Packet : public Query
 		if (pos + name.length() + 2 > output_size)
 			throw Exception("Unable to pack name");
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Packing name " + name);
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Packing name " + name);
 
 		irc::sepstream sep(name, '.');
 		std::string token;
@@ -116,7 +130,7 @@ class Packet : public Query
 		if (name.empty())
 			throw Exception("Unable to unpack name - no name");
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unpack name " + name);
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Unpack name " + name);
 
 		return name;
 	}
@@ -208,12 +222,37 @@ class Packet : public Query
 
 				break;
 			}
+			case QUERY_SOA:
+			{
+				// Only the MNAME and the MINIMUM field are used. A negative answer can be cached
+				// for the lower of the TTL of the SOA record and its MINIMUM field (RFC 2308).
+				record.rdata = this->UnpackName(input, input_size, pos);
+				this->UnpackName(input, input_size, pos);
+
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack soa resource record");
+
+				// Skip over the serial, refresh, retry and expire fields
+				pos += 16;
+
+				const unsigned int minimum = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
+				pos += 4;
+
+				record.ttl = std::min(record.ttl, minimum);
+				break;
+			}
 			default:
+			{
+				if (pos + rdlength > input_size)
+					throw Exception("Unable to unpack resource record");
+
+				pos += rdlength;
 				break;
+			}
 		}
 
 		if (!record.name.empty() && !record.rdata.empty())
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, record.name + " -> " + record.rdata);
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, record.name + " -> " + record.rdata);
 
 		return record;
 	}
@@ -227,8 +266,10 @@ class Packet : public Query
 	RequestId id;
 	/* Flags on the packet */
 	unsigned short flags;
+	/* How long a negative answer can be cached for, 0 if it can not be cached */
+	unsigned int negttl;
 
-	Packet() : id(0), flags(0)
+	Packet() : id(0), flags(0), negttl(0)
 	{
 	}
 
@@ -257,7 +298,7 @@ class Packet : public Query
 		unsigned short arcount = (input[packet_pos] << 8) | input[packet_pos + 1];
 		packet_pos += 2;
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "qdcount: " + ConvToStr(qdcount) + " ancount: " + ConvToStr(ancount) + " nscount: " + ConvToStr(nscount) + " arcount: " + ConvToStr(arcount));
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "qdcount: " + ConvToStr(qdcount) + " ancount: " + ConvToStr(ancount) + " nscount: " + ConvToStr(nscount) + " arcount: " + ConvToStr(arcount));
 
 		if (qdcount != 1)
 			throw Exception("Question count != 1 in incoming packet");
@@ -266,6 +307,28 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		if (!this->answers.empty())
+			return;
+
+		// Negative answers without a SOA record in the authority section must not be cached (RFC 2308).
+		// A bad authority section does not make the answer itself invalid.
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+			{
+				const ResourceRecord record = this->UnpackResourceRecord(input, len, packet_pos);
+				if (record.type == QUERY_SOA)
+				{
+					this->negttl = record.ttl;
+					break;
+				}
+			}
+		}
+		catch (Exception& ex)
+		{
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Unable to unpack authority section: " + ex.GetReason());
+		}
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -340,22 +403,385 @@ class Packet : public Query
 	}
 };
 
-class MyManager : public Manager, public Timer, public EventHandler
+/** A request which refreshes a cache entry before it expires
+ */
+class PrefetchRequest : public Request
+{
+ public:
+	PrefetchRequest(Manager* mgr, Module* mod, const Question& q)
+		: Request(mgr, mod, q.name, q.type, false)
+	{
+	}
+
+	/* The answer is added to the cache like any other answer */
+	void OnLookupComplete(const Query* req) override
+	{
+	}
+};
+
+class MyManager;
+class PendingQuestion;
+class TCPQuery;
+
+/** An upstream nameserver and the UDP socket which is used to query it
+ */
+class Nameserver : public EventHandler
+{
+	MyManager* const manager;
+
+ public:
+	typedef std::unordered_map<RequestId, PendingQuestion*> PendingMap;
+
+	/* The address of the nameserver */
+	irc::sockets::sockaddrs addr;
+	/* Questions which were sent to this nameserver, by request id */
+	PendingMap pending;
+	/* Smoothed round trip time in milliseconds, 0 until it has been measured */
+	unsigned long latency;
+	/* Number of queries sent to this nameserver */
+	unsigned long sent;
+	/* Number of answers received from this nameserver */
+	unsigned long answered;
+	/* Number of queries which this nameserver did not answer in time */
+	unsigned long timeouts;
+
+	Nameserver(MyManager* mgr, const irc::sockets::sockaddrs& address)
+		: manager(mgr)
+		, addr(address)
+		, latency(0)
+		, sent(0)
+		, answered(0)
+		, timeouts(0)
+	{
+	}
+
+	~Nameserver()
+	{
+		if (this->GetFd() > -1)
+			SocketEngine::Close(this);
+	}
+
+	/** Creates the socket used to query this nameserver
+	 * @return True if the socket was created, false otherwise
+	 */
+	bool Open(std::string sourceaddr, unsigned int sourceport)
+	{
+		int s = socket(addr.family(), SOCK_DGRAM, 0);
+		this->SetFd(s);
+		if (s == -1)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error creating DNS socket for %s - it will NOT be used", addr.addr().c_str());
+			return false;
+		}
+
+		SocketEngine::SetReuse(s);
+		SocketEngine::NonBlocking(s);
+
+		irc::sockets::sockaddrs bindto;
+		if (sourceaddr.empty())
+		{
+			// set a sourceaddr for irc::sockets::aptosa() based on the servers af type
+			if (addr.family() == AF_INET)
+				sourceaddr = "0.0.0.0";
+			else if (addr.family() == AF_INET6)
+				sourceaddr = "::";
+		}
+		irc::sockets::aptosa(sourceaddr, sourceport, bindto);
+
+		if (bindto.family() != addr.family())
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Nameserver address family differs from source address family - %s might not resolve", addr.addr().c_str());
+
+		// Connecting the socket makes sure only answers from the nameserver are received on it,
+		// which also allows several of them to share the same source port.
+		if (SocketEngine::Bind(s, bindto) < 0 || SocketEngine::Connect(this, addr) < 0)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error binding DNS socket for %s - it will NOT be used", addr.addr().c_str());
+			SocketEngine::Close(s);
+			this->SetFd(-1);
+			return false;
+		}
+
+		if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Internal error starting DNS socket for %s - it will NOT be used", addr.addr().c_str());
+			SocketEngine::Close(s);
+			this->SetFd(-1);
+			return false;
+		}
+
+		return true;
+	}
+
+	/** Picks an unused request id
+	 * @return The request id
+	 */
+	RequestId AllocateId()
+	{
+		if (pending.size() > MAX_REQUEST_ID)
+			throw Exception("DNS: All ids are in use");
+
+		// Random ids make forging answers harder. Fall back to scanning from a random
+		// id in the unlikely case that most of them are in use.
+		RequestId id = ServerInstance->GenRandomInt(MAX_REQUEST_ID + 1);
+		for (unsigned int tries = 0; pending.count(id); ++tries)
+			id = (tries < 32 ? ServerInstance->GenRandomInt(MAX_REQUEST_ID + 1) : id + 1);
+		return id;
+	}
+
+	/** Adds a measured round trip time to the smoothed latency of the nameserver
+	 * @param rtt The round trip time in milliseconds
+	 */
+	void UpdateLatency(unsigned long rtt)
+	{
+		rtt = std::max(rtt, 1UL);
+		latency = latency ? (latency * 7 + rtt) / 8 : rtt;
+	}
+
+	void OnEventHandlerRead() override;
+
+	void OnEventHandlerError(int errcode) override
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "UDP socket for %s got an error event", addr.addr().c_str());
+	}
+};
+
+/** A question which was sent to one or more nameservers and the requests waiting for its answer.
+ * Requests for a question which is already waiting for an answer share it.
+ */
+class PendingQuestion : public Timer
+{
+	MyManager* const manager;
+
+ public:
+	/** A copy of the question which was sent to a nameserver
+	 */
+	struct Send
+	{
+		Nameserver* server;
+		RequestId id;
+		/* When the question was sent in milliseconds */
+		uint64_t time;
+
+		Send(Nameserver* ns, RequestId rid, uint64_t now) : server(ns), id(rid), time(now) { }
+	};
+
+	/* The question, PTR questions are reversed */
+	Question question;
+	/* The packed query, the request id is filled in when it is sent */
+	std::string packet;
+	/* The requests waiting for the answer */
+	std::vector<Request*> requests;
+	/* Where the question was sent to, the most recent last */
+	std::vector<Send> sends;
+	/* The TCP connection used to get a truncated answer again or NULL */
+	TCPQuery* tcp;
+
+	PendingQuestion(MyManager* mgr, const Question& q, const unsigned char* query, unsigned short len)
+		: Timer(0)
+		, manager(mgr)
+		, question(q)
+		, packet(reinterpret_cast<const char*>(query), len)
+		, tcp(NULL)
+	{
+	}
+
+	/* Called when no nameserver answered in time, sends the question again */
+	bool Tick(time_t now) override;
+};
+
+/** A TCP connection to a nameserver which is used when an answer was truncated
+ */
+class TCPQuery : public BufferedSocket
+{
+	MyManager* const manager;
+
+ public:
+	/* The question to ask or NULL if it is not needed anymore */
+	PendingQuestion* pending;
+	/* The truncated answer, used if the TCP query fails */
+	Packet truncated;
+
+	TCPQuery(MyManager* mgr, PendingQuestion* pq, const Packet& answer)
+		: manager(mgr)
+		, pending(pq)
+		, truncated(answer)
+	{
+	}
+
+	void OnConnected() override
+	{
+		if (!pending)
+			return;
+
+		// Messages sent over TCP are prefixed with their length (RFC 1035 section 4.2.2).
+		std::string data;
+		data.push_back(pending->packet.length() >> 8);
+		data.push_back(pending->packet.length() & 0xFF);
+		data.append(pending->packet);
+		WriteData(data);
+	}
+
+	void OnDataReady() override;
+	void OnError(BufferedSocketError e) override;
+
+	/** Closes the connection
+	 */
+	void Finish()
+	{
+		pending = NULL;
+		Close();
+		ServerInstance->GlobalCulls.AddItem(this);
+	}
+};
+
+class MyManager : public Manager, public Timer
 {
-	typedef std::unordered_map<Question, Query, Question::hash> cache_map;
+ public:
+	/** DNS resolver statistics
+	 */
+	struct Statistics
+	{
+		/* Number of requests answered from the cache */
+		unsigned long hits;
+		/* Number of those which were answered with a cached error */
+		unsigned long negativehits;
+		/* Number of requests which were not in the cache */
+		unsigned long misses;
+		/* Number of entries removed to make room for new ones */
+		unsigned long evictions;
+		/* Number of requests sent to refresh entries before they expire */
+		unsigned long prefetches;
+		/* Number of requests which shared a question which was already sent */
+		unsigned long coalesced;
+		/* Number of questions which were sent again because no answer was received in time */
+		unsigned long retries;
+		/* Number of truncated answers which were asked for again over TCP */
+		unsigned long truncated;
+
+		Statistics()
+			: hits(0), negativehits(0), misses(0), evictions(0), prefetches(0)
+			, coalesced(0), retries(0), truncated(0)
+		{
+		}
+	};
+
+ private:
+	/** An entry in the DNS cache
+	 */
+	struct CacheEntry
+	{
+		/* The cached answer or error */
+		Query query;
+		/* When the entry was added */
+		time_t created;
+		/* When the entry expires */
+		time_t expires;
+		/* Number of times the entry was used */
+		unsigned long hits;
+		/* Whether a request to refresh the entry has been sent */
+		bool refreshing;
+
+		CacheEntry(const Query& q, unsigned int ttl)
+			: query(q)
+			, created(ServerInstance->Time())
+			, expires(created + ttl)
+			, hits(0)
+			, refreshing(false)
+		{
+		}
+	};
+
+	/* Entries are kept in the order they were last used in, the most recently used first */
+	typedef std::list<CacheEntry> cache_list;
+	typedef std::unordered_map<Question, cache_list::iterator, Question::hash> cache_map;
+	cache_list lru;
 	cache_map cache;
+	Statistics stats;
+
+	/* The nameservers to send questions to */
+	std::vector<Nameserver*> servers;
+
+	/* Questions which are waiting for an answer */
+	typedef std::unordered_map<Question, PendingQuestion*, Question::hash> question_map;
+	question_map inflight;
+
+	/* The address to send TCP queries from */
+	std::string sourceaddr;
 
-	irc::sockets::sockaddrs myserver;
 	bool unloading;
 
-	/** Maximum number of entries in cache
+	/** Maximum number of entries in the cache
+	 */
+	unsigned long cachesize;
+
+	/** Maximum number of seconds to cache answers for
+	 */
+	unsigned int maxttl;
+
+	/** Maximum number of seconds to cache negative answers for
+	 */
+	unsigned int maxnegttl;
+
+	/** Number of times an entry has to be used before it is refreshed ahead of expiry
+	 */
+	static const unsigned int PREFETCH_HITS = 2;
+
+	/** Retrieves the current time in milliseconds
+	 */
+	static uint64_t GetMilliseconds()
+	{
+		return uint64_t(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+
+	static bool IsExpired(const CacheEntry& entry, time_t now = ServerInstance->Time())
+	{
+		return (entry.expires < now);
+	}
+
+	void RemoveCache(cache_map::iterator it)
+	{
+		lru.erase(it->second);
+		cache.erase(it);
+	}
+
+	/** Removes the least recently used entries from the cache until it has at most max entries
 	 */
-	static const unsigned int MAX_CACHE_SIZE = 1000;
+	void TrimCache(unsigned long max)
+	{
+		while (cache.size() > max)
+		{
+			cache.erase(lru.back().query.question);
+			lru.pop_back();
+			stats.evictions++;
+		}
+	}
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/** Refreshes a cache entry which is used often if it is about to expire
+	 * @param entry The cache entry
+	 * @param question The question as it was asked, PTR questions are not reversed yet
+	 */
+	void Prefetch(CacheEntry& entry, const Question& question)
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		if (entry.refreshing || entry.hits < PREFETCH_HITS)
+			return;
+
+		// Refresh entries in the last tenth of their lifetime.
+		const time_t remaining = entry.expires - ServerInstance->Time();
+		if (remaining > std::max<time_t>((entry.expires - entry.created) / 10, 1))
+			return;
+
+		entry.refreshing = true;
+		PrefetchRequest* req = new PrefetchRequest(this, creator, question);
+		try
+		{
+			this->Process(req);
+			stats.prefetches++;
+		}
+		catch (DNS::Exception& ex)
+		{
+			delete req;
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "cache: unable to refresh " + question.name + ": " + ex.GetReason());
+		}
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -367,29 +793,63 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			stats.misses++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		CacheEntry& entry = *it->second;
+		if (IsExpired(entry))
 		{
-			this->cache.erase(it);
+			RemoveCache(it);
+			stats.misses++;
 			return false;
 		}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: Using cached result for " + question.name);
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "cache: Using cached result for " + question.name);
+		lru.splice(lru.begin(), lru, it->second);
+		entry.hits++;
+		stats.hits++;
+
+		// Copy the answer as refreshing the entry or the request handler can replace it.
+		Query record = entry.query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		Prefetch(entry, req->question);
+
+		if (record.error != ERROR_NONE)
+		{
+			stats.negativehits++;
+			req->OnError(&record);
+		}
+		else
+			req->OnLookupComplete(&record);
 		return true;
 	}
 
+	/** Adds an answer or an error to the DNS cache, replacing any existing entry for the question
+	 * @param query The answer or error
+	 * @param ttl The number of seconds to cache it for
+	 */
+	void AddCache(const Query& query, unsigned int ttl)
+	{
+		if (!cachesize || !ttl)
+			return;
+
+		cache_map::iterator it = cache.find(query.question);
+		if (it != cache.end())
+			RemoveCache(it);
+
+		TrimCache(cachesize - 1);
+
+		lru.push_front(CacheEntry(query, ttl));
+		cache[query.question] = lru.begin();
+	}
+
 	/** Add a record to the dns cache
 	 * @param r The record
 	 */
 	void AddCache(Query& r)
 	{
-		if (cache.size() >= MAX_CACHE_SIZE)
-			cache.clear();
-
 		// Determine the lowest TTL value and use that as the TTL of the cache entry
 		unsigned int cachettl = UINT_MAX;
 		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
@@ -399,22 +859,31 @@ class MyManager : public Manager, public Timer, public EventHandler
 				cachettl = rr.ttl;
 		}
 
-		cachettl = std::min(cachettl, (unsigned int)5*60);
+		cachettl = std::min(cachettl, maxttl);
 		ResourceRecord& rr = r.answers.front();
 		// Set TTL to what we've determined to be the lowest
 		rr.ttl = cachettl;
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.question] = r;
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
+		AddCache(r, cachettl);
 	}
 
- public:
-	DNS::Request* requests[MAX_REQUEST_ID+1];
+	/** Add a negative answer to the dns cache (RFC 2308)
+	 * @param p The packet with the negative answer
+	 */
+	void AddNegativeCache(Packet& p)
+	{
+		const unsigned int cachettl = std::min(p.negttl, maxnegttl);
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "cache: added negative cache for " + p.question.name + " ttl: " + ConvToStr(cachettl));
+		AddCache(p, cachettl);
+	}
 
+ public:
 	MyManager(Module* c) : Manager(c), Timer(5*60, true)
 		, unloading(false)
+		, cachesize(1000)
+		, maxttl(5*60)
+		, maxnegttl(5*60)
 	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-			requests[i] = NULL;
 		ServerInstance->Timers.AddTimer(this);
 	}
 
@@ -423,18 +892,8 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Ensure Process() will fail for new requests
 		unloading = true;
 
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* request = requests[i];
-			if (!request)
-				continue;
-
-			Query rr(request->question);
-			rr.error = ERROR_UNKNOWN;
-			request->OnError(&rr);
-
-			delete request;
-		}
+		FailRequests(NULL, ERROR_UNKNOWN);
+		ClearServers();
 	}
 
 	void Process(DNS::Request* req) override
@@ -442,43 +901,10 @@ class MyManager : public Manager, public Timer, public EventHandler
 		if ((unloading) || (req->creator->dying))
 			throw Exception("Module is being unloaded");
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type) + " to " + this->myserver.addr());
-
-		/* Create an id */
-		unsigned int tries = 0;
-		int id;
-		do
-		{
-			id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID+1);
-
-			if (++tries == DNS::MAX_REQUEST_ID*5)
-			{
-				// If we couldn't find an empty slot this many times, do a sequential scan as a last
-				// resort. If an empty slot is found that way, go on, otherwise throw an exception
-				id = -1;
-				for (unsigned int i = 0; i <= DNS::MAX_REQUEST_ID; i++)
-				{
-					if (!this->requests[i])
-					{
-						id = i;
-						break;
-					}
-				}
-
-				if (id == -1)
-					throw Exception("DNS: All ids are in use");
-
-				break;
-			}
-		}
-		while (this->requests[id]);
-
-		req->id = id;
-		this->requests[req->id] = req;
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Processing request to lookup " + req->question.name + " of type " + ConvToStr(req->question.type));
 
 		Packet p;
 		p.flags = QUERYFLAGS_RD;
-		p.id = req->id;
 		p.question = req->question;
 
 		unsigned char buffer[524];
@@ -489,16 +915,40 @@ class MyManager : public Manager, public Timer, public EventHandler
 		 */
 		if (req->use_cache && this->CheckCache(req, p.question))
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Using cached result");
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Using cached result");
 			delete req;
 			return;
 		}
 
+		// Share the answer to an identical question which is already waiting for one.
+		PendingQuestion* pq;
+		question_map::iterator it = inflight.find(p.question);
+		if (it != inflight.end())
+		{
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Waiting for the answer to an identical question");
+			pq = it->second;
+			stats.coalesced++;
+		}
+		else
+		{
+			pq = new PendingQuestion(this, p.question, buffer, len);
+			try
+			{
+				if (!this->Send(pq))
+					throw Exception("DNS: Unable to send query");
+			}
+			catch (...)
+			{
+				RemovePending(pq);
+				throw;
+			}
+			inflight[pq->question] = pq;
+		}
+
 		// Update name in the original request so question checking works for PTR queries
 		req->question.name = p.question.name;
-
-		if (SocketEngine::SendTo(this, buffer, len, 0, this->myserver) != len)
-			throw Exception("DNS: Unable to send query");
+		req->id = pq->sends.empty() ? 0 : pq->sends.back().id;
+		pq->requests.push_back(req);
 
 		// Add timer for timeout
 		ServerInstance->Timers.AddTimer(req);
@@ -506,8 +956,133 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 	void RemoveRequest(DNS::Request* req) override
 	{
-		if (requests[req->id] == req)
-			requests[req->id] = NULL;
+		question_map::iterator it = inflight.find(req->question);
+		if (it == inflight.end())
+			return;
+
+		PendingQuestion* pq = it->second;
+		if (stdalgo::erase(pq->requests, req) && pq->requests.empty())
+			RemovePending(pq);
+	}
+
+	/** Sends a question to the fastest nameserver it has not been sent to yet
+	 * @param pq The question
+	 * @return True if the question was sent, false otherwise
+	 */
+	bool Send(PendingQuestion* pq)
+	{
+		Nameserver* server = NULL;
+		bool retry = true;
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			Nameserver* ns = *i;
+			if (ns->GetFd() < 0)
+				continue;
+
+			bool tried = false;
+			for (std::vector<PendingQuestion::Send>::const_iterator j = pq->sends.begin(); j != pq->sends.end(); ++j)
+				tried |= (j->server == ns);
+
+			// Prefer nameservers which have not been tried yet, then the ones with the lowest latency.
+			if (!server || (retry && !tried) || (retry == tried && ns->latency < server->latency))
+			{
+				server = ns;
+				retry = tried;
+			}
+		}
+
+		if (!server)
+			return false;
+
+		const RequestId id = server->AllocateId();
+		pq->packet[0] = id >> 8;
+		pq->packet[1] = id & 0xFF;
+		if (SocketEngine::Send(server, pq->packet.data(), pq->packet.length(), 0) != static_cast<int>(pq->packet.length()))
+			return false;
+
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Sent question for " + pq->question.name + " to " + server->addr.addr());
+		server->pending[id] = pq;
+		server->sent++;
+		pq->sends.push_back(PendingQuestion::Send(server, id, GetMilliseconds()));
+
+		// Send the question again if there is no answer within a few round trips, backing off
+		// exponentially. Requests time out on their own so this does not need a limit.
+		const unsigned long rtt = server->latency ? server->latency * 4 : RETRY_MS;
+		const unsigned long interval = std::min(std::max(rtt, MIN_RETRY_MS) << std::min<size_t>(pq->sends.size() - 1, 4), MAX_RETRY_MS);
+		pq->SetIntervalMs(interval);
+		return true;
+	}
+
+	/** Called when no nameserver answered a question in time
+	 */
+	void Retry(PendingQuestion* pq)
+	{
+		Nameserver* server = pq->sends.empty() ? NULL : pq->sends.back().server;
+		if (server)
+		{
+			// Make a nameserver which does not answer look at least as slow as the time it
+			// was given to answer so others are preferred.
+			server->timeouts++;
+			server->latency = std::min(std::max(server->latency * 2, pq->GetIntervalMs()), MAX_RETRY_MS);
+		}
+
+		try
+		{
+			if (this->Send(pq))
+				stats.retries++;
+		}
+		catch (Exception& ex)
+		{
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Unable to send question for " + pq->question.name + " again: " + ex.GetReason());
+		}
+	}
+
+	/** Removes a question and all copies of it which were sent
+	 */
+	void RemovePending(PendingQuestion* pq)
+	{
+		for (std::vector<PendingQuestion::Send>::const_iterator i = pq->sends.begin(); i != pq->sends.end(); ++i)
+		{
+			Nameserver::PendingMap::iterator it = i->server->pending.find(i->id);
+			if (it != i->server->pending.end() && it->second == pq)
+				i->server->pending.erase(it);
+		}
+
+		question_map::iterator it = inflight.find(pq->question);
+		if (it != inflight.end() && it->second == pq)
+			inflight.erase(it);
+
+		if (pq->tcp)
+			pq->tcp->Finish();
+		delete pq;
+	}
+
+	/** Fails requests with an error
+	 * @param mod The module which made the requests or NULL to fail all of them
+	 * @param error The error
+	 */
+	void FailRequests(Module* mod, Error error)
+	{
+		std::vector<DNS::Request*> failed;
+		for (question_map::const_iterator i = inflight.begin(); i != inflight.end(); ++i)
+		{
+			const std::vector<DNS::Request*>& requests = i->second->requests;
+			for (std::vector<DNS::Request*>::const_iterator j = requests.begin(); j != requests.end(); ++j)
+			{
+				if (!mod || (*j)->creator == mod)
+					failed.push_back(*j);
+			}
+		}
+
+		for (std::vector<DNS::Request*>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+		{
+			DNS::Request* request = *i;
+			Query rr(request->question);
+			rr.error = error;
+			request->OnError(&rr);
+
+			delete request;
+		}
 	}
 
 	std::string GetErrorStr(Error e) override
@@ -538,31 +1113,13 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 	}
 
-	void OnEventHandlerError(int errcode) override
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "UDP socket got an error event");
-	}
-
-	void OnEventHandlerRead() override
+	/** Called when a nameserver sent something
+	 */
+	void OnAnswer(Nameserver* server, const unsigned char* buffer, int length)
 	{
-		unsigned char buffer[524];
-		irc::sockets::sockaddrs from;
-		socklen_t x = sizeof(from);
-
-		int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
-
 		if (length < Packet::HEADER_LENGTH)
 			return;
 
-		if (myserver != from)
-		{
-			std::string server1 = from.str();
-			std::string server2 = myserver.str();
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-				server1.c_str(), server2.c_str());
-			return;
-		}
-
 		Packet recv_packet;
 		bool valid = false;
 
@@ -577,36 +1134,101 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 
 		// recv_packet.id must be filled in here
-		DNS::Request* request = this->requests[recv_packet.id];
-		if (request == NULL)
+		Nameserver::PendingMap::iterator it = server->pending.find(recv_packet.id);
+		if (it == server->pending.end())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received an answer for something we didn't request");
 			return;
 		}
 
-		if (request->question != recv_packet.question)
+		PendingQuestion* pq = it->second;
+		if (pq->question != recv_packet.question)
 		{
 			// This can happen under high latency, drop it silently, do not fail the request
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received an answer that isn't for a question we asked");
 			return;
 		}
 
+		server->answered++;
+		for (std::vector<PendingQuestion::Send>::const_iterator i = pq->sends.begin(); i != pq->sends.end(); ++i)
+		{
+			if (i->server == server && i->id == recv_packet.id)
+				server->UpdateLatency(GetMilliseconds() - i->time);
+		}
+
+		if (valid && (recv_packet.flags & QUERYFLAGS_TC) && !pq->tcp)
+		{
+			// The answer did not fit in a UDP packet, ask again over TCP (RFC 7766).
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Truncated answer for " + pq->question.name + ", asking " + server->addr.addr() + " again over TCP");
+			stats.truncated++;
+			pq->tcp = new TCPQuery(this, pq, recv_packet);
+			pq->tcp->DoConnect(server->addr.addr(), DNS::PORT, TCP_TIMEOUT, sourceaddr);
+			return;
+		}
+
+		Answer(pq, recv_packet, valid);
+	}
+
+	/** Called when an answer was received over TCP
+	 */
+	void OnAnswer(TCPQuery* tcp, const unsigned char* buffer, unsigned short length)
+	{
+		PendingQuestion* pq = tcp->pending;
+		Packet recv_packet;
+		try
+		{
+			recv_packet.Fill(buffer, length);
+		}
+		catch (Exception& ex)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Malformed answer over TCP: " + ex.GetReason());
+			OnTCPError(tcp);
+			return;
+		}
+
+		if (recv_packet.id != tcp->truncated.id || pq->question != recv_packet.question)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received an answer over TCP that isn't for a question we asked");
+			OnTCPError(tcp);
+			return;
+		}
+
+		Answer(pq, recv_packet, true);
+	}
+
+	/** Called when asking again over TCP failed, uses the truncated answer instead
+	 */
+	void OnTCPError(TCPQuery* tcp)
+	{
+		PendingQuestion* pq = tcp->pending;
+		Packet recv_packet = tcp->truncated;
+		Answer(pq, recv_packet, true);
+	}
+
+	/** Passes an answer to the requests waiting for it
+	 * @param pq The question which was answered
+	 * @param recv_packet The answer
+	 * @param valid Whether the answer could be parsed
+	 */
+	void Answer(PendingQuestion* pq, Packet& recv_packet, bool valid)
+	{
+		std::vector<DNS::Request*> requests;
+		requests.swap(pq->requests);
+		RemovePending(pq);
+
+		Error error = ERROR_NONE;
 		if (!valid)
 		{
-			ServerInstance->stats.DnsBad++;
-			recv_packet.error = ERROR_MALFORMED;
-			request->OnError(&recv_packet);
+			error = ERROR_MALFORMED;
 		}
 		else if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received a nonstandard query");
-			ServerInstance->stats.DnsBad++;
-			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
+			error = ERROR_NONSTANDARD_QUERY;
 		}
 		else if (!(recv_packet.flags & QUERYFLAGS_QR) || (recv_packet.flags & QUERYFLAGS_RCODE))
 		{
-			Error error = ERROR_UNKNOWN;
+			error = ERROR_UNKNOWN;
 
 			switch (recv_packet.flags & QUERYFLAGS_RCODE)
 			{
@@ -633,106 +1255,186 @@ class MyManager : public Manager, public Timer, public EventHandler
 				default:
 					break;
 			}
-
-			ServerInstance->stats.DnsBad++;
-			recv_packet.error = error;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "No resource records returned");
+			error = ERROR_NO_RECORDS;
+		}
+
+		if (error != ERROR_NONE)
+		{
 			ServerInstance->stats.DnsBad++;
-			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
+			recv_packet.error = error;
+			if ((error == ERROR_DOMAIN_NOT_FOUND || error == ERROR_NO_RECORDS) && recv_packet.negttl)
+				this->AddNegativeCache(recv_packet);
 		}
 		else
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Lookup complete for " + request->question.name);
+			LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "Lookup complete for " + recv_packet.question.name);
 			ServerInstance->stats.DnsGood++;
-			request->OnLookupComplete(&recv_packet);
 			this->AddCache(recv_packet);
 		}
 
 		ServerInstance->stats.Dns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+		for (std::vector<DNS::Request*>::const_iterator i = requests.begin(); i != requests.end(); ++i)
+		{
+			DNS::Request* request = *i;
+			if (error != ERROR_NONE)
+				request->OnError(&recv_packet);
+			else
+				request->OnLookupComplete(&recv_packet);
+
+			delete request;
+		}
 	}
 
 	bool Tick(time_t now) override
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: purging DNS cache");
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		for (cache_list::iterator it = this->lru.begin(); it != this->lru.end(); )
 		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
+			if (IsExpired(*it, now))
+			{
+				this->cache.erase(it->query.question);
+				it = this->lru.erase(it);
+			}
 			else
 				++it;
 		}
+
+		// Give nameservers which were slow another chance.
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+			(*i)->latency = 0;
 		return true;
 	}
 
-	void Rehash(const std::string& dnsserver, std::string sourceaddr, unsigned int sourceport)
+	/** Changes the limits of the cache, removing the least recently used entries if it is too big
+	 * @param size The maximum number of entries
+	 * @param ttl The maximum number of seconds to cache answers for
+	 * @param negttl The maximum number of seconds to cache negative answers for
+	 */
+	void SetCacheLimits(unsigned long size, unsigned int ttl, unsigned int negttl)
 	{
-		if (this->GetFd() > -1)
+		cachesize = size;
+		maxttl = ttl;
+		maxnegttl = negttl;
+		TrimCache(cachesize);
+	}
+
+	size_t GetCacheCount() const { return cache.size(); }
+	const Statistics& GetStats() const { return stats; }
+
+	/** Closes the sockets of all nameservers
+	 */
+	void ClearServers()
+	{
+		for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
 		{
-			SocketEngine::Shutdown(this, 2);
-			SocketEngine::Close(this);
+			// Questions which were sent to the nameserver are sent to another one when they are retried.
+			Nameserver* server = *i;
+			for (Nameserver::PendingMap::const_iterator j = server->pending.begin(); j != server->pending.end(); ++j)
+			{
+				std::vector<PendingQuestion::Send>& sends = j->second->sends;
+				for (std::vector<PendingQuestion::Send>::iterator k = sends.begin(); k != sends.end(); )
+				{
+					if (k->server == server)
+						k = sends.erase(k);
+					else
+						++k;
+				}
+			}
+			delete server;
+		}
+		servers.clear();
+	}
+
+	void Rehash(const std::vector<std::string>& dnsservers, const std::string& source, unsigned int sourceport)
+	{
+		if (!servers.empty())
+		{
+			ClearServers();
 
 			/* Remove expired entries from the cache */
 			this->Tick(ServerInstance->Time());
 		}
 
-		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
-
-		/* Initialize mastersocket */
-		int s = socket(myserver.family(), SOCK_DGRAM, 0);
-		this->SetFd(s);
-
-		/* Have we got a socket? */
-		if (this->GetFd() != -1)
+		sourceaddr = source;
+		for (std::vector<std::string>::const_iterator i = dnsservers.begin(); i != dnsservers.end(); ++i)
 		{
-			SocketEngine::SetReuse(s);
-			SocketEngine::NonBlocking(s);
-
-			irc::sockets::sockaddrs bindto;
-			if (sourceaddr.empty())
-			{
-				// set a sourceaddr for irc::sockets::aptosa() based on the servers af type
-				if (myserver.family() == AF_INET)
-					sourceaddr = "0.0.0.0";
-				else if (myserver.family() == AF_INET6)
-					sourceaddr = "::";
-			}
-			irc::sockets::aptosa(sourceaddr, sourceport, bindto);
-
-			if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
-			{
-				/* Failed to bind */
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error binding dns socket - hostnames will NOT resolve");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
-			else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+			irc::sockets::sockaddrs addr;
+			if (!irc::sockets::aptosa(*i, DNS::PORT, addr))
 			{
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Internal error starting DNS - hostnames will NOT resolve.");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
+				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Nameserver '%s' is not an IP address - it will NOT be used", i->c_str());
+				continue;
 			}
 
-			if (bindto.family() != myserver.family())
-				ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Nameserver address family differs from source address family - hostnames might not resolve");
-		}
-		else
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "Error creating DNS socket - hostnames will NOT resolve");
+			Nameserver* server = new Nameserver(this, addr);
+			if (server->Open(sourceaddr, sourceport))
+				servers.push_back(server);
+			else
+				delete server;
 		}
+
+		if (servers.empty())
+			ServerInstance->Logs->Log(MODNAME, LOG_SPARSE, "No usable nameservers - hostnames will NOT resolve");
 	}
+
+	const std::vector<Nameserver*>& GetServers() const { return servers; }
 };
 
-class ModuleDNS : public Module
+void Nameserver::OnEventHandlerRead()
+{
+	unsigned char buffer[524];
+	irc::sockets::sockaddrs from;
+	socklen_t x = sizeof(from);
+
+	int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+	if (length < Packet::HEADER_LENGTH)
+		return;
+
+	if (addr != from)
+	{
+		std::string server1 = from.str();
+		std::string server2 = addr.str();
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
+			server1.c_str(), server2.c_str());
+		return;
+	}
+
+	manager->OnAnswer(this, buffer, length);
+}
+
+bool PendingQuestion::Tick(time_t now)
+{
+	manager->Retry(this);
+	return true;
+}
+
+void TCPQuery::OnDataReady()
+{
+	if (!pending || recvq.length() < 2)
+		return;
+
+	const unsigned short length = static_cast<unsigned char>(recvq[0]) << 8 | static_cast<unsigned char>(recvq[1]);
+	if (recvq.length() < 2U + length)
+		return;
+
+	manager->OnAnswer(this, reinterpret_cast<const unsigned char*>(recvq.data()) + 2, length);
+}
+
+void TCPQuery::OnError(BufferedSocketError e)
+{
+	if (!pending)
+		return;
+
+	ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unable to ask for the answer to %s over TCP: %s", pending->question.name.c_str(), getError().c_str());
+	manager->OnTCPError(this);
+}
+
+class ModuleDNS : public Module, public Stats::EventListener
 {
 	MyManager manager;
 	std::string DNSServer;
@@ -760,14 +1462,21 @@ class ModuleDNS : public Module
 			if (pFixedInfo)
 			{
 				if (GetNetworkParams(pFixedInfo, &dwBufferSize) == NO_ERROR)
-					DNSServer = pFixedInfo->DnsServerList.IpAddress.String;
+				{
+					for (IP_ADDR_STRING* addr = &pFixedInfo->DnsServerList; addr; addr = addr->Next)
+					{
+						if (!DNSServer.empty())
+							DNSServer.push_back(' ');
+						DNSServer.append(addr->IpAddress.String);
+					}
+				}
 
 				HeapFree(GetProcessHeap(), 0, pFixedInfo);
 			}
 
 			if (!DNSServer.empty())
 			{
-				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as first active resolver in the system settings.", DNSServer.c_str());
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as the active resolvers in the system settings.", DNSServer.c_str());
 				return;
 			}
 		}
@@ -779,26 +1488,35 @@ class ModuleDNS : public Module
 
 		std::ifstream resolv("/etc/resolv.conf");
 
-		while (resolv >> DNSServer)
+		std::string token;
+		while (resolv >> token)
 		{
-			if (DNSServer == "nameserver")
+			if (token == "nameserver")
 			{
-				resolv >> DNSServer;
-				if (DNSServer.find_first_not_of("0123456789.") == std::string::npos || DNSServer.find_first_not_of("0123456789ABCDEFabcdef:") == std::string::npos)
+				resolv >> token;
+				if (token.find_first_not_of("0123456789.") == std::string::npos || token.find_first_not_of("0123456789ABCDEFabcdef:") == std::string::npos)
 				{
-					ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",DNSServer.c_str());
-					return;
+					if (!DNSServer.empty())
+						DNSServer.push_back(' ');
+					DNSServer.append(token);
 				}
 			}
 		}
 
+		if (!DNSServer.empty())
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "<dns:server> set to '%s' as the resolvers in /etc/resolv.conf.", DNSServer.c_str());
+			return;
+		}
+
 		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
 		DNSServer = "127.0.0.1";
 	}
 
  public:
-	ModuleDNS() : manager(this)
+	ModuleDNS() : Stats::EventListener(this)
+		, manager(this)
 		, SourcePort(0)
 	{
 	}
@@ -817,27 +1535,42 @@ class ModuleDNS : public Module
 		if (DNSServer.empty())
 			FindDNSServer();
 
+		manager.SetCacheLimits(tag->getUInt("cachesize", 1000, 0, 1000000), tag->getDuration("cachettl", 60*60, 1), tag->getDuration("negativettl", 5*60, 0));
+
 		if (oldserver != DNSServer || oldip != SourceIP || oldport != SourcePort)
-			this->manager.Rehash(DNSServer, SourceIP, SourcePort);
+		{
+			std::vector<std::string> servers;
+			irc::spacesepstream serverstream(DNSServer);
+			for (std::string server; serverstream.GetToken(server); )
+				servers.push_back(server);
+			this->manager.Rehash(servers, SourceIP, SourcePort);
+		}
 	}
 
 	void OnUnloadModule(Module* mod) override
 	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
+		this->manager.FailRequests(mod, ERROR_UNLOADED);
+	}
 
-			if (req->creator == mod)
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() == 'T')
+		{
+			const MyManager::Statistics& dnsstats = manager.GetStats();
+			stats.AddRow(249, InspIRCd::Format("dns cache entries %lu hits %lu (%lu negative) misses %lu evictions %lu prefetches %lu",
+				(unsigned long)manager.GetCacheCount(), dnsstats.hits, dnsstats.negativehits, dnsstats.misses, dnsstats.evictions, dnsstats.prefetches));
+			stats.AddRow(249, InspIRCd::Format("dns queries coalesced %lu retried %lu truncated %lu",
+				dnsstats.coalesced, dnsstats.retries, dnsstats.truncated));
+
+			const std::vector<Nameserver*>& servers = manager.GetServers();
+			for (std::vector<Nameserver*>::const_iterator i = servers.begin(); i != servers.end(); ++i)
 			{
-				Query rr(req->question);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
-
-				delete req;
+				const Nameserver* server = *i;
+				stats.AddRow(249, InspIRCd::Format("dns server %s latency %lu ms sent %lu answered %lu timeouts %lu pending %lu",
+					server->addr.addr().c_str(), server->latency, server->sent, server->answered, server->timeouts, (unsigned long)server->pending.size()));
 			}
 		}
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() override
@@ -72,7 +72,7 @@ class UserResolver : public DNS::Request
 			return;
 		}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "DNS result for %s: '%s' -> '%s'", uuid.c_str(), ans_record->name.c_str(), ans_record->rdata.c_str());
+		LOG_IF_ENABLED(MODNAME, LOG_DEBUG, "DNS result for %s: '%s' -> '%s'", uuid.c_str(), ans_record->name.c_str(), ans_record->rdata.c_str());
 
 		if (!fwd)
 		{
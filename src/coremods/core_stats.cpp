@@ -209,6 +209,8 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "Read events:  "+ConvToStr(sestats.ReadEvents));
 			stats.AddRow(249, "Write events: "+ConvToStr(sestats.WriteEvents));
 			stats.AddRow(249, "Error events: "+ConvToStr(sestats.ErrorEvents));
+			stats.AddRow(249, "Mask changes: "+ConvToStr(sestats.MaskChanges));
+			stats.AddRow(249, "Mask updates: "+ConvToStr(sestats.MaskUpdates)+" ("+ConvToStr(sestats.MaskChanges - sestats.MaskUpdates)+" saved)");
 			break;
 		}
 
@@ -233,6 +235,7 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "Users: "+ConvToStr(ServerInstance->Users->GetUsers().size()));
 			stats.AddRow(249, "Channels: "+ConvToStr(ServerInstance->GetChans().size()));
 			stats.AddRow(249, "Commands: "+ConvToStr(ServerInstance->Parser.GetCommands().size()));
+			stats.AddRow(249, "Dropped log lines: "+ConvToStr(ServerInstance->Logs->GetDroppedLines()));
 
 			float kbitpersec_in, kbitpersec_out, kbitpersec_total;
 			SocketEngine::GetStats().GetBandwidth(kbitpersec_in, kbitpersec_out, kbitpersec_total);
@@ -314,6 +317,15 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "connection count "+ConvToStr(ServerInstance->stats.Connects));
 			stats.AddRow(249, InspIRCd::Format("bytes sent %5.2fK recv %5.2fK",
 				ServerInstance->stats.Sent / 1024.0, ServerInstance->stats.Recv / 1024.0));
+			const unsigned long serializations = ServerInstance->stats.SerializeHits + ServerInstance->stats.SerializeMisses;
+			stats.AddRow(249, InspIRCd::Format("serialization cache hits %lu misses %lu (%.2f%% hit rate)",
+				ServerInstance->stats.SerializeHits, ServerInstance->stats.SerializeMisses,
+				serializations ? ServerInstance->stats.SerializeHits * 100.0 / serializations : 0.0));
+			const TimerManager::Statistics& timerstats = ServerInstance->Timers.GetStats();
+			stats.AddRow(249, InspIRCd::Format("timers pending %lu added %lu cancelled %lu fired %lu cascaded %lu",
+				(unsigned long)ServerInstance->Timers.GetCount(), timerstats.Added, timerstats.Cancelled, timerstats.Fired, timerstats.Cascaded));
+			stats.AddRow(249, InspIRCd::Format("timer runs %lu average %.3f ms max %.3f ms", timerstats.Runs,
+				timerstats.Runs ? timerstats.RunTime / 1000.0 / timerstats.Runs : 0.0, timerstats.MaxRunTime / 1000.0));
 		}
 		break;
 
@@ -49,10 +49,10 @@ void CullList::Apply()
 		if (gone.insert(c).second)
 		{
 #ifdef INSPIRCD_ENABLE_RTTI
-			ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "Deleting %s @%p", typeid(*c).name(),
+			LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "Deleting %s @%p", typeid(*c).name(),
 				(void*)c);
 #else
-			ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "Deleting @%p", (void*)c);
+			LOG_IF_ENABLED("CULLLIST", LOG_DEBUG, "Deleting @%p", (void*)c);
 #endif
 			c->cull();
 			queue.push_back(c);
@@ -0,0 +1,123 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "editdistance.h"
+
+namespace
+{
+	/** Advances one block of the pattern by one text character. This is the block based
+	 * variant of Myers' algorithm by Hyyrö: the horizontal delta at the top of the block
+	 * comes from the block above it and the one at the bottom is handed to the block below.
+	 * @param pv The positive vertical deltas of the block.
+	 * @param mv The negative vertical deltas of the block.
+	 * @param eq The positions in the block where the text character occurs in the pattern.
+	 * @param hin The horizontal delta at the top of the block.
+	 * @param last The bit of the row whose horizontal delta is returned.
+	 * @return The horizontal delta at the given row.
+	 */
+	inline int AdvanceBlock(uint64_t& pv, uint64_t& mv, uint64_t eq, int hin, uint64_t last)
+	{
+		const uint64_t hinneg = hin < 0 ? 1 : 0;
+		const uint64_t xv = eq | mv;
+		eq |= hinneg;
+		const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+
+		int hout = 0;
+		if (ph & last)
+			hout = 1;
+		else if (mh & last)
+			hout = -1;
+
+		ph <<= 1;
+		mh <<= 1;
+		mh |= hinneg;
+		if (hin > 0)
+			ph |= 1;
+
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		return hout;
+	}
+}
+
+EditDistance::EditDistance()
+	: blocks(0)
+{
+}
+
+void EditDistance::SetPattern(const std::string& Pattern)
+{
+	const size_t newblocks = (Pattern.length() + WORD_BITS - 1) / WORD_BITS;
+	if (newblocks != blocks)
+	{
+		blocks = newblocks;
+		peq.assign(256 * blocks, 0);
+		pv.resize(blocks);
+		mv.resize(blocks);
+	}
+	else
+	{
+		// Only the rows of the bytes in the old pattern have bits set.
+		for (std::string::const_iterator i = pattern.begin(); i != pattern.end(); ++i)
+			std::fill_n(peq.begin() + static_cast<unsigned char>(*i) * blocks, blocks, 0);
+	}
+
+	pattern = Pattern;
+	for (size_t i = 0; i < pattern.length(); ++i)
+		peq[static_cast<unsigned char>(pattern[i]) * blocks + i / WORD_BITS] |= uint64_t(1) << (i % WORD_BITS);
+}
+
+size_t EditDistance::Compute(const std::string& text, size_t max)
+{
+	const size_t m = pattern.length();
+	const size_t n = text.length();
+
+	// The distance is at least the difference of the lengths.
+	if ((m > n ? m - n : n - m) > max)
+		return max + 1;
+	if (!m || !n)
+		return std::max(m, n);
+
+	std::fill(pv.begin(), pv.end(), ~uint64_t(0));
+	std::fill(mv.begin(), mv.end(), 0);
+
+	const uint64_t high = uint64_t(1) << (WORD_BITS - 1);
+	const uint64_t last = uint64_t(1) << ((m - 1) % WORD_BITS);
+	size_t score = m;
+	for (size_t j = 0; j < n; ++j)
+	{
+		const uint64_t* eq = &peq[static_cast<unsigned char>(text[j]) * blocks];
+
+		// The first row of the matrix grows by one in every column.
+		int carry = 1;
+		for (size_t b = 0; b + 1 < blocks; ++b)
+			carry = AdvanceBlock(pv[b], mv[b], eq[b], carry, high);
+		carry = AdvanceBlock(pv[blocks - 1], mv[blocks - 1], eq[blocks - 1], carry, last);
+		if (carry > 0)
+			score++;
+		else if (carry < 0)
+			score--;
+
+		// The distance can go down by at most one for each of the remaining characters.
+		if (score > max + (n - j - 1))
+			return max + 1;
+	}
+	return score;
+}
@@ -117,6 +117,7 @@ void InspIRCd::Cleanup()
 	DeleteZero(this->Config);
 	SocketEngine::Deinit();
 	Logs->CloseLogs();
+	Logs->StopWriter();
 }
 
 void InspIRCd::SetSignals()
@@ -666,9 +667,6 @@ void InspIRCd::Run()
 				XLines->GetAll("E");
 			}
 
-			Timers.TickTimers(TIME.tv_sec);
-			Users->DoBackgroundUserStuff();
-
 			if ((TIME.tv_sec % 5) == 0)
 			{
 				FOREACH_MOD(OnBackgroundTimer, (TIME.tv_sec));
@@ -676,6 +674,9 @@ void InspIRCd::Run()
 			}
 		}
 
+		// Timers can have a sub-second interval so check them every time.
+		Timers.TickTimers(TIME.tv_sec);
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
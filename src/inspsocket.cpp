@@ -110,7 +110,7 @@ BufferedSocketError BufferedSocket::BeginConnect(const irc::sockets::sockaddrs&
 	this->Timeout = new SocketTimeout(this->GetFd(), this, timeout);
 	ServerInstance->Timers.AddTimer(this->Timeout);
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "BufferedSocket::DoConnect success");
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "BufferedSocket::DoConnect success");
 	return I_ERR_NONE;
 }
 
@@ -141,17 +141,53 @@ CullResult StreamSocket::cull()
 	return EventHandler::cull();
 }
 
+char* StreamSocket::RecvQueue::get_tail(size_type& avail)
+{
+	// Moving the data is only worth it when it costs less than the data consumed before it
+	if ((start) && (start >= length()))
+	{
+		memmove(&buf[0], &buf[start], length());
+		finish -= start;
+		start = 0;
+	}
+
+	avail = buf.size() - finish;
+	return buf.data() + finish;
+}
+
+void StreamSocket::RecvQueue::reserve(size_type n)
+{
+	if (buf.size() - finish >= n)
+		return;
+
+	const size_type len = length();
+	if (buf.size() - len >= n)
+	{
+		// There is enough room if the data is moved to the front of the buffer
+		memmove(&buf[0], &buf[start], len);
+	}
+	else
+	{
+		std::vector<char> newbuf(std::max(buf.size() * 2, len + n));
+		memcpy(newbuf.data(), data(), len);
+		buf.swap(newbuf);
+	}
+
+	start = 0;
+	finish = len;
+}
+
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	RecvQueue::size_type i = recvq.find(delim);
+	if (i == RecvQueue::npos)
 		return false;
-	line.assign(recvq, 0, i);
-	recvq.erase(0, i + 1);
+	line.assign(recvq.data(), i);
+	recvq.erase_front(i + 1);
 	return true;
 }
 
-int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
+int StreamSocket::HookChainRead(IOHook* hook, RecvQueue& rq)
 {
 	if (!hook)
 		return ReadToRecvQ(rq);
@@ -169,7 +205,7 @@ int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
 
 void StreamSocket::DoRead()
 {
-	const std::string::size_type prevrecvqsize = recvq.size();
+	const RecvQueue::size_type prevrecvqsize = recvq.size();
 
 	const int result = HookChainRead(GetIOHook(), recvq);
 	if (result < 0)
@@ -182,19 +218,46 @@ void StreamSocket::DoRead()
 		OnDataReady();
 }
 
-int StreamSocket::ReadToRecvQ(std::string& rq)
+int StreamSocket::ReadToRecvQ(RecvQueue& rq)
 {
+		// Read into the free space of the recvq directly and only use the
+		// shared read buffer for whatever does not fit in there.
+		const size_t bufsize = ServerInstance->Config->NetBufferSize;
+		RecvQueue::size_type tailsize;
+		char* const tail = rq.get_tail(tailsize);
+		tailsize = std::min<RecvQueue::size_type>(tailsize, bufsize);
+
 		char* ReadBuffer = ServerInstance->GetReadBuffer();
-		int n = SocketEngine::Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
+		int n;
+		if (tailsize == bufsize)
+		{
+			n = SocketEngine::Recv(this, tail, tailsize, 0);
+		}
+		else
+		{
+			SocketEngine::IOVector iov[2];
+			iov[0].iov_base = tail;
+			iov[0].iov_len = tailsize;
+			iov[1].iov_base = ReadBuffer;
+			iov[1].iov_len = bufsize - tailsize;
+			n = SocketEngine::ReadV(this, iov, 2);
+		}
+
+		if (n > 0)
+		{
+			const size_t intail = std::min<size_t>(n, tailsize);
+			rq.commit(intail);
+			if (static_cast<size_t>(n) > intail)
+				rq.append(ReadBuffer, n - intail);
+		}
+
 		if (n == ServerInstance->Config->NetBufferSize)
 		{
 			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
-			rq.append(ReadBuffer, n);
 		}
 		else if (n > 0)
 		{
 			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ);
-			rq.append(ReadBuffer, n);
 		}
 		else if (n == 0)
 		{
@@ -372,6 +435,18 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
+	WriteData(SendQueue::Element(data));
+}
+
+void StreamSocket::WriteData(const SendQueue::Element& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %.*s",
+			(int)data.length(), data.data());
+		return;
+	}
+
 	/* Append the data to the back of the queue ready for writing */
 	sendq.push_back(data);
 
@@ -478,6 +553,32 @@ void StreamSocket::OnEventHandlerRead()
 	CheckError(I_ERR_OTHER);
 }
 
+void StreamSocket::OnThreadedRead(const char* data, size_t length, int errnum)
+{
+	if (!error.empty())
+		return;
+
+	if (!length)
+	{
+		SetError(errnum ? SocketEngine::GetError(errnum) : "Connection closed");
+		SocketEngine::ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+	}
+	else
+	{
+		recvq.append(data, length);
+		try
+		{
+			OnDataReady();
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Caught exception in socket processing on FD %d - '%s'", fd, ex.GetReason().c_str());
+			SetError(ex.GetReason());
+		}
+	}
+	CheckError(I_ERR_OTHER);
+}
+
 void StreamSocket::OnEventHandlerWrite()
 {
 	if (!error.empty())
@@ -0,0 +1,153 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "linescan.h"
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# define INSPIRCD_LINESCAN_SSE2
+# include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled with a function attribute so the rest of the server
+// does not need -mavx2 and still runs on CPUs without it.
+#if defined INSPIRCD_LINESCAN_SSE2 && (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+# define INSPIRCD_LINESCAN_AVX2
+# include <immintrin.h>
+#endif
+
+namespace
+{
+	const char* FindScalar(const char* begin, const char* end, char a, char b, char c, char d)
+	{
+		for (; begin != end; ++begin)
+		{
+			const char chr = *begin;
+			if ((chr == a) || (chr == b) || (chr == c) || (chr == d))
+				break;
+		}
+		return begin;
+	}
+
+#ifdef INSPIRCD_LINESCAN_SSE2
+	unsigned int CountTrailingZeros(unsigned int mask)
+	{
+#if defined __GNUC__ || defined __clang__
+		return __builtin_ctz(mask);
+#else
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#endif
+	}
+
+	const char* FindSSE2(const char* begin, const char* end, char a, char b, char c, char d)
+	{
+		const __m128i va = _mm_set1_epi8(a);
+		const __m128i vb = _mm_set1_epi8(b);
+		const __m128i vc = _mm_set1_epi8(c);
+		const __m128i vd = _mm_set1_epi8(d);
+		for (; end - begin >= 16; begin += 16)
+		{
+			const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+			const __m128i match = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, vc), _mm_cmpeq_epi8(chunk, vd)));
+			const unsigned int mask = _mm_movemask_epi8(match);
+			if (mask)
+				return begin + CountTrailingZeros(mask);
+		}
+		return FindScalar(begin, end, a, b, c, d);
+	}
+#endif
+
+#ifdef INSPIRCD_LINESCAN_AVX2
+	__attribute__((target("avx2")))
+	const char* FindAVX2(const char* begin, const char* end, char a, char b, char c, char d)
+	{
+		const __m256i va = _mm256_set1_epi8(a);
+		const __m256i vb = _mm256_set1_epi8(b);
+		const __m256i vc = _mm256_set1_epi8(c);
+		const __m256i vd = _mm256_set1_epi8(d);
+		for (; end - begin >= 32; begin += 32)
+		{
+			const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+			const __m256i match = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(chunk, vc), _mm256_cmpeq_epi8(chunk, vd)));
+			const unsigned int mask = _mm256_movemask_epi8(match);
+			if (mask)
+				return begin + CountTrailingZeros(mask);
+		}
+
+		// Finish off with 16 byte strides here rather than calling FindSSE2() as mixing
+		// legacy SSE instructions with AVX ones is slow on a lot of CPUs.
+		const __m128i sa = _mm256_castsi256_si128(va);
+		const __m128i sb = _mm256_castsi256_si128(vb);
+		const __m128i sc = _mm256_castsi256_si128(vc);
+		const __m128i sd = _mm256_castsi256_si128(vd);
+		for (; end - begin >= 16; begin += 16)
+		{
+			const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+			const __m128i match = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, sa), _mm_cmpeq_epi8(chunk, sb)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, sc), _mm_cmpeq_epi8(chunk, sd)));
+			const unsigned int mask = _mm_movemask_epi8(match);
+			if (mask)
+				return begin + CountTrailingZeros(mask);
+		}
+		return FindScalar(begin, end, a, b, c, d);
+	}
+#endif
+
+	std::vector<LineScan::Implementation> DetectImplementations()
+	{
+		std::vector<LineScan::Implementation> impls;
+
+		LineScan::Implementation scalar = { "scalar", FindScalar };
+		impls.push_back(scalar);
+
+#ifdef INSPIRCD_LINESCAN_SSE2
+		LineScan::Implementation sse2 = { "sse2", FindSSE2 };
+		impls.push_back(sse2);
+#endif
+
+#ifdef INSPIRCD_LINESCAN_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			LineScan::Implementation avx2 = { "avx2", FindAVX2 };
+			impls.push_back(avx2);
+		}
+#endif
+
+		return impls;
+	}
+
+	const std::vector<LineScan::Implementation> Supported = DetectImplementations();
+	const LineScan::Implementation Best = Supported.back();
+}
+
+const std::vector<LineScan::Implementation>& LineScan::GetSupported()
+{
+	return Supported;
+}
+
+const LineScan::Implementation& LineScan::GetBest()
+{
+	return Best;
+}
@@ -125,7 +125,7 @@ void ListenSocket::OnEventHandlerRead()
 	socklen_t length = sizeof(client);
 	int incomingSockfd = SocketEngine::Accept(this, &client.sa, &length);
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Accepting connection on socket %s fd %d", bind_sa.str().c_str(), incomingSockfd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Accepting connection on socket %s fd %d", bind_sa.str().c_str(), incomingSockfd);
 	if (incomingSockfd < 0)
 	{
 		ServerInstance->stats.Refused++;
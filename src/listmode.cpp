@@ -19,6 +19,80 @@
 #include "inspircd.h"
 #include "listmode.h"
 
+uint64_t ListModeBase::lastgeneration = 0;
+
+ListModeBase::MaskIndex::MaskIndex(const ModeList& list)
+	: map(national_case_insensitive_map)
+	, hosts(map)
+{
+	// Entries are referenced by pointer so the vector must not reallocate after this.
+	entries.reserve(list.size());
+	for (ModeList::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		const std::string& mask = i->mask;
+		if ((mask.length() <= 2) || (mask[1] == ':'))
+		{
+			extbans.push_back(mask);
+			continue;
+		}
+
+		std::string::size_type at = mask.find('@');
+		if (at == std::string::npos)
+			continue;
+
+		entries.push_back(Entry(mask, at));
+		const Entry& entry = entries.back();
+		if (entry.host.IsCIDR())
+			cidrs.push_back(&entry);
+		else
+			hosts.Add(entry.host, &entry);
+	}
+}
+
+bool ListModeBase::MaskIndex::Matches(User* user) const
+{
+	const std::string nickident = user->nick + "!" + user->ident;
+
+	// Masks whose host part is not a CIDR range match the IP address like any other host.
+	std::vector<const Entry*> found;
+	hosts.Find(user->GetRealHost(), found);
+	if (user->GetDisplayedHost() != user->GetRealHost())
+		hosts.Find(user->GetDisplayedHost(), found);
+	hosts.Find(user->GetIPString(), found);
+	for (std::vector<const Entry*>::const_iterator i = found.begin(); i != found.end(); ++i)
+	{
+		if ((*i)->nickident.Match(nickident))
+			return true;
+	}
+
+	for (std::vector<const Entry*>::const_iterator i = cidrs.begin(); i != cidrs.end(); ++i)
+	{
+		const Entry* entry = *i;
+		if (entry->nickident.Match(nickident) && (entry->host.Match(user->GetRealHost()) ||
+			entry->host.Match(user->GetDisplayedHost()) || entry->host.MatchCIDR(user->GetIPString())))
+			return true;
+	}
+	return false;
+}
+
+bool ListModeBase::MaskIndex::Matches(const std::string& nickident, const std::string& host) const
+{
+	std::vector<const Entry*> found;
+	hosts.Find(host, found);
+	for (std::vector<const Entry*>::const_iterator i = found.begin(); i != found.end(); ++i)
+	{
+		if ((*i)->nickident.Match(nickident))
+			return true;
+	}
+
+	for (std::vector<const Entry*>::const_iterator i = cidrs.begin(); i != cidrs.end(); ++i)
+	{
+		if ((*i)->nickident.Match(nickident) && (*i)->host.Match(host))
+			return true;
+	}
+	return false;
+}
+
 ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modechar, const std::string& eolstr, unsigned int lnum, unsigned int eolnum, bool autotidy)
 	: ModeHandler(Creator, Name, modechar, PARAM_ALWAYS, MODETYPE_CHANNEL, MC_LIST)
 	, listnumeric(lnum)
@@ -122,6 +196,35 @@ unsigned int ListModeBase::GetLimitInternal(const std::string& channame, ChanDat
 	return cd->maxitems;
 }
 
+const ListModeBase::MaskIndex* ListModeBase::GetMasks(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return NULL;
+
+	// The index has to be rebuilt if m_nationalchars has changed the case map since it was built.
+	if (cd->index && cd->index->GetMap() != national_case_insensitive_map)
+	{
+		delete cd->index;
+		cd->index = NULL;
+	}
+
+	if (!cd->index)
+		cd->index = new MaskIndex(cd->list);
+	return cd->index;
+}
+
+void ListModeBase::ChangeGenerations()
+{
+	const chan_hash& chans = ServerInstance->GetChans();
+	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	{
+		ChanData* cd = extItem.get(i->second);
+		if (cd)
+			cd->Changed();
+	}
+}
+
 unsigned int ListModeBase::GetLimit(Channel* channel)
 {
 	ChanData* cd = extItem.get(channel);
@@ -197,6 +300,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->Changed();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -215,6 +319,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 				if (parameter == it->mask)
 				{
 					stdalgo::vector::swaperase(cd->list, it);
+					cd->Changed();
 					return MODEACTION_ALLOW;
 				}
 			}
@@ -21,6 +21,9 @@
 
 
 #include "inspircd.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 /*
  * Suggested implementation...
@@ -49,11 +52,310 @@
  *
  */
 
+namespace
+{
+	/** The number of log lines which can be queued for the log writer thread. */
+	const size_t LOG_QUEUE_SIZE = 16384;
+
+	/** The maximum number of log lines which are written out at once. */
+	const size_t LOG_BATCH_SIZE = 1024;
+
+	/** The maximum number of milliseconds to wait for queued log lines to be written out on rehash or shutdown. */
+	const unsigned long LOG_FLUSH_TIMEOUT = 2000;
+
+	/** A bounded queue which several threads can push to and one thread pops from without locking.
+	 * Every cell has a sequence number which tells whether it is free to write to or ready to be
+	 * read, so producers only contend on claiming a position.
+	 */
+	template <typename T>
+	class MPSCRing
+	{
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T data;
+		};
+
+		std::unique_ptr<Cell[]> cells;
+		const size_t mask;
+
+		/** The next position producers write to. */
+		std::atomic<size_t> head;
+
+		/** The next position the consumer reads from. */
+		size_t tail;
+
+	 public:
+		/** Creates a queue.
+		 * @param size The number of cells, which must be a power of two.
+		 */
+		MPSCRing(size_t size)
+			: cells(new Cell[size])
+			, mask(size - 1)
+			, head(0)
+			, tail(0)
+		{
+			for (size_t i = 0; i < size; ++i)
+				cells[i].sequence.store(i);
+		}
+
+		/** Pushes a value, swapping it into the queue.
+		 * @return True if the value was pushed, false if the queue is full.
+		 */
+		bool Push(T& value)
+		{
+			Cell* cell;
+			size_t pos = head.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				cell = &cells[pos & mask];
+				const intptr_t diff = intptr_t(cell->sequence.load()) - intptr_t(pos);
+				if (!diff)
+				{
+					if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+					return false;
+				else
+					pos = head.load(std::memory_order_relaxed);
+			}
+
+			std::swap(cell->data, value);
+			cell->sequence.store(pos + 1);
+			return true;
+		}
+
+		/** Pops a value. Must only be called by the consumer.
+		 * @return True if a value was popped, false if the queue is empty.
+		 */
+		bool Pop(T& value)
+		{
+			Cell& cell = cells[tail & mask];
+			if (cell.sequence.load() != tail + 1)
+				return false;
+
+			std::swap(value, cell.data);
+			cell.sequence.store(tail + mask + 1);
+			tail++;
+			return true;
+		}
+
+		/** Determines whether there is nothing to pop. Must only be called by the consumer. */
+		bool Empty() const
+		{
+			return cells[tail & mask].sequence.load() != tail + 1;
+		}
+
+		/** Retrieves the number of values which have been pushed so far. */
+		size_t GetPushed() const
+		{
+			return head.load();
+		}
+	};
+}
+
+/** Writes the lines of asynchronous log files in batches so the main thread never waits for the disk. */
+class LogWriterThread final : public QueuedThread
+{
+	/** A line to write to a log file. */
+	struct Record
+	{
+		/** The file to write the line to. */
+		FILE* file;
+
+		/** The line to write. */
+		std::string line;
+
+		/** If true then the file is closed once everything queued before this record has been written. */
+		bool close;
+
+		Record() : file(NULL), close(false) { }
+	};
+
+	MPSCRing<Record> queue;
+
+	/** Whether the thread is waiting for lines to be queued. */
+	std::atomic<bool> sleeping;
+
+	/** The number of records which have been handled. */
+	std::atomic<size_t> handled;
+
+	/** The number of lines which were dropped because the queue was full. */
+	std::atomic<unsigned long> dropped;
+
+	/** Lines waiting to be written to each file in the current batch. */
+	std::vector<std::pair<FILE*, std::string> > pending;
+
+	/** Retrieves the buffer of lines for a file in the current batch. */
+	std::string& GetBuffer(FILE* file)
+	{
+		for (std::vector<std::pair<FILE*, std::string> >::iterator i = pending.begin(); i != pending.end(); ++i)
+		{
+			if (i->first == file)
+				return i->second;
+		}
+		pending.push_back(std::make_pair(file, std::string()));
+		return pending.back().second;
+	}
+
+	/** Writes out and flushes the lines buffered for a file. */
+	void WriteBuffer(FILE* file)
+	{
+		std::string& buffer = GetBuffer(file);
+		if (!buffer.empty())
+		{
+			fwrite(buffer.data(), 1, buffer.length(), file);
+			buffer.clear();
+		}
+		fflush(file);
+	}
+
+	void Enqueue(Record& record, bool mustqueue)
+	{
+		while (!queue.Push(record))
+		{
+			if (!mustqueue)
+			{
+				dropped++;
+				return;
+			}
+			std::this_thread::yield();
+		}
+
+		if (sleeping.load())
+		{
+			LockQueue();
+			UnlockQueueWakeup();
+		}
+	}
+
+ public:
+	LogWriterThread()
+		: queue(LOG_QUEUE_SIZE)
+		, sleeping(false)
+		, handled(0)
+		, dropped(0)
+	{
+	}
+
+	/** Queues a line to be written to a log file. */
+	void Write(FILE* file, const std::string& line)
+	{
+		Record record;
+		record.file = file;
+		record.line = line;
+		Enqueue(record, false);
+	}
+
+	/** Queues closing a log file once everything queued for it has been written. */
+	void Close(FILE* file)
+	{
+		Record record;
+		record.file = file;
+		record.close = true;
+		Enqueue(record, true);
+	}
+
+	/** Waits until everything queued so far has been written.
+	 * @param timeout The maximum number of milliseconds to wait for.
+	 * @return True if everything was written; otherwise, false.
+	 */
+	bool Flush(unsigned long timeout)
+	{
+		const size_t target = queue.GetPushed();
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+		while (handled.load() < target)
+		{
+			if (std::chrono::steady_clock::now() >= deadline)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	unsigned long GetDropped() const
+	{
+		return dropped.load();
+	}
+
+	void Run() override
+	{
+		unsigned long reported = 0;
+		Record record;
+		for (;;)
+		{
+			size_t count = 0;
+			while (count < LOG_BATCH_SIZE && queue.Pop(record))
+			{
+				count++;
+				if (record.close)
+				{
+					WriteBuffer(record.file);
+					fclose(record.file);
+					for (std::vector<std::pair<FILE*, std::string> >::iterator i = pending.begin(); i != pending.end(); ++i)
+					{
+						if (i->first == record.file)
+						{
+							pending.erase(i);
+							break;
+						}
+					}
+				}
+				else
+				{
+					GetBuffer(record.file).append(record.line);
+				}
+				record.line.clear();
+			}
+
+			if (count)
+			{
+				const unsigned long nowdropped = dropped.load();
+				for (std::vector<std::pair<FILE*, std::string> >::iterator i = pending.begin(); i != pending.end(); ++i)
+				{
+					if (nowdropped != reported)
+						i->second.append(InspIRCd::Format("%lu log lines were dropped because the log queue was full\n", nowdropped - reported));
+					WriteBuffer(i->first);
+				}
+				if (!pending.empty())
+					reported = nowdropped;
+				pending.clear();
+				handled += count;
+				continue;
+			}
+
+			LockQueue();
+			sleeping.store(true);
+			if (queue.Empty())
+			{
+				if (GetExitFlag())
+				{
+					UnlockQueue();
+					return;
+				}
+				WaitForQueue();
+			}
+			sleeping.store(false);
+			UnlockQueue();
+		}
+	}
+};
+
 const char LogStream::LogHeader[] =
 	"Log started for " INSPIRCD_VERSION " (" MODULE_INIT_STR ")";
 
+void LogStream::ChangeLevel(LogLevel lvl)
+{
+	this->loglvl = lvl;
+	ServerInstance->Logs->UpdateLevels();
+}
+
 LogManager::LogManager()
 	: Logging(false)
+	, writer(NULL)
+	, GlobalLevel(LOG_NONE)
+	, MinLevel(LOG_NONE)
 {
 }
 
@@ -119,7 +421,7 @@ void LogManager::OpenFileLogs()
 			struct tm *mytime = gmtime(&time);
 			strftime(realtarget, sizeof(realtarget), target.c_str(), mytime);
 			FILE* f = fopen(realtarget, "a");
-			fw = new FileWriter(f, tag->getUInt("flush", 20, 1, UINT_MAX));
+			fw = new FileWriter(f, tag->getUInt("flush", 20, 1, UINT_MAX), tag->getBool("async"));
 			logmap.insert(std::make_pair(target, fw));
 		}
 		else
@@ -146,6 +448,96 @@ void LogManager::CloseLogs()
 	}
 
 	AllLogStreams.clear();
+	UpdateLevels();
+
+	// Give the log writer thread a chance to write out what was logged before the logs were closed.
+	if (writer)
+		writer->Flush(LOG_FLUSH_TIMEOUT);
+}
+
+LogWriterThread* LogManager::GetWriter()
+{
+	if (!writer)
+	{
+		writer = new LogWriterThread;
+		try
+		{
+			ServerInstance->Threads.Start(writer);
+		}
+		catch (CoreException&)
+		{
+			// Fall back to writing on the main thread.
+			delete writer;
+			writer = NULL;
+		}
+	}
+	return writer;
+}
+
+void LogManager::StopWriter()
+{
+	if (!writer)
+		return;
+
+	writer->Flush(LOG_FLUSH_TIMEOUT);
+	writer->join();
+	delete writer;
+	writer = NULL;
+}
+
+unsigned long LogManager::GetDroppedLines() const
+{
+	return writer ? writer->GetDropped() : 0;
+}
+
+void LogManager::UpdateLevels()
+{
+	TypeLevels.clear();
+	GlobalLevel = LOG_NONE;
+	for (std::map<LogStream*, std::vector<std::string> >::const_iterator gi = GlobalLogStreams.begin(); gi != GlobalLogStreams.end(); ++gi)
+		GlobalLevel = std::min(GlobalLevel, gi->first->GetLevel());
+
+	// Types which are excluded from a global LogStream might have a higher level than the other types.
+	for (std::map<LogStream*, std::vector<std::string> >::const_iterator gi = GlobalLogStreams.begin(); gi != GlobalLogStreams.end(); ++gi)
+	{
+		for (std::vector<std::string>::const_iterator ei = gi->second.begin(); ei != gi->second.end(); ++ei)
+		{
+			if (TypeLevels.count(*ei))
+				continue;
+
+			LogLevel& level = TypeLevels[*ei];
+			level = LOG_NONE;
+			for (std::map<LogStream*, std::vector<std::string> >::const_iterator oi = GlobalLogStreams.begin(); oi != GlobalLogStreams.end(); ++oi)
+			{
+				if (!stdalgo::isin(oi->second, *ei))
+					level = std::min(level, oi->first->GetLevel());
+			}
+		}
+	}
+
+	// Types which have LogStreams of their own might have a lower level than the other types.
+	for (std::map<std::string, std::vector<LogStream*> >::const_iterator i = LogStreams.begin(); i != LogStreams.end(); ++i)
+	{
+		if (i->first == "*")
+			continue;
+
+		LogLevel& level = TypeLevels.insert(std::make_pair(i->first, GlobalLevel)).first->second;
+		for (std::vector<LogStream*>::const_iterator it = i->second.begin(); it != i->second.end(); ++it)
+			level = std::min(level, (*it)->GetLevel());
+	}
+
+	MinLevel = GlobalLevel;
+	for (std::map<std::string, LogLevel>::const_iterator ti = TypeLevels.begin(); ti != TypeLevels.end(); ++ti)
+		MinLevel = std::min(MinLevel, ti->second);
+}
+
+bool LogManager::IsEnabled(const std::string& type, LogLevel loglevel) const
+{
+	if (loglevel < MinLevel)
+		return false;
+
+	std::map<std::string, LogLevel>::const_iterator i = TypeLevels.find(type);
+	return loglevel >= (i == TypeLevels.end() ? GlobalLevel : i->second);
 }
 
 void LogManager::AddLogTypes(const std::string &types, LogStream* l, bool autoclose)
@@ -186,6 +578,7 @@ void LogManager::AddLogTypes(const std::string &types, LogStream* l, bool autocl
 	if (gi != GlobalLogStreams.end())
 	{
 		gi->second.swap(excludes); // Swap with the vector in the hash.
+		UpdateLevels();
 	}
 }
 
@@ -199,6 +592,7 @@ bool LogManager::AddLogType(const std::string &type, LogStream *l, bool autoclos
 	if (autoclose)
 		AllLogStreams[l]++;
 
+	UpdateLevels();
 	return true;
 }
 
@@ -213,8 +607,9 @@ void LogManager::DelLogStream(LogStream* l)
 	}
 
 	GlobalLogStreams.erase(l);
+	UpdateLevels();
 
-	std::map<LogStream*, int>::iterator ai = AllLogStreams.begin();
+	std::map<LogStream*, int>::iterator ai = AllLogStreams.find(l);
 	if (ai == AllLogStreams.end())
 	{
 		return; /* Done. */
@@ -251,6 +646,8 @@ bool LogManager::DelLogType(const std::string &type, LogStream *l)
 		return false;
 	}
 
+	UpdateLevels();
+
 	std::map<LogStream*, int>::iterator ai = AllLogStreams.find(l);
 	if (ai == AllLogStreams.end())
 	{
@@ -268,7 +665,8 @@ bool LogManager::DelLogType(const std::string &type, LogStream *l)
 
 void LogManager::Log(const std::string &type, LogLevel loglevel, const char *fmt, ...)
 {
-	if (Logging)
+	// Don't waste time formatting messages which nothing will log.
+	if (Logging || !IsEnabled(type, loglevel))
 		return;
 
 	std::string buf;
@@ -278,7 +676,7 @@ void LogManager::Log(const std::string &type, LogLevel loglevel, const char *fmt
 
 void LogManager::Log(const std::string &type, LogLevel loglevel, const std::string &msg)
 {
-	if (Logging)
+	if (Logging || !IsEnabled(type, loglevel))
 	{
 		return;
 	}
@@ -308,10 +706,11 @@ void LogManager::Log(const std::string &type, LogLevel loglevel, const std::stri
 }
 
 
-FileWriter::FileWriter(FILE* logfile, unsigned int flushcount)
+FileWriter::FileWriter(FILE* logfile, unsigned int flushcount, bool async)
 	: log(logfile)
 	, flush(flushcount)
 	, writeops(0)
+	, writer(async && logfile ? ServerInstance->Logs->GetWriter() : NULL)
 {
 }
 
@@ -322,6 +721,12 @@ void FileWriter::WriteLogLine(const std::string &line)
 // XXX: For now, just return. Don't throw an exception. It'd be nice to find out if this is happening, but I'm terrified of breaking so close to final release. -- w00t
 //		throw CoreException("FileWriter::WriteLogLine called with a closed logfile");
 
+	if (writer)
+	{
+		writer->Write(log, line);
+		return;
+	}
+
 	fputs(line.c_str(), log);
 	if (++writeops % flush == 0)
 	{
@@ -333,8 +738,15 @@ FileWriter::~FileWriter()
 {
 	if (log)
 	{
-		fflush(log);
-		fclose(log);
+		if (writer)
+		{
+			writer->Close(log);
+		}
+		else
+		{
+			fflush(log);
+			fclose(log);
+		}
 		log = NULL;
 	}
 }
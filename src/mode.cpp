@@ -204,10 +204,19 @@ ModeAction PrefixMode::OnModeChange(User* source, User*, Channel* chan, std::str
 
 void PrefixMode::Update(unsigned int rank, unsigned int setrank, unsigned int unsetrank, bool selfrm)
 {
+	const bool rankchanged = (rank != prefixrank);
 	prefixrank = rank;
 	ranktoset = setrank;
 	ranktounset = unsetrank;
 	selfremove = selfrm;
+
+	// Local member lists are sorted by rank so they need to be resorted if the rank changed
+	if (rankchanged)
+	{
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			i->second->SortLocalMembers();
+	}
 }
 
 ModeAction ParamModeBase::OnModeChange(User* source, User*, Channel* chan, std::string& parameter, bool adding)
@@ -520,7 +520,7 @@ namespace GnuTLS
 			retval = gnutls_record_recv_packet(sess, &packet);
 		}
 
-		void appendto(std::string& recvq)
+		void appendto(StreamSocket::RecvQueue& recvq)
 		{
 			// Copy data from GnuTLS buffers to recvq
 			gnutls_datum_t datum;
@@ -540,7 +540,7 @@ namespace GnuTLS
 			retval = gnutls_record_recv(sess, buffer, ServerInstance->Config->NetBufferSize);
 		}
 
-		void appendto(std::string& recvq)
+		void appendto(StreamSocket::RecvQueue& recvq)
 		{
 			// Copy data from ReadBuffer to recvq
 			recvq.append(buffer, retval);
@@ -1061,7 +1061,7 @@ info_done_dealloc:
 		CloseSession();
 	}
 
-	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) override
+	int OnStreamSocketRead(StreamSocket* user, StreamSocket::RecvQueue& recvq) override
 	{
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
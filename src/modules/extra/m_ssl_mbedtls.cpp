@@ -682,7 +682,7 @@ class mbedTLSIOHook : public SSLIOHook
 		CloseSession();
 	}
 
-	int OnStreamSocketRead(StreamSocket* sock, std::string& recvq) override
+	int OnStreamSocketRead(StreamSocket* sock, StreamSocket::RecvQueue& recvq) override
 	{
 		// Finish handshake if needed
 		int prepret = PrepareIO(sock);
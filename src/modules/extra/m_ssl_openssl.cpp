@@ -688,7 +688,7 @@ class OpenSSLIOHook : public SSLIOHook
 		CloseSession();
 	}
 
-	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) override
+	int OnStreamSocketRead(StreamSocket* user, StreamSocket::RecvQueue& recvq) override
 	{
 		// Finish handshake if needed
 		int prepret = PrepareIO(user);
@@ -763,7 +763,7 @@ class OpenSSLIOHook : public SSLIOHook
 			ERR_clear_error();
 			FlattenSendQueue(sendq, GetProfile().GetOutgoingRecordSize());
 			const StreamSocket::SendQueue::Element& buffer = sendq.front();
-			int ret = SSL_write(sess, buffer.data(), buffer.size());
+			int ret = SSL_write(sess, buffer.data(), buffer.length());
 
 			if (!CheckRenego(user))
 				return -1;
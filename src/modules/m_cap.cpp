@@ -164,6 +164,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 			Capability* cap = i->second;
 			cap->Unregister();
 		}
+		ClientProtocol::Serializer::InvalidateTagCache();
 	}
 
 	void AddCap(Cap::Capability* cap) override
@@ -204,6 +205,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 		ServerInstance->Modules.DelReferent(cap);
 		cap->Unregister();
 		caps.erase(cap->GetName());
+		ClientProtocol::Serializer::InvalidateTagCache();
 	}
 
 	Capability* Find(const std::string& capname) const override
@@ -251,6 +253,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 		}
 
 		capext.set(user, usercaps);
+		ClientProtocol::Serializer::InvalidateTagCache(user);
 		return true;
 	}
 
@@ -288,6 +291,7 @@ class Cap::ManagerImpl : public Cap::Manager, public ReloadModule::EventListener
 	{
 		HandleList(result, user, false, false, true);
 		capext.unset(user);
+		ClientProtocol::Serializer::InvalidateTagCache(user);
 	}
 };
 
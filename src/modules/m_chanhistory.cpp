@@ -22,36 +22,689 @@
 #include "modules/ircv3_batch.h"
 #include "modules/server.h"
 
-struct HistoryItem
+#ifndef _WIN32
+# include <dirent.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+/** Keeps a single copy of every source mask which is in the history of a channel. */
+class MaskPool
+{
+	/** The masks and the number of lines which use them. */
+	typedef std::unordered_map<std::string, size_t> MaskMap;
+	MaskMap masks;
+
+ public:
+	/** Gets the pooled copy of a mask. It has to be released with Release() once it is not needed any more. */
+	const std::string* Acquire(const std::string& mask)
+	{
+		MaskMap::iterator it = masks.insert(std::make_pair(mask, 0)).first;
+		it->second++;
+		return &it->first;
+	}
+
+	void Release(const std::string* mask)
+	{
+		MaskMap::iterator it = masks.find(*mask);
+		if (--it->second == 0)
+			masks.erase(it);
+	}
+};
+
+class HistoryItem
 {
+	MaskPool& pool;
+
+ public:
 	time_t ts;
 	std::string text;
-	std::string sourcemask;
+	const std::string* const sourcemask;
+
+	/** The message which is replayed or NULL if it has not been built yet. It is kept between
+	 * joins so every form of it is only serialized once and then shared by the send queues of
+	 * all users who get the same form.
+	 */
+	ClientProtocol::Messages::Privmsg* msg;
 
-	HistoryItem(User* source, const std::string& Text)
-		: ts(ServerInstance->Time())
+	/** The reference tag of the batch the message was added to. */
+	std::string batchref;
+
+	HistoryItem(MaskPool& Pool, User* source, const std::string& Text)
+		: pool(Pool)
+		, ts(ServerInstance->Time())
 		, text(Text)
-		, sourcemask(source->GetFullHost())
+		, sourcemask(pool.Acquire(source->GetFullHost()))
+		, msg(NULL)
+	{
+	}
+
+	~HistoryItem()
+	{
+		delete msg;
+		pool.Release(sourcemask);
+	}
+
+	/** Drops the message so it is built again on the next replay. */
+	void Reset()
+	{
+		delete msg;
+		msg = NULL;
+	}
+};
+
+/** Keeps the history of channels in an append-only log on disk so it survives restarts and
+ * module reloads. The log is split into segments which are mapped into memory and lines are
+ * read from there when they are replayed so only the position of each line is kept on the heap.
+ * A segment is deleted once none of its lines are needed any more. The lines which are still
+ * needed from a segment which is mostly unneeded are copied to the newest segment first.
+ */
+class HistoryStore
+{
+ public:
+	/** The position of a line in the log. */
+	struct Entry
+	{
+		time_t ts;
+		uint32_t segment;
+		uint32_t offset;
+	};
+
+	/** The lines of a channel in the log, oldest first. */
+	struct ChannelLog
+	{
+		std::deque<Entry> entries;
+
+		/** Whether a channel with this name exists and has history enabled. */
+		bool claimed;
+
+		ChannelLog()
+			: claimed(false)
+		{
+		}
+	};
+
+ private:
+	/** The header of a line in the log. It is followed by the channel name, the source mask and the text. */
+	struct RecordHeader
+	{
+		uint32_t magic;
+		uint32_t textlen;
+		uint16_t chanlen;
+		uint16_t masklen;
+		uint32_t reserved;
+		int64_t ts;
+
+		/** The number of the line. Lines keep their number when they are copied to another segment. */
+		uint64_t id;
+	};
+
+	struct Segment
+	{
+		/** The file descriptor of the newest segment or -1 for the others. */
+		int fd;
+
+		/** The segment mapped into memory. The newest segment is mapped at the maximum segment size. */
+		char* map;
+		size_t mapsize;
+
+		/** The size of the segment. */
+		size_t size;
+
+		/** The size of the lines in the segment which are still needed. */
+		size_t live;
+	};
+
+	typedef std::unordered_map<std::string, ChannelLog, irc::insensitive, irc::StrHashComp> ChannelMap;
+	typedef std::map<uint32_t, Segment> SegmentMap;
+
+	static const uint32_t MAGIC = 0x48434e49;
+	static const size_t SEGMENT_SIZE = 16 * 1024 * 1024;
+
+	/** The directory which contains the segments. */
+	const std::string dir;
+
+	ChannelMap channels;
+	SegmentMap segments;
+
+	/** The number of the next line. */
+	uint64_t nextid;
+
+	std::string GetPath(uint32_t seq) const
+	{
+		return InspIRCd::Format("%s/%08x.log", dir.c_str(), seq);
+	}
+
+	const RecordHeader* GetHeader(const Segment& seg, uint32_t offset) const
+	{
+		return reinterpret_cast<const RecordHeader*>(seg.map + offset);
+	}
+
+	/** Gets the size of a record including the padding which keeps the next header aligned. */
+	static size_t GetRecordSize(const RecordHeader* header)
+	{
+		const size_t size = sizeof(RecordHeader) + header->chanlen + header->masklen + header->textlen;
+		return (size + alignof(RecordHeader) - 1) & ~(alignof(RecordHeader) - 1);
+	}
+
+	bool Map(Segment& seg, size_t size, int fd);
+	void Unmap(Segment& seg);
+	bool StartSegment();
+	void RemoveSegment(SegmentMap::iterator it);
+	bool Write(const char* data, size_t length, uint32_t& segment, uint32_t& offset);
+	void DropOldest(ChannelLog& log);
+
+ public:
+	HistoryStore(const std::string& Dir)
+		: dir(Dir)
+		, nextid(0)
+	{
+	}
+
+	~HistoryStore();
+
+	/** Retrieves the directory which contains the segments. */
+	const std::string& GetDirectory() const { return dir; }
+
+	/** Reads the log from disk.
+	 * @param maxlines The maximum number of lines to keep for a channel.
+	 * @param error Gets the reason if the log can not be read.
+	 * @return True if the log was read, false otherwise.
+	 */
+	bool Open(unsigned int maxlines, std::string& error);
+
+	/** Gets the lines of a channel and marks them as being in use. Lines which were read from disk
+	 * are only kept for channels which are claimed before ForgetUnclaimed() is called.
+	 */
+	ChannelLog* Claim(const std::string& channame)
+	{
+		ChannelLog* log = &channels[channame];
+		log->claimed = true;
+		return log;
+	}
+
+	/** Removes all lines of a channel. */
+	void Forget(const std::string& channame);
+
+	/** Adds a line to the history of a channel. */
+	void Append(ChannelLog& log, const std::string& channame, time_t ts, const std::string& mask, const std::string& text);
+
+	/** Removes the oldest lines of a channel until it has at most maxlen lines which are not older than mintime. */
+	void Trim(ChannelLog& log, size_t maxlen, time_t mintime)
 	{
+		while (!log.entries.empty() && (log.entries.size() > maxlen || log.entries.front().ts < mintime))
+			DropOldest(log);
 	}
+
+	/** Reads a line from the log. */
+	bool Read(const Entry& entry, std::string& mask, std::string& text) const;
+
+	/** Removes the history of all channels which have not been claimed. */
+	void ForgetUnclaimed()
+	{
+		for (ChannelMap::iterator i = channels.begin(); i != channels.end(); )
+		{
+			if (i->second.claimed)
+			{
+				++i;
+				continue;
+			}
+
+			Trim(i->second, 0, 0);
+			channels.erase(i++);
+		}
+	}
+
+	/** Copies the lines which are still needed out of segments which are mostly unneeded. */
+	void Compact();
 };
 
+#ifndef _WIN32
+
+HistoryStore::~HistoryStore()
+{
+	for (SegmentMap::iterator i = segments.begin(); i != segments.end(); ++i)
+		Unmap(i->second);
+}
+
+bool HistoryStore::Open(unsigned int maxlines, std::string& error)
+{
+	if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+	{
+		error = InspIRCd::Format("unable to create %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+
+	DIR* dirp = opendir(dir.c_str());
+	if (!dirp)
+	{
+		error = InspIRCd::Format("unable to read %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::vector<uint32_t> found;
+	while (dirent* entry = readdir(dirp))
+	{
+		const std::string name = entry->d_name;
+		if (name.length() == 12 && name.compare(8, 4, ".log") == 0 && name.find_first_not_of("0123456789abcdef") == 8)
+			found.push_back(strtoul(name.substr(0, 8).c_str(), NULL, 16));
+	}
+	closedir(dirp);
+	std::sort(found.begin(), found.end());
+
+	for (std::vector<uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+	{
+		const std::string path = GetPath(*i);
+		const bool newest = (*i == found.back());
+		int fd = open(path.c_str(), (newest ? O_RDWR | O_APPEND : O_RDONLY) | O_CLOEXEC);
+		struct stat sb;
+		if (fd < 0 || fstat(fd, &sb) != 0)
+		{
+			error = InspIRCd::Format("unable to open %s: %s", path.c_str(), strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+
+		Segment& seg = segments[*i];
+		seg.fd = -1;
+		seg.map = NULL;
+		seg.mapsize = 0;
+		seg.size = sb.st_size;
+		seg.live = 0;
+		if (!Map(seg, newest ? std::max<size_t>(seg.size, SEGMENT_SIZE) : seg.size, fd))
+		{
+			error = InspIRCd::Format("unable to map %s: %s", path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+
+		size_t offset = 0;
+		while (offset + sizeof(RecordHeader) <= seg.size)
+		{
+			const RecordHeader* header = GetHeader(seg, offset);
+			const size_t size = GetRecordSize(header);
+			if (header->magic != MAGIC || offset + size > seg.size)
+				break;
+
+			const Entry entry = { static_cast<time_t>(header->ts), *i, static_cast<uint32_t>(offset) };
+			channels[std::string(seg.map + offset + sizeof(RecordHeader), header->chanlen)].entries.push_back(entry);
+			nextid = std::max(nextid, header->id + 1);
+			seg.live += size;
+			offset += size;
+		}
+
+		if (offset != seg.size)
+		{
+			// The server probably stopped while it was writing the last line.
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Ignoring %lu bytes of damaged history at the end of %s",
+				static_cast<unsigned long>(seg.size - offset), path.c_str());
+			if (newest && ftruncate(fd, offset) == 0)
+				seg.size = offset;
+		}
+
+		if (newest)
+			seg.fd = fd;
+		else
+			close(fd);
+	}
+
+	for (ChannelMap::iterator i = channels.begin(); i != channels.end(); ++i)
+	{
+		ChannelLog& log = i->second;
+
+		// Lines which were copied out of an old segment are in a newer one than the lines around them.
+		struct IdOrder
+		{
+			const HistoryStore* store;
+			bool operator()(const Entry& a, const Entry& b) const
+			{
+				return store->GetHeader(store->segments.find(a.segment)->second, a.offset)->id
+					< store->GetHeader(store->segments.find(b.segment)->second, b.offset)->id;
+			}
+		} order = { this };
+		if (!std::is_sorted(log.entries.begin(), log.entries.end(), order))
+			std::stable_sort(log.entries.begin(), log.entries.end(), order);
+
+		Trim(log, maxlines, 0);
+	}
+
+	for (SegmentMap::iterator i = segments.begin(); i != segments.end(); )
+	{
+		SegmentMap::iterator seg = i++;
+		if (!seg->second.live && seg->second.fd < 0)
+			RemoveSegment(seg);
+	}
+
+	if ((segments.empty() || segments.rbegin()->second.fd < 0) && !StartSegment())
+	{
+		error = InspIRCd::Format("unable to create a segment in %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool HistoryStore::Map(Segment& seg, size_t size, int fd)
+{
+	if (!size)
+		return true;
+
+	void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+	seg.map = static_cast<char*>(map);
+	seg.mapsize = size;
+	return true;
+}
+
+void HistoryStore::Unmap(Segment& seg)
+{
+	if (seg.map)
+		munmap(seg.map, seg.mapsize);
+	if (seg.fd >= 0)
+		close(seg.fd);
+	seg.map = NULL;
+	seg.mapsize = 0;
+	seg.fd = -1;
+}
+
+bool HistoryStore::StartSegment()
+{
+	uint32_t seq = 0;
+	if (!segments.empty())
+	{
+		Segment& last = segments.rbegin()->second;
+		seq = segments.rbegin()->first + 1;
+
+		// The newest segment was mapped at the maximum size, map only the part which is in use.
+		close(last.fd);
+		last.fd = -1;
+		const std::string path = GetPath(segments.rbegin()->first);
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			Unmap(last);
+			Map(last, last.size, fd);
+			close(fd);
+		}
+	}
+
+	const std::string path = GetPath(seq);
+	int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+
+	Segment& seg = segments[seq];
+	seg.fd = -1;
+	seg.map = NULL;
+	seg.mapsize = 0;
+	seg.size = 0;
+	seg.live = 0;
+	if (!Map(seg, SEGMENT_SIZE, fd))
+	{
+		close(fd);
+		segments.erase(seq);
+		unlink(path.c_str());
+		return false;
+	}
+	seg.fd = fd;
+	return true;
+}
+
+void HistoryStore::RemoveSegment(SegmentMap::iterator it)
+{
+	Unmap(it->second);
+	unlink(GetPath(it->first).c_str());
+	segments.erase(it);
+}
+
+bool HistoryStore::Write(const char* data, size_t length, uint32_t& segment, uint32_t& offset)
+{
+	if (segments.empty() || segments.rbegin()->second.fd < 0)
+		return false;
+
+	if (segments.rbegin()->second.size + length > SEGMENT_SIZE && !StartSegment())
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to start a new history segment in %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+
+	Segment& seg = segments.rbegin()->second;
+	const ssize_t written = write(seg.fd, data, length);
+	if (written != static_cast<ssize_t>(length))
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to write history to %s: %s", GetPath(segments.rbegin()->first).c_str(),
+			written < 0 ? strerror(errno) : "short write");
+		// Don't leave a partial line behind for the next line to be appended to.
+		if (written > 0 && ftruncate(seg.fd, seg.size) != 0)
+			StartSegment();
+		return false;
+	}
+
+	segment = segments.rbegin()->first;
+	offset = seg.size;
+	seg.size += length;
+	seg.live += length;
+	return true;
+}
+
+void HistoryStore::DropOldest(ChannelLog& log)
+{
+	const Entry& entry = log.entries.front();
+	SegmentMap::iterator it = segments.find(entry.segment);
+	log.entries.pop_front();
+	if (it == segments.end())
+		return;
+
+	Segment& seg = it->second;
+	seg.live -= GetRecordSize(GetHeader(seg, entry.offset));
+	if (!seg.live && seg.fd < 0)
+		RemoveSegment(it);
+}
+
+void HistoryStore::Forget(const std::string& channame)
+{
+	ChannelMap::iterator it = channels.find(channame);
+	if (it == channels.end())
+		return;
+
+	Trim(it->second, 0, 0);
+	channels.erase(it);
+}
+
+void HistoryStore::Append(ChannelLog& log, const std::string& channame, time_t ts, const std::string& mask, const std::string& text)
+{
+	RecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MAGIC;
+	header.chanlen = std::min<size_t>(channame.length(), UINT16_MAX);
+	header.masklen = std::min<size_t>(mask.length(), UINT16_MAX);
+	header.textlen = text.length();
+	header.ts = ts;
+	header.id = nextid++;
+
+	std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+	record.append(channame, 0, header.chanlen);
+	record.append(mask, 0, header.masklen);
+	record.append(text);
+	record.resize(GetRecordSize(&header), '\0');
+
+	Entry entry = { ts, 0, 0 };
+	if (Write(record.data(), record.length(), entry.segment, entry.offset))
+		log.entries.push_back(entry);
+}
+
+bool HistoryStore::Read(const Entry& entry, std::string& mask, std::string& text) const
+{
+	SegmentMap::const_iterator it = segments.find(entry.segment);
+	if (it == segments.end() || !it->second.map)
+		return false;
+
+	const RecordHeader* header = GetHeader(it->second, entry.offset);
+	const char* data = it->second.map + entry.offset + sizeof(RecordHeader) + header->chanlen;
+	mask.assign(data, header->masklen);
+	text.assign(data + header->masklen, header->textlen);
+	return true;
+}
+
+void HistoryStore::Compact()
+{
+	// Segments of which less than a quarter is still needed are rewritten into the newest segment.
+	std::set<uint32_t> sparse;
+	for (SegmentMap::const_iterator i = segments.begin(); i != segments.end(); ++i)
+	{
+		const Segment& seg = i->second;
+		if (seg.fd < 0 && seg.live < seg.size / 4)
+			sparse.insert(i->first);
+	}
+	if (sparse.empty())
+		return;
+
+	for (ChannelMap::iterator i = channels.begin(); i != channels.end(); ++i)
+	{
+		std::deque<Entry>& entries = i->second.entries;
+		for (std::deque<Entry>::iterator entry = entries.begin(); entry != entries.end(); ++entry)
+		{
+			if (!sparse.count(entry->segment))
+				continue;
+
+			// Copy the record before writing it as writing it might start a new segment.
+			Segment& seg = segments.find(entry->segment)->second;
+			const RecordHeader* header = GetHeader(seg, entry->offset);
+			const size_t size = GetRecordSize(header);
+			const std::string record(reinterpret_cast<const char*>(header), size);
+			uint32_t segment;
+			uint32_t offset;
+			if (!Write(record.data(), record.length(), segment, offset))
+				return;
+
+			seg.live -= size;
+			entry->segment = segment;
+			entry->offset = offset;
+		}
+	}
+
+	for (std::set<uint32_t>::const_iterator i = sparse.begin(); i != sparse.end(); ++i)
+	{
+		SegmentMap::iterator seg = segments.find(*i);
+		if (seg != segments.end() && !seg->second.live)
+			RemoveSegment(seg);
+	}
+}
+
+#else
+
+// Persistent history needs mmap() which is not available on Windows.
+HistoryStore::~HistoryStore()
+{
+}
+
+bool HistoryStore::Open(unsigned int maxlines, std::string& error)
+{
+	error = "persistent history is not supported on Windows";
+	return false;
+}
+
+void HistoryStore::DropOldest(ChannelLog& log)
+{
+	log.entries.pop_front();
+}
+
+void HistoryStore::Forget(const std::string& channame)
+{
+	channels.erase(channame);
+}
+
+void HistoryStore::Append(ChannelLog& log, const std::string& channame, time_t ts, const std::string& mask, const std::string& text)
+{
+}
+
+bool HistoryStore::Read(const Entry& entry, std::string& mask, std::string& text) const
+{
+	return false;
+}
+
+void HistoryStore::Compact()
+{
+}
+
+#endif
+
 struct HistoryList
 {
-	std::deque<HistoryItem> lines;
+	/** The lines of the history, oldest first starting at head. */
+	std::vector<HistoryItem*> lines;
+	size_t head;
+	size_t count;
 	unsigned int maxlen, maxtime;
 	std::string param;
 
-	HistoryList(unsigned int len, unsigned int time, const std::string& oparam)
-		: maxlen(len), maxtime(time), param(oparam) { }
+	/** The lines of the history in the persistent store or NULL if the history is only kept in lines. */
+	HistoryStore::ChannelLog* log;
+
+	HistoryList(unsigned int len, unsigned int time, const std::string& oparam, HistoryStore::ChannelLog* Log)
+		: lines(Log ? 0 : len), head(0), count(0), maxlen(len), maxtime(time), param(oparam), log(Log) { }
+
+	~HistoryList()
+	{
+		for (size_t i = 0; i < count; ++i)
+			delete Get(i);
+
+		// The lines stay in the store when the module is unloaded so they can be claimed again.
+		if (log)
+			log->claimed = false;
+	}
+
+	/** Gets a line of the history with 0 being the oldest one. */
+	HistoryItem* Get(size_t index) const
+	{
+		return lines[(head + index) % lines.size()];
+	}
+
+	void Add(HistoryItem* item)
+	{
+		if (count < lines.size())
+		{
+			lines[(head + count) % lines.size()] = item;
+			count++;
+			return;
+		}
+
+		// The history is full so the oldest line is replaced.
+		delete lines[head];
+		lines[head] = item;
+		head = (head + 1) % lines.size();
+	}
+
+	void Resize(unsigned int len)
+	{
+		// Drop the oldest lines if the new line number limit is lower than the old one
+		for (; count > len; --count)
+		{
+			delete lines[head];
+			head = (head + 1) % lines.size();
+		}
+
+		std::vector<HistoryItem*> newlines(len);
+		for (size_t i = 0; i < count; ++i)
+			newlines[i] = Get(i);
+		lines.swap(newlines);
+		head = 0;
+		maxlen = len;
+	}
 };
 
 class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 {
  public:
 	unsigned int maxlines;
+	HistoryStore* store;
 	HistoryMode(Module* Creator)
 		: ParamMode<HistoryMode, SimpleExtItem<HistoryList> >(Creator, "history", 'H')
+		, store(NULL)
 	{
 	}
 
@@ -84,9 +737,10 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 		HistoryList* history = ext.get(channel);
 		if (history)
 		{
-			// Shrink the list if the new line number limit is lower than the old one
-			if (len < history->lines.size())
-				history->lines.erase(history->lines.begin(), history->lines.begin() + (history->lines.size() - len));
+			if (history->log)
+				store->Trim(*history->log, len, 0);
+			else if (len != history->maxlen)
+				history->Resize(len);
 
 			history->maxlen = len;
 			history->maxtime = time;
@@ -94,17 +748,85 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 		}
 		else
 		{
-			ext.set(channel, new HistoryList(len, time, parameter));
+			HistoryStore::ChannelLog* log = NULL;
+			if (store)
+			{
+				log = store->Claim(channel->name);
+				store->Trim(*log, len, time ? ServerInstance->Time() - time : 0);
+			}
+			ext.set(channel, new HistoryList(len, time, parameter, log));
 		}
 		return MODEACTION_ALLOW;
 	}
 
+	/** Drops the persistent history of a channel unless the module is being unloaded. */
+	void Forget(Channel* channel)
+	{
+		HistoryList* history = ext.get(channel);
+		if (!history || !history->log || creator->dying)
+			return;
+
+		history->log = NULL;
+		store->Forget(channel->name);
+	}
+
+	void OnUnset(User* source, Channel* channel) override
+	{
+		Forget(channel);
+	}
+
 	void SerializeParam(Channel* chan, const HistoryList* history, std::string& out)
 	{
 		out.append(history->param);
 	}
 };
 
+/** Drops the lines which have become too old and rewrites the persistent store when much of it is unneeded. */
+class CompactTimer : public Timer
+{
+	HistoryMode& mode;
+
+	/** Whether the channels which had history when the module was loaded are still being restored. */
+	bool restoring;
+
+ public:
+	CompactTimer(HistoryMode& Mode)
+		: Timer(1, true)
+		, mode(Mode)
+		, restoring(true)
+	{
+	}
+
+	bool Tick(time_t now) override
+	{
+		if (!mode.store)
+			return true;
+
+		if (restoring)
+		{
+			// Channels are restored while the module is loaded, e.g. by the permchannels module
+			// at startup or the reloadmodule module, so this is the first tick after that. The
+			// history of a channel which was not restored must not be shown to whoever creates
+			// the channel next.
+			mode.store->ForgetUnclaimed();
+			restoring = false;
+			SetInterval(60);
+			return true;
+		}
+
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		{
+			HistoryList* list = mode.ext.get(i->second);
+			if (list && list->log && list->maxtime)
+				mode.store->Trim(*list->log, list->maxlen, now - list->maxtime);
+		}
+
+		mode.store->Compact();
+		return true;
+	}
+};
+
 class ModuleChanHistory
 	: public Module
 	, public ServerEventListener
@@ -117,6 +839,43 @@ class ModuleChanHistory
 	IRCv3::Batch::API batchmanager;
 	IRCv3::Batch::Batch batch;
 	IRCv3::ServerTime::API servertimemanager;
+	MaskPool masks;
+	CompactTimer compacttimer;
+
+	/** Gets the message which replays a line of history to a channel. */
+	ClientProtocol::Messages::Privmsg& GetMessage(HistoryItem* item, Channel* chan)
+	{
+		const std::string& batchref = batchmanager ? batch.GetRefTagStr() : "";
+		if (item->msg && item->batchref == batchref)
+			return *item->msg;
+
+		// The tags of a message can't be changed once it is serialized so it is built again
+		// in the rare case that the history is replayed in a batch with a different reference.
+		item->Reset();
+		item->msg = new ClientProtocol::Messages::Privmsg(ClientProtocol::Messages::Privmsg::nocopy, *item->sourcemask, chan, item->text);
+		if (servertimemanager)
+			servertimemanager->Set(*item->msg, item->ts);
+		batch.AddToBatch(*item->msg);
+		item->batchref = batchref;
+		return *item->msg;
+	}
+
+	/** Drops the messages of all lines of history as they might have tags from a module which is
+	 * being unloaded or be missing tags from a module which was loaded.
+	 */
+	void ResetMessages()
+	{
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		{
+			HistoryList* list = m.ext.get(i->second);
+			if (!list)
+				continue;
+
+			for (size_t j = 0; j < list->count; ++j)
+				list->Get(j)->Reset();
+		}
+	}
 
  public:
 	ModuleChanHistory()
@@ -127,7 +886,14 @@ class ModuleChanHistory
 		, batchmanager(this)
 		, batch("chathistory")
 		, servertimemanager(this)
+		, compacttimer(m)
+	{
+	}
+
+	~ModuleChanHistory()
 	{
+		// The history lists have already been freed at this point.
+		delete m.store;
 	}
 
 	void ReadConfig(ConfigStatus& status) override
@@ -136,6 +902,29 @@ class ModuleChanHistory
 		m.maxlines = tag->getUInt("maxlines", 50, 1);
 		sendnotice = tag->getBool("notice", true);
 		dobots = tag->getBool("bots", true);
+
+		const std::string persistdir = tag->getString("persistdir");
+		if (m.store)
+		{
+			// Moving the lines which are already stored would need them to be copied.
+			if (persistdir.empty() || ServerInstance->Config->Paths.PrependData(persistdir) != m.store->GetDirectory())
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Changes to <chanhistory:persistdir> take effect when the module is reloaded");
+			return;
+		}
+
+		if (persistdir.empty())
+			return;
+
+		HistoryStore* store = new HistoryStore(ServerInstance->Config->Paths.PrependData(persistdir));
+		std::string error;
+		if (!store->Open(m.maxlines, error))
+		{
+			delete store;
+			throw ModuleException("Unable to open the channel history in <chanhistory:persistdir>: " + error);
+		}
+
+		m.store = store;
+		ServerInstance->Timers.AddTimer(&compacttimer);
 	}
 
 	ModResult OnBroadcastMessage(Channel* channel, const Server* server) override
@@ -149,12 +938,16 @@ class ModuleChanHistory
 		{
 			Channel* c = target.Get<Channel>();
 			HistoryList* list = m.ext.get(c);
-			if (list)
+			if (!list)
+				return;
+
+			if (list->log)
 			{
-				list->lines.push_back(HistoryItem(user, details.text));
-				if (list->lines.size() > list->maxlen)
-					list->lines.pop_front();
+				m.store->Append(*list->log, c->name, ServerInstance->Time(), user->GetFullHost(), details.text);
+				m.store->Trim(*list->log, list->maxlen, 0);
 			}
+			else
+				list->Add(new HistoryItem(masks, user, details.text));
 		}
 	}
 
@@ -188,23 +981,52 @@ class ModuleChanHistory
 			batch.GetBatchStartMessage().PushParamRef(memb->chan->name);
 		}
 
-		for(std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
+		if (list->log)
 		{
-			const HistoryItem& item = *i;
-			if (item.ts >= mintime)
+			// Lines in the store are not kept in memory so their messages are built on every replay.
+			std::string mask;
+			std::string text;
+			const std::deque<HistoryStore::Entry>& entries = list->log->entries;
+			for (std::deque<HistoryStore::Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i)
 			{
-				ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy, item.sourcemask, memb->chan, item.text);
+				if (i->ts < mintime || !m.store->Read(*i, mask, text))
+					continue;
+
+				ClientProtocol::Messages::Privmsg msg(mask, memb->chan, text);
 				if (servertimemanager)
-					servertimemanager->Set(msg, item.ts);
+					servertimemanager->Set(msg, i->ts);
 				batch.AddToBatch(msg);
 				localuser->Send(ServerInstance->GetRFCEvents().privmsg, msg);
 			}
 		}
 
+		for (size_t i = 0; i < list->count; ++i)
+		{
+			HistoryItem* item = list->Get(i);
+			if (item->ts >= mintime)
+				localuser->Send(ServerInstance->GetRFCEvents().privmsg, GetMessage(item, memb->chan));
+		}
+
 		if (batchmanager)
 			batchmanager->End(batch);
 	}
 
+	void OnChannelDelete(Channel* chan) override
+	{
+		// Like before the history was persisted, it ends with the channel.
+		m.Forget(chan);
+	}
+
+	void OnLoadModule(Module* mod) override
+	{
+		ResetMessages();
+	}
+
+	void OnUnloadModule(Module* mod) override
+	{
+		ResetMessages();
+	}
+
 	Version GetVersion() override
 	{
 		return Version("Provides channel history replayed on join", VF_VENDOR);
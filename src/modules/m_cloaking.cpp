@@ -24,6 +24,7 @@
 
 
 #include "inspircd.h"
+#include "listmode.h"
 #include "modules/hash.h"
 
 enum CloakMode
@@ -181,11 +182,13 @@ class ModuleCloaking : public Module
 	CommandCloak ck;
 	std::vector<CloakInfo> cloaks;
 	dynamic_reference<HashProvider> Hash;
+	ChanModeReference banmode;
 
 	ModuleCloaking()
 		: cu(this)
 		, ck(this)
 		, Hash(this, "hash/md5")
+		, banmode(this, "ban")
 	{
 	}
 
@@ -354,10 +357,41 @@ class ModuleCloaking : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnCheckChannelBan(User* user, Channel* chan) override
+	{
+		// Channel::IsBanned() matches bans which are not extbans without asking modules so
+		// cloaks which are not in use have to be checked against the ban list here.
+		LocalUser* lu = IS_LOCAL(user);
+		ListModeBase* banlm = static_cast<ListModeBase*>(*banmode);
+		if (!lu || !banlm)
+			return MOD_RES_PASSTHRU;
+
+		const ListModeBase::MaskIndex* bans = banlm->GetMasks(chan);
+		if (!bans)
+			return MOD_RES_PASSTHRU;
+
+		// Force the creation of cloaks if not already set.
+		OnUserConnect(lu);
+
+		CloakList* cloaklist = cu.ext.get(user);
+		if (!cloaklist)
+			return MOD_RES_PASSTHRU;
+
+		const std::string nickident = user->nick + "!" + user->ident;
+		for (CloakList::const_iterator iter = cloaklist->begin(); iter != cloaklist->end(); ++iter)
+		{
+			const std::string& cloak = *iter;
+			if (cloak != user->GetDisplayedHost() && bans->Matches(nickident, cloak))
+				return MOD_RES_DENY;
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	void Prioritize() override
 	{
 		/* Needs to be after m_banexception etc. */
 		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnCheckChannelBan, PRIORITY_LAST);
 	}
 
 	// this unsets umode +x on every host change. If we are actually doing a +x
@@ -27,6 +27,9 @@
 #include "modules/shun.h"
 #include "modules/stats.h"
 
+#include <chrono>
+#include <memory>
+
 enum FilterFlags
 {
 	FLAG_PART = 2,
@@ -47,10 +50,423 @@ enum FilterAction
 	FA_NONE
 };
 
+/** Finds which of a set of literal strings occur in a text using an Aho-Corasick automaton.
+ * Characters are compared through a case map so the literals of case insensitive patterns
+ * are found regardless of their case. For case sensitive patterns this can only find more
+ * literals than actually occur, never fewer.
+ */
+class LiteralMatcher
+{
+	struct Node
+	{
+		/** The nodes which follow this one, sorted by character. */
+		std::vector<std::pair<unsigned char, unsigned int> > children;
+
+		/** The node for the longest proper suffix of this node. */
+		unsigned int fail;
+
+		/** The nearest node reachable through fail which ends a literal or 0 if there is none. */
+		unsigned int output;
+
+		/** The ids of the literals which end at this node. */
+		std::vector<size_t> ids;
+
+		/** The scan in which the ids of this node were last reported. */
+		unsigned long seen;
+
+		Node() : fail(0), output(0), seen(0) { }
+	};
+
+	/** The nodes of the automaton, the first of which is the root. */
+	std::vector<Node> nodes;
+
+	/** The children of the root, which is where most characters of a text are looked up. */
+	unsigned int root[256];
+
+	/** The case map which the literals were folded with. */
+	unsigned const char* casemap;
+
+	/** The number of scans done so far. */
+	unsigned long scans;
+
+	unsigned int GetChild(unsigned int node, unsigned char chr) const
+	{
+		if (!node)
+			return root[chr];
+
+		const std::vector<std::pair<unsigned char, unsigned int> >& children = nodes[node].children;
+		std::vector<std::pair<unsigned char, unsigned int> >::const_iterator it = std::lower_bound(children.begin(), children.end(), std::make_pair(chr, 0U));
+		return (it != children.end() && it->first == chr) ? it->second : 0;
+	}
+
+	unsigned int Next(unsigned int node, unsigned char chr) const
+	{
+		for (;;)
+		{
+			const unsigned int child = GetChild(node, chr);
+			if (child || !node)
+				return child;
+			node = nodes[node].fail;
+		}
+	}
+
+ public:
+	LiteralMatcher()
+		: scans(0)
+	{
+		Clear(national_case_insensitive_map);
+	}
+
+	/** Removes all literals.
+	 * @param map The case map to compare characters with.
+	 */
+	void Clear(unsigned const char* map)
+	{
+		nodes.assign(1, Node());
+		std::fill(root, root + 256, 0);
+		casemap = map;
+	}
+
+	/** Adds a literal. Build() must be called before the next Find().
+	 * @param literal The literal to add, must not be empty.
+	 * @param id The id to report when the literal is found.
+	 */
+	void Add(const std::string& literal, size_t id)
+	{
+		unsigned int node = 0;
+		for (std::string::const_iterator i = literal.begin(); i != literal.end(); ++i)
+		{
+			const unsigned char chr = casemap[static_cast<unsigned char>(*i)];
+			unsigned int child = GetChild(node, chr);
+			if (!child)
+			{
+				child = nodes.size();
+				std::vector<std::pair<unsigned char, unsigned int> >& children = nodes[node].children;
+				children.insert(std::lower_bound(children.begin(), children.end(), std::make_pair(chr, 0U)), std::make_pair(chr, child));
+				if (!node)
+					root[chr] = child;
+				nodes.push_back(Node());
+			}
+			node = child;
+		}
+		nodes[node].ids.push_back(id);
+	}
+
+	/** Links the nodes of the automaton after literals were added. */
+	void Build()
+	{
+		// Every node gets the node for its longest suffix, which is always closer to the root
+		// than the node itself, so going through the nodes breadth first fills them in order.
+		std::vector<unsigned int> queue(1, 0);
+		for (size_t i = 0; i < queue.size(); ++i)
+		{
+			const unsigned int node = queue[i];
+			for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator j = nodes[node].children.begin(); j != nodes[node].children.end(); ++j)
+			{
+				Node& child = nodes[j->second];
+				child.fail = node ? Next(nodes[node].fail, j->first) : 0;
+				child.output = nodes[child.fail].ids.empty() ? nodes[child.fail].output : child.fail;
+				queue.push_back(j->second);
+			}
+		}
+	}
+
+	/** Finds the literals which occur in a text.
+	 * @param text The text to search.
+	 * @param found Gets bit set at the index of the id of every literal which was found.
+	 * @param bit The bit to set.
+	 */
+	void Find(const std::string& text, std::vector<unsigned char>& found, unsigned char bit)
+	{
+		scans++;
+		unsigned int node = 0;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			node = Next(node, casemap[static_cast<unsigned char>(*i)]);
+
+			// Once a node has been reported all of the nodes after it were reported as well.
+			unsigned int out = nodes[node].ids.empty() ? nodes[node].output : node;
+			for (; out && nodes[out].seen != scans; out = nodes[out].output)
+			{
+				nodes[out].seen = scans;
+				for (std::vector<size_t>::const_iterator j = nodes[out].ids.begin(); j != nodes[out].ids.end(); ++j)
+					found[*j] |= bit;
+			}
+		}
+	}
+
+	/** Retrieves the case map which the literals were folded with. */
+	unsigned const char* GetCaseMap() const { return casemap; }
+};
+
+namespace
+{
+	void KeepLongest(std::string& current, std::string& longest)
+	{
+		if (current.length() > longest.length())
+			longest.swap(current);
+		current.clear();
+	}
+
+	/** Skips a bracket expression.
+	 * @param rx The regex.
+	 * @param pos The position after the opening bracket.
+	 * @return The position after the closing bracket or std::string::npos if there is none.
+	 */
+	size_t SkipClass(const std::string& rx, size_t pos)
+	{
+		if (pos < rx.length() && rx[pos] == '^')
+			pos++;
+		if (pos < rx.length() && rx[pos] == ']')
+			pos++;
+
+		while (pos < rx.length())
+		{
+			const char chr = rx[pos++];
+			if (chr == '\\')
+				pos++;
+			else if (chr == ']')
+				return pos;
+			else if (chr == '[' && pos < rx.length() && strchr(":=.", rx[pos]))
+			{
+				// Character classes like [:alpha:] contain a closing bracket.
+				const size_t end = rx.find(std::string(1, rx[pos]) + "]", pos + 1);
+				if (end == std::string::npos)
+					return std::string::npos;
+				pos = end + 2;
+			}
+		}
+		return std::string::npos;
+	}
+
+	/** Skips a parenthesized group.
+	 * @param rx The regex.
+	 * @param pos The position after the opening parenthesis.
+	 * @return The position after the closing parenthesis or std::string::npos if there is none.
+	 */
+	size_t SkipGroup(const std::string& rx, size_t pos)
+	{
+		unsigned int depth = 1;
+		while (pos < rx.length())
+		{
+			const char chr = rx[pos++];
+			if (chr == '\\')
+				pos++;
+			else if (chr == '[')
+			{
+				pos = SkipClass(rx, pos);
+				if (pos == std::string::npos)
+					return pos;
+			}
+			else if (chr == '(')
+				depth++;
+			else if (chr == ')' && !--depth)
+				return pos;
+		}
+		return std::string::npos;
+	}
+
+	/** Checks whether a brace starts a valid interval like {2} or {1,3}. */
+	bool IsInterval(const std::string& rx, size_t pos, size_t end)
+	{
+		bool comma = false;
+		for (; pos < end; ++pos)
+		{
+			if (rx[pos] == ',' && !comma)
+				comma = true;
+			else if (!isdigit(static_cast<unsigned char>(rx[pos])))
+				return false;
+		}
+		return true;
+	}
+
+	/** Gets the literals which a regex requires.
+	 * This only understands the common subset of the supported regex syntaxes and gives up
+	 * on anything else. Everything it can not tell the meaning of is treated as if it could
+	 * match any text so a literal is never required when it is not.
+	 * @param rx The regex.
+	 * @param literals Gets a literal for every alternative of the regex.
+	 * @return True if every alternative has a literal, false otherwise.
+	 */
+	bool GetRegexLiterals(const std::string& rx, std::vector<std::string>& literals)
+	{
+		std::string current;
+		std::string longest;
+		bool caseless = false;
+		bool repeated = false;
+		size_t pos = 0;
+		for (;;)
+		{
+			// A character followed by + is required unless another operator like * follows.
+			if (repeated && (pos >= rx.length() || !strchr("*?{", rx[pos])))
+				KeepLongest(current, longest);
+			repeated = false;
+
+			if (pos >= rx.length() || rx[pos] == '|')
+			{
+				// Every text which is matched has to contain the literal of one of the alternatives.
+				KeepLongest(current, longest);
+				if (longest.empty())
+					return false;
+
+				// Case insensitive matching of characters outside of ASCII can not be done with a case map.
+				if (caseless)
+				{
+					for (std::string::const_iterator i = longest.begin(); i != longest.end(); ++i)
+					{
+						if (static_cast<unsigned char>(*i) >= 0x80)
+							return false;
+					}
+				}
+
+				literals.push_back(longest);
+				longest.clear();
+				if (pos++ >= rx.length())
+					return true;
+				continue;
+			}
+
+			const char chr = rx[pos++];
+			switch (chr)
+			{
+				case '\\':
+					if (pos >= rx.length())
+						return false;
+
+					if (isalnum(static_cast<unsigned char>(rx[pos])))
+					{
+						// Escapes like \d match something other than themselves. Escapes with arguments
+						// like \x41 or back references can not be skipped safely.
+						if (!strchr("bBdDsSwWnrtfvAzZG", rx[pos]))
+							return false;
+						KeepLongest(current, longest);
+					}
+					else if (strchr("(){}|?+<>`'", rx[pos]))
+					{
+						// These are operators in some of the syntaxes and literals in the others.
+						return false;
+					}
+					else
+						current.push_back(rx[pos]);
+					pos++;
+					break;
+
+				case '{':
+				{
+					// The interval might allow the previous character to not be there.
+					const size_t end = rx.find('}', pos);
+					if (end == std::string::npos || !IsInterval(rx, pos, end))
+						return false;
+					pos = end + 1;
+				}
+				// Fall through.
+				case '*':
+				case '?':
+					if (!current.empty())
+						current.erase(current.length() - 1);
+					KeepLongest(current, longest);
+					break;
+
+				case '+':
+					repeated = true;
+					break;
+
+				case '.':
+				case '^':
+				case '$':
+					KeepLongest(current, longest);
+					break;
+
+				case '[':
+					KeepLongest(current, longest);
+					pos = SkipClass(rx, pos);
+					if (pos == std::string::npos)
+						return false;
+					break;
+
+				case '(':
+					KeepLongest(current, longest);
+					if (pos < rx.length() && rx[pos] == '?')
+					{
+						// Only options which do not change how the rest of the regex is read are understood.
+						const size_t end = rx.find_first_not_of("imsU-", pos + 1);
+						if (end == std::string::npos || (rx[end] != ')' && rx[end] != ':'))
+							return false;
+
+						if (rx.find('i', pos + 1) < end)
+							caseless = true;
+
+						if (rx[end] == ')')
+						{
+							pos = end + 1;
+							break;
+						}
+					}
+
+					pos = SkipGroup(rx, pos);
+					if (pos == std::string::npos)
+						return false;
+					break;
+
+				case ')':
+					return false;
+
+				default:
+					current.push_back(chr);
+					break;
+			}
+		}
+	}
+
+	/** Gets the literal which a glob pattern requires.
+	 * @param glob The glob pattern.
+	 * @param literals Gets the longest literal of the pattern.
+	 * @return True if the pattern has a literal, false otherwise.
+	 */
+	bool GetGlobLiterals(const std::string& glob, std::vector<std::string>& literals)
+	{
+		std::string current;
+		std::string longest;
+		for (std::string::const_iterator i = glob.begin(); i != glob.end(); ++i)
+		{
+			if (*i == '*' || *i == '?')
+				KeepLongest(current, longest);
+			else
+				current.push_back(*i);
+		}
+		KeepLongest(current, longest);
+
+		if (longest.empty())
+			return false;
+
+		literals.push_back(longest);
+		return true;
+	}
+
+	/** Gets literals of which at least one occurs in every text a pattern matches.
+	 * @param engine The name of the regex engine the pattern is for.
+	 * @param pattern The pattern.
+	 * @return The literals or an empty list if the pattern has to be checked against every text.
+	 */
+	std::vector<std::string> GetRequiredLiterals(const std::string& engine, const std::string& pattern)
+	{
+		std::vector<std::string> literals;
+		bool found = false;
+		if (engine == "regex/glob")
+			found = GetGlobLiterals(pattern, literals);
+		else if (engine == "regex/pcre" || engine == "regex/posix" || engine == "regex/re2" || engine == "regex/stdregex" || engine == "regex/tre")
+			found = GetRegexLiterals(pattern, literals);
+
+		if (!found)
+			literals.clear();
+		return literals;
+	}
+}
+
 class FilterResult
 {
  public:
-	Regex* regex;
+	std::shared_ptr<Regex> regex;
 	std::string freeform;
 	std::string reason;
 	FilterAction action;
@@ -64,16 +480,32 @@ class FilterResult
 	bool flag_notice;
 	bool flag_strip_color;
 
+	/** Literals of which one occurs in every text the regex matches or empty if there are none. */
+	std::vector<std::string> literals;
+
+	/** The number of times the regex was checked against a text. */
+	unsigned long evaluations;
+
+	/** The number of times the regex matched. */
+	unsigned long matches;
+
+	/** The time spent checking the regex in nanoseconds. */
+	unsigned long long runtime;
+
 	FilterResult(dynamic_reference<RegexFactory>& RegexEngine, const std::string& free, const std::string& rea, FilterAction act, unsigned long gt, const std::string& fla, bool cfg)
 		: freeform(free)
 		, reason(rea)
 		, action(act)
 		, duration(gt)
 		, from_config(cfg)
+		, evaluations(0)
+		, matches(0)
+		, runtime(0)
 	{
 		if (!RegexEngine)
 			throw ModuleException("Regex module implementing '"+RegexEngine.GetProvider()+"' is not loaded!");
-		regex = RegexEngine->Create(free);
+		regex.reset(RegexEngine->Create(free));
+		literals = GetRequiredLiterals(RegexEngine->name, free);
 		this->FillFlags(fla);
 	}
 
@@ -148,6 +580,188 @@ class FilterResult
 	}
 };
 
+class ModuleFilter;
+
+/** A message whose filters are checked on a worker thread. */
+struct FilterJob
+{
+	struct Check
+	{
+		/** The regex to check, which is kept alive until the job is done even if its filter is removed. */
+		std::shared_ptr<Regex> regex;
+
+		/** Whether to check the regex against the text with colours stripped. */
+		bool strip;
+
+		/** The time spent checking the regex in nanoseconds. */
+		unsigned long long runtime;
+
+		Check(const std::shared_ptr<Regex>& rx, bool stripcolor)
+			: regex(rx)
+			, strip(stripcolor)
+			, runtime(0)
+		{
+		}
+	};
+
+	/** The id of the held message. */
+	unsigned long id;
+
+	/** The text of the message. */
+	std::string text;
+
+	/** The text of the message with colours stripped. */
+	std::string stripped;
+
+	/** The regexes of the filters which apply to the message in the order they have to be checked. */
+	std::vector<Check> checks;
+
+	/** The number of checks which were done. */
+	size_t evaluated;
+
+	/** The index of the check which matched or the number of checks if none did. */
+	size_t matched;
+
+	FilterJob()
+		: id(0)
+		, evaluated(0)
+		, matched(0)
+	{
+	}
+
+	/** Checks the regexes until one of them matches. This may be called on any thread. */
+	void Run()
+	{
+		for (matched = 0; matched < checks.size(); ++matched)
+		{
+			Check& check = checks[matched];
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			const bool found = check.regex->Matches(check.strip ? stripped : text);
+			check.runtime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			if (found)
+				break;
+		}
+		evaluated = std::min(matched + 1, checks.size());
+	}
+};
+
+/** A thread which runs filter jobs and hands them back to the main thread. */
+class FilterWorker : public SocketThread
+{
+	ModuleFilter* const parent;
+
+ public:
+	/** Jobs waiting to be run. Protected by the queue lock. */
+	std::deque<FilterJob*> jobs;
+
+	/** Jobs which were run. Protected by the queue lock. */
+	std::deque<FilterJob*> results;
+
+	/** The number of jobs given to this thread which have not been handed back yet. Only used on the main thread. */
+	size_t load;
+
+	FilterWorker(ModuleFilter* Parent)
+		: parent(Parent)
+		, load(0)
+	{
+	}
+
+	void Run() override;
+	void OnNotify() override;
+};
+
+/** A message from a local user which is waiting for its filters to be checked. */
+class HeldMessage : public Timer
+{
+	ModuleFilter* const parent;
+
+ public:
+	enum State
+	{
+		/** The filters are still being checked. */
+		PENDING,
+
+		/** The message can be delivered. */
+		DELIVER,
+
+		/** The message matched a filter. */
+		MATCHED,
+
+		/** The filters were not checked in time and the message is dropped. */
+		DROP
+	};
+
+	/** The id of the message. */
+	const unsigned long id;
+
+	/** The user who sent the message. */
+	LocalUser* const user;
+
+	/** Whether the message is a PRIVMSG or a NOTICE. */
+	const MessageType type;
+
+	/** The target as the message is sent to it, including a status prefix. */
+	std::string target;
+
+	/** The uuid of the user the message is sent to or empty if it is sent to a channel. */
+	std::string targetuuid;
+
+	/** The name of the channel or user the message is sent to. */
+	std::string targetname;
+
+	/** The text of the message as it was sent by the user. */
+	std::string text;
+
+	/** The message tags which were sent by the user. */
+	ClientProtocol::TagMap tags;
+
+	State state;
+
+	/** The filter which matched if the state is MATCHED. */
+	FilterResult filter;
+
+	HeldMessage(ModuleFilter* Parent, unsigned long ID, LocalUser* source, MessageType mt, unsigned long maxdelay)
+		: Timer(0)
+		, parent(Parent)
+		, id(ID)
+		, user(source)
+		, type(mt)
+		, state(PENDING)
+	{
+		SetIntervalMs(maxdelay);
+	}
+
+	~HeldMessage();
+	bool Tick(time_t TIME) override;
+};
+
+/** A held message whose filters were not checked in time and are still being checked by a worker. */
+struct LateMessage
+{
+	/** The uuid of the user who sent the message. */
+	std::string uuid;
+
+	/** The name of the channel or user the message was sent to. */
+	std::string targetname;
+
+	/** Whether the message was sent to a channel. */
+	bool tochannel;
+
+	/** Whether the message was delivered unchecked. */
+	bool delivered;
+};
+
+/** The messages of a user which are held, in the order they were sent. */
+struct HeldQueue
+{
+	std::deque<HeldMessage*> messages;
+
+	~HeldQueue()
+	{
+		stdalgo::delete_all(messages);
+	}
+};
+
 class CommandFilter : public Command
 {
  public:
@@ -174,10 +788,70 @@ class ModuleFilter : public Module, public ServerEventListener, public Stats::Ev
 	RegexFactory* factory;
 	void FreeFilters();
 
+	/** Finds the filters whose literals occur in a text so only those have to be checked. */
+	LiteralMatcher prefilter;
+
+	/** Whether the filters changed since the prefilter was built. */
+	bool prefilterdirty;
+
+	/** The number of literals in the prefilter. */
+	size_t prefilterliterals;
+
+	/** The filters which have no literals and are checked against every text. */
+	size_t unfiltered;
+
+	/** Marks the filters whose literals were found in the current text. */
+	std::vector<unsigned char> found;
+
+	/** The number of texts which were checked against the filters. */
+	unsigned long texts;
+
+	/** The number of times a filter was not checked because none of its literals were found. */
+	unsigned long skipped;
+
+	void BuildPrefilter();
+
+	/** The threads which check held messages against the filters. */
+	std::vector<FilterWorker*> workers;
+
+	/** The messages of local users which are held. */
+	SimpleExtItem<HeldQueue> heldqueue;
+
+	/** The id of the next held message. */
+	unsigned long nextid;
+
+	/** The time in milliseconds after which a held message is delivered or dropped. */
+	unsigned long maxdelay;
+
+	/** Whether to deliver held messages which were not checked in time. */
+	bool deliverlate;
+
+	/** Whether a held message is being delivered. */
+	bool delivering;
+
+	/** The number of messages which were held. */
+	unsigned long held;
+
+	/** The number of held messages which were not checked in time. */
+	unsigned long late;
+
+	void StartWorkers(size_t count);
+	void StopWorkers();
+	FilterResult* FindFilter(const Regex* regex);
+	ModResult HoldMessage(LocalUser* user, const MessageTarget& msgtarget, MessageDetails& details);
+	void ReleaseHeld(LocalUser* user);
+	void DeliverHeld(HeldMessage* msg);
+
  public:
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
 
+	/** Held messages whose filters are being checked by a worker, by id. */
+	std::unordered_map<unsigned long, HeldMessage*> checking;
+
+	/** Messages which were released before their filters were checked, by id. */
+	std::unordered_map<unsigned long, LateMessage> latechecks;
+
 	std::vector<FilterResult> filters;
 	int flags;
 
@@ -191,7 +865,30 @@ class ModuleFilter : public Module, public ServerEventListener, public Stats::Ev
 	void init() override;
 	CullResult cull() override;
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) override;
+	void Prioritize() override;
 	FilterResult* FilterMatch(User* user, const std::string &text, int flags);
+
+	/** Finds the filters which apply to a text and whose literals occur in it.
+	 * @param user The user who sent the text.
+	 * @param text The text.
+	 * @param flags The type of the text.
+	 * @param candidates Gets the filters which have to be checked, in the order they have to be checked.
+	 * @param stripped_text Gets the text with colours stripped if a filter needs it.
+	 */
+	void FindCandidates(User* user, const std::string& text, int flags, std::vector<FilterResult*>& candidates, std::string& stripped_text);
+
+	/** Takes the action of a filter which matched a message.
+	 * @return True if the message should be delivered anyway, false otherwise.
+	 */
+	bool ActOnMatch(User* user, const std::string& target, bool tochannel, FilterResult* f, bool& echo_original);
+	void OnJobDone(FilterJob* job);
+
+	/** Takes the action of a filter which matched a message after the message was released.
+	 * @param id The id of the message.
+	 * @param matched The filter which matched or NULL if none matched.
+	 */
+	void OnLateJobDone(unsigned long id, FilterResult* matched);
+	void OnHeldTimeout(HeldMessage* msg);
 	bool DeleteFilter(const std::string &freeform);
 	std::pair<bool, std::string> AddFilter(const std::string& freeform, FilterAction type, const std::string& reason, unsigned long duration, const std::string& flags);
 	void ReadConfig(ConfigStatus& status) override;
@@ -315,6 +1012,18 @@ ModuleFilter::ModuleFilter()
 	: ServerEventListener(this)
 	, Stats::EventListener(this)
 	, initing(true)
+	, prefilterdirty(true)
+	, prefilterliterals(0)
+	, unfiltered(0)
+	, texts(0)
+	, skipped(0)
+	, heldqueue("filter-held", ExtensionItem::EXT_USER, this)
+	, nextid(0)
+	, maxdelay(0)
+	, deliverlate(false)
+	, delivering(false)
+	, held(0)
+	, late(0)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -327,16 +1036,375 @@ void ModuleFilter::init()
 
 CullResult ModuleFilter::cull()
 {
+	StopWorkers();
 	FreeFilters();
 	return Module::cull();
 }
 
 void ModuleFilter::FreeFilters()
 {
-	for (std::vector<FilterResult>::const_iterator i = filters.begin(); i != filters.end(); ++i)
-		delete i->regex;
-
 	filters.clear();
+	prefilterdirty = true;
+}
+
+void ModuleFilter::StartWorkers(size_t count)
+{
+	while (workers.size() < count)
+	{
+		FilterWorker* worker = new FilterWorker(this);
+		ServerInstance->Threads.Start(worker);
+		workers.push_back(worker);
+	}
+}
+
+void ModuleFilter::StopWorkers()
+{
+	// New messages are checked on the main thread while the workers are stopped.
+	std::vector<FilterWorker*> stopping;
+	stopping.swap(workers);
+	for (std::vector<FilterWorker*>::const_iterator i = stopping.begin(); i != stopping.end(); ++i)
+		(*i)->join();
+
+	for (std::vector<FilterWorker*>::const_iterator i = stopping.begin(); i != stopping.end(); ++i)
+	{
+		FilterWorker* worker = *i;
+		worker->OnNotify();
+
+		// Jobs which were not started are run here so the messages they are for are not lost.
+		while (!worker->jobs.empty())
+		{
+			FilterJob* job = worker->jobs.front();
+			worker->jobs.pop_front();
+			job->Run();
+			OnJobDone(job);
+			delete job;
+		}
+		delete worker;
+	}
+}
+
+void FilterWorker::Run()
+{
+	this->LockQueue();
+	while (!this->GetExitFlag())
+	{
+		if (jobs.empty())
+		{
+			this->WaitForQueue();
+			continue;
+		}
+
+		FilterJob* job = jobs.front();
+		jobs.pop_front();
+		this->UnlockQueue();
+
+		job->Run();
+
+		this->LockQueue();
+		results.push_back(job);
+		NotifyParent();
+	}
+	this->UnlockQueue();
+}
+
+void FilterWorker::OnNotify()
+{
+	std::deque<FilterJob*> done;
+	this->LockQueue();
+	done.swap(results);
+	this->UnlockQueue();
+
+	for (std::deque<FilterJob*>::const_iterator i = done.begin(); i != done.end(); ++i)
+	{
+		load--;
+		parent->OnJobDone(*i);
+		delete *i;
+	}
+}
+
+HeldMessage::~HeldMessage()
+{
+	parent->checking.erase(id);
+}
+
+bool HeldMessage::Tick(time_t TIME)
+{
+	parent->OnHeldTimeout(this);
+	return false;
+}
+
+FilterResult* ModuleFilter::FindFilter(const Regex* regex)
+{
+	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
+	{
+		if (i->regex.get() == regex)
+			return &*i;
+	}
+	return NULL;
+}
+
+ModResult ModuleFilter::HoldMessage(LocalUser* user, const MessageTarget& msgtarget, MessageDetails& details)
+{
+	HeldQueue* queue = heldqueue.get(user);
+
+	bool exempt;
+	std::string target;
+	std::string targetuuid;
+	if (msgtarget.type == MessageTarget::TYPE_USER)
+	{
+		User* t = msgtarget.Get<User>();
+		exempt = exemptednicks.count(t->nick);
+		target = t->nick;
+		targetuuid = t->uuid;
+	}
+	else
+	{
+		Channel* t = msgtarget.Get<Channel>();
+		exempt = exemptedchans.count(t->name);
+		target = t->name;
+	}
+
+	FilterJob* job = NULL;
+	if (!exempt)
+	{
+		std::vector<FilterResult*> candidates;
+		std::string stripped_text;
+		FindCandidates(user, details.text, flags, candidates, stripped_text);
+		if (!candidates.empty())
+		{
+			job = new FilterJob;
+			job->text = details.text;
+			job->stripped = stripped_text;
+			for (std::vector<FilterResult*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+				job->checks.push_back(FilterJob::Check((*i)->regex, (*i)->flag_strip_color));
+		}
+	}
+
+	// Messages which do not have to be checked are only held to keep them in order.
+	if (!job && !queue)
+		return MOD_RES_PASSTHRU;
+
+	if (!queue)
+	{
+		queue = new HeldQueue;
+		heldqueue.set(user, queue);
+	}
+
+	HeldMessage* msg = new HeldMessage(this, nextid++, user, details.type, maxdelay);
+	msg->target = msgtarget.status ? msgtarget.status + target : target;
+	msg->targetuuid = targetuuid;
+	msg->targetname = target;
+	msg->text = details.original_text;
+	msg->tags.insert(details.tags_in.begin(), details.tags_in.end());
+	queue->messages.push_back(msg);
+	held++;
+
+	if (job)
+	{
+		job->id = msg->id;
+		checking[msg->id] = msg;
+
+		// Give the job to the thread with the fewest jobs so one slow regex does not hold up the others.
+		FilterWorker* worker = workers.front();
+		for (std::vector<FilterWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			if ((*i)->load < worker->load)
+				worker = *i;
+		}
+
+		worker->load++;
+		worker->LockQueue();
+		worker->jobs.push_back(job);
+		worker->UnlockQueueWakeup();
+	}
+	else
+	{
+		msg->state = HeldMessage::DELIVER;
+	}
+	return MOD_RES_DENY;
+}
+
+void ModuleFilter::OnJobDone(FilterJob* job)
+{
+	FilterResult* matched = NULL;
+	for (size_t i = 0; i < job->evaluated; ++i)
+	{
+		// The filter might have been removed while the job was running.
+		FilterResult* filter = FindFilter(job->checks[i].regex.get());
+		if (!filter)
+			continue;
+
+		filter->evaluations++;
+		filter->runtime += job->checks[i].runtime;
+		if (i == job->matched)
+		{
+			filter->matches++;
+			matched = filter;
+		}
+	}
+
+	std::unordered_map<unsigned long, HeldMessage*>::iterator it = checking.find(job->id);
+	if (it == checking.end())
+	{
+		OnLateJobDone(job->id, matched);
+		return;
+	}
+
+	HeldMessage* msg = it->second;
+	checking.erase(it);
+	if (matched)
+	{
+		msg->filter = *matched;
+		msg->state = HeldMessage::MATCHED;
+	}
+	else
+	{
+		msg->state = HeldMessage::DELIVER;
+	}
+	ReleaseHeld(msg->user);
+}
+
+void ModuleFilter::OnLateJobDone(unsigned long id, FilterResult* matched)
+{
+	std::unordered_map<unsigned long, LateMessage>::iterator it = latechecks.find(id);
+	if (it == latechecks.end())
+		return;
+
+	const LateMessage msg = it->second;
+	latechecks.erase(it);
+	if (!matched)
+		return;
+
+	// A message which was made to be slow to check must not let its sender escape the action
+	// of the filter. Messages which were dropped already got the effect of a block.
+	User* user = ServerInstance->FindUUID(msg.uuid);
+	if (!user || user->quitting)
+		return;
+
+	switch (matched->action)
+	{
+		case FA_KILL:
+		case FA_GLINE:
+		case FA_ZLINE:
+		case FA_SHUN:
+		{
+			bool echo_original = false;
+			ActOnMatch(user, msg.targetname, msg.tochannel, matched, echo_original);
+			break;
+		}
+
+		default:
+			if (msg.delivered && matched->action != FA_NONE)
+			{
+				ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s's message to %s was delivered unchecked but matched %s (%s)",
+					user->nick.c_str(), msg.targetname.c_str(), matched->freeform.c_str(), matched->reason.c_str()));
+			}
+			break;
+	}
+}
+
+void ModuleFilter::OnHeldTimeout(HeldMessage* msg)
+{
+	if (msg->state != HeldMessage::PENDING)
+		return;
+
+	late++;
+	checking.erase(msg->id);
+	msg->state = deliverlate ? HeldMessage::DELIVER : HeldMessage::DROP;
+
+	// The filters are still checked so the action of a filter which matches can be taken.
+	LateMessage& latemsg = latechecks[msg->id];
+	latemsg.uuid = msg->user->uuid;
+	latemsg.targetname = msg->targetname;
+	latemsg.tochannel = msg->targetuuid.empty();
+	latemsg.delivered = deliverlate;
+
+	ReleaseHeld(msg->user);
+}
+
+void ModuleFilter::ReleaseHeld(LocalUser* user)
+{
+	HeldQueue* queue = heldqueue.get(user);
+	if (!queue)
+		return;
+
+	while (!queue->messages.empty() && queue->messages.front()->state != HeldMessage::PENDING)
+	{
+		HeldMessage* msg = queue->messages.front();
+		queue->messages.pop_front();
+		if (!user->quitting)
+			DeliverHeld(msg);
+		delete msg;
+	}
+
+	if (queue->messages.empty())
+		heldqueue.unset(user);
+}
+
+void ModuleFilter::DeliverHeld(HeldMessage* msg)
+{
+	LocalUser* user = msg->user;
+	switch (msg->state)
+	{
+		case HeldMessage::MATCHED:
+		{
+			bool echo_original = false;
+			if (!ActOnMatch(user, msg->targetname, msg->targetuuid.empty(), &msg->filter, echo_original))
+				return;
+			break;
+		}
+
+		case HeldMessage::DROP:
+			user->WriteNotice("*** Your message to " + msg->targetname + " was not delivered as it could not be checked in time.");
+			return;
+
+		default:
+			break;
+	}
+
+	// The target user might have changed their nick while the message was held. If they
+	// have quit then the message must not go to whoever is using their old nick now.
+	if (!msg->targetuuid.empty())
+	{
+		User* target = ServerInstance->FindUUID(msg->targetuuid);
+		if (!target || target->quitting)
+		{
+			user->WriteNumeric(Numerics::NoSuchNick(msg->targetname));
+			return;
+		}
+		msg->target = target->nick;
+	}
+
+	Command* handler = ServerInstance->Parser.GetHandler(msg->type == MSG_PRIVMSG ? "PRIVMSG" : "NOTICE");
+	if (!handler)
+		return;
+
+	std::vector<std::string> parameters;
+	parameters.push_back(msg->target);
+	parameters.push_back(msg->text);
+
+	delivering = true;
+	handler->Handle(user, CommandBase::Params(parameters, msg->tags));
+	delivering = false;
+}
+
+void ModuleFilter::BuildPrefilter()
+{
+	prefilter.Clear(national_case_insensitive_map);
+	prefilterliterals = unfiltered = 0;
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		const std::vector<std::string>& literals = filters[i].literals;
+		for (std::vector<std::string>::const_iterator j = literals.begin(); j != literals.end(); ++j)
+			prefilter.Add(*j, i);
+
+		prefilterliterals += literals.size();
+		if (literals.empty())
+			unfiltered++;
+	}
+	prefilter.Build();
+	found.assign(filters.size(), 0);
+	prefilterdirty = false;
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -345,8 +1413,15 @@ ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtar
 	if (!IS_LOCAL(user))
 		return MOD_RES_PASSTHRU;
 
+	// Held messages are only delivered once they passed the filters.
+	if (delivering)
+		return MOD_RES_PASSTHRU;
+
 	flags = (details.type == MSG_PRIVMSG) ? FLAG_PRIVMSG : FLAG_NOTICE;
 
+	if (!workers.empty() && msgtarget.type != MessageTarget::TYPE_SERVER)
+		return HoldMessage(IS_LOCAL(user), msgtarget, details);
+
 	FilterResult* f = this->FilterMatch(user, details.text, flags);
 	if (f)
 	{
@@ -368,85 +1443,101 @@ ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtar
 
 			target = t->name;
 		}
-		if (f->action == FA_WARN)
-		{
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("WARNING: %s's message to %s matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+
+		if (ActOnMatch(user, target, msgtarget.type == MessageTarget::TYPE_CHANNEL, f, details.echo_original))
 			return MOD_RES_PASSTHRU;
-		}
-		if (f->action == FA_BLOCK)
+		return MOD_RES_DENY;
+	}
+	return MOD_RES_PASSTHRU;
+}
+
+void ModuleFilter::Prioritize()
+{
+	// Held messages go through the PRIVMSG and NOTICE handlers again when they are released so
+	// no other module may see them before they are held, otherwise modules which count messages
+	// (e.g. m_repeat, m_messageflood) would count them twice.
+	ServerInstance->Modules->SetPriority(this, I_OnUserPreMessage, PRIORITY_FIRST);
+}
+
+bool ModuleFilter::ActOnMatch(User* user, const std::string& target, bool tochannel, FilterResult* f, bool& echo_original)
+{
+	if (f->action == FA_WARN)
+	{
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("WARNING: %s's message to %s matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		return true;
+	}
+	if (f->action == FA_BLOCK)
+	{
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s had their message to %s filtered as it matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		if (notifyuser)
 		{
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s had their message to %s filtered as it matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
-			if (notifyuser)
-			{
-				if (msgtarget.type == MessageTarget::TYPE_CHANNEL)
-					user->WriteNumeric(ERR_CANNOTSENDTOCHAN, target, InspIRCd::Format("Message to channel blocked and opers notified (%s)", f->reason.c_str()));
-				else
-					user->WriteNotice("Your message to "+target+" was blocked and opers notified: "+f->reason);
-			}
+			if (tochannel)
+				user->WriteNumeric(ERR_CANNOTSENDTOCHAN, target, InspIRCd::Format("Message to channel blocked and opers notified (%s)", f->reason.c_str()));
 			else
-				details.echo_original = true;
+				user->WriteNotice("Your message to "+target+" was blocked and opers notified: "+f->reason);
 		}
-		else if (f->action == FA_SILENT)
+		else
+			echo_original = true;
+	}
+	else if (f->action == FA_SILENT)
+	{
+		if (notifyuser)
 		{
-			if (notifyuser)
-			{
-				if (msgtarget.type == MessageTarget::TYPE_CHANNEL)
-					user->WriteNumeric(ERR_CANNOTSENDTOCHAN, target, InspIRCd::Format("Message to channel blocked (%s)", f->reason.c_str()));
-				else
-					user->WriteNotice("Your message to "+target+" was blocked: "+f->reason);
-			}
+			if (tochannel)
+				user->WriteNumeric(ERR_CANNOTSENDTOCHAN, target, InspIRCd::Format("Message to channel blocked (%s)", f->reason.c_str()));
 			else
-				details.echo_original = true;
-		}
-		else if (f->action == FA_KILL)
-		{
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was killed because their message to %s matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
-			ServerInstance->Users->QuitUser(user, "Filtered: " + f->reason);
+				user->WriteNotice("Your message to "+target+" was blocked: "+f->reason);
 		}
-		else if (f->action == FA_SHUN && (ServerInstance->XLines->GetFactory("SHUN")))
+		else
+			echo_original = true;
+	}
+	else if (f->action == FA_KILL)
+	{
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was killed because their message to %s matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		ServerInstance->Users->QuitUser(user, "Filtered: " + f->reason);
+	}
+	else if (f->action == FA_SHUN && (ServerInstance->XLines->GetFactory("SHUN")))
+	{
+		Shun* sh = new Shun(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), user->GetIPString());
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was shunned because their message to %s matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		if (ServerInstance->XLines->AddLine(sh, NULL))
 		{
-			Shun* sh = new Shun(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), user->GetIPString());
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was shunned because their message to %s matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
-			if (ServerInstance->XLines->AddLine(sh, NULL))
-			{
-				ServerInstance->XLines->ApplyLines();
-			}
-			else
-				delete sh;
+			ServerInstance->XLines->ApplyLines();
 		}
-		else if (f->action == FA_GLINE)
+		else
+			delete sh;
+	}
+	else if (f->action == FA_GLINE)
+	{
+		GLine* gl = new GLine(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), "*", user->GetIPString());
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was G-lined because their message to %s matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		if (ServerInstance->XLines->AddLine(gl,NULL))
 		{
-			GLine* gl = new GLine(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), "*", user->GetIPString());
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was G-lined because their message to %s matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
-			if (ServerInstance->XLines->AddLine(gl,NULL))
-			{
-				ServerInstance->XLines->ApplyLines();
-			}
-			else
-				delete gl;
+			ServerInstance->XLines->ApplyLines();
 		}
-		else if (f->action == FA_ZLINE)
+		else
+			delete gl;
+	}
+	else if (f->action == FA_ZLINE)
+	{
+		ZLine* zl = new ZLine(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), user->GetIPString());
+		ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was Z-lined because their message to %s matched %s (%s)",
+			user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
+		if (ServerInstance->XLines->AddLine(zl,NULL))
 		{
-			ZLine* zl = new ZLine(ServerInstance->Time(), f->duration, ServerInstance->Config->ServerName.c_str(), f->reason.c_str(), user->GetIPString());
-			ServerInstance->SNO->WriteGlobalSno('f', InspIRCd::Format("%s was Z-lined because their message to %s matched %s (%s)",
-				user->nick.c_str(), target.c_str(), f->freeform.c_str(), f->reason.c_str()));
-			if (ServerInstance->XLines->AddLine(zl,NULL))
-			{
-				ServerInstance->XLines->ApplyLines();
-			}
-			else
-				delete zl;
+			ServerInstance->XLines->ApplyLines();
 		}
-
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, user->nick + " had their message filtered, target was " + target + ": " + f->reason + " Action: " + ModuleFilter::FilterActionToString(f->action));
-		return MOD_RES_DENY;
+		else
+			delete zl;
 	}
-	return MOD_RES_PASSTHRU;
+
+	ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, user->nick + " had their message filtered, target was " + target + ": " + f->reason + " Action: " + ModuleFilter::FilterActionToString(f->action));
+	return false;
 }
 
 ModResult ModuleFilter::OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated)
@@ -573,6 +1664,15 @@ void ModuleFilter::ReadConfig(ConfigStatus& status)
 	ConfigTag* tag = ServerInstance->Config->ConfValue("filteropts");
 	std::string newrxengine = tag->getString("engine");
 	notifyuser = tag->getBool("notifyuser", true);
+	maxdelay = tag->getUInt("maxdelay", 250, 10, 60000);
+	deliverlate = stdalgo::string::equalsci(tag->getString("ontimeout", "drop"), "deliver");
+
+	const size_t threads = tag->getUInt("threads", 0, 0, 64);
+	if (threads != workers.size())
+	{
+		StopWorkers();
+		StartWorkers(threads);
+	}
 
 	factory = RegexEngine ? (RegexEngine.operator->()) : NULL;
 
@@ -683,8 +1783,41 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
 	static std::string stripped_text;
+	std::vector<FilterResult*> candidates;
+	FindCandidates(user, text, flgs, candidates, stripped_text);
+
+	for (std::vector<FilterResult*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		FilterResult* filter = *i;
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const bool matched = filter->regex->Matches(filter->flag_strip_color ? stripped_text : text);
+		filter->runtime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		filter->evaluations++;
+		if (matched)
+		{
+			filter->matches++;
+			return filter;
+		}
+	}
+	return NULL;
+}
+
+void ModuleFilter::FindCandidates(User* user, const std::string& text, int flgs, std::vector<FilterResult*>& candidates, std::string& stripped_text)
+{
 	stripped_text.clear();
 
+	if (filters.empty())
+		return;
+
+	if (prefilterdirty || prefilter.GetCaseMap() != national_case_insensitive_map)
+		BuildPrefilter();
+
+	// The text is only searched for literals once a filter which has them applies. Filters which
+	// strip colours are looked up in the stripped text as stripping can join parts of a literal.
+	enum { FOUND_TEXT = 1, FOUND_STRIPPED = 2 };
+	unsigned char searched = 0;
+	texts++;
+
 	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
 	{
 		FilterResult* filter = &*i;
@@ -699,10 +1832,26 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 			InspIRCd::StripColor(stripped_text);
 		}
 
-		if (filter->regex->Matches(filter->flag_strip_color ? stripped_text : text))
-			return filter;
+		if (!filter->literals.empty())
+		{
+			const unsigned char bit = filter->flag_strip_color ? FOUND_STRIPPED : FOUND_TEXT;
+			if (!(searched & bit))
+			{
+				if (!searched)
+					std::fill(found.begin(), found.end(), 0);
+				prefilter.Find(filter->flag_strip_color ? stripped_text : text, found, bit);
+				searched |= bit;
+			}
+
+			if (!(found[i - filters.begin()] & bit))
+			{
+				skipped++;
+				continue;
+			}
+		}
+
+		candidates.push_back(filter);
 	}
-	return NULL;
 }
 
 bool ModuleFilter::DeleteFilter(const std::string &freeform)
@@ -711,8 +1860,8 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 	{
 		if (i->freeform == freeform)
 		{
-			delete i->regex;
 			filters.erase(i);
+			prefilterdirty = true;
 			return true;
 		}
 	}
@@ -732,6 +1881,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, false));
+		prefilterdirty = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -782,12 +1932,12 @@ std::string ModuleFilter::FilterActionToString(FilterAction fa)
 
 void ModuleFilter::ReadFilters()
 {
+	prefilterdirty = true;
 	for (std::vector<FilterResult>::iterator filter = filters.begin(); filter != filters.end(); )
 	{
 		if (filter->from_config)
 		{
 			ServerInstance->SNO->WriteGlobalSno('f', "FILTER: removing filter '" + filter->freeform + "' due to config rehash.");
-			delete filter->regex;
 			filter = filters.erase(filter);
 			continue;
 		}
@@ -831,6 +1981,20 @@ ModResult ModuleFilter::OnStats(Stats::Context& stats)
 		{
 			stats.AddRow(223, RegexEngine.GetProvider()+":"+i->freeform+" "+i->GetFlags()+" "+FilterActionToString(i->action)+" "+ConvToStr(i->duration)+" :"+i->reason);
 		}
+		for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); i++)
+		{
+			stats.AddRow(223, InspIRCd::Format("STATS %lu %lu %llu :%s", i->evaluations, i->matches, i->runtime / 1000, i->freeform.c_str()));
+		}
+		if (!filters.empty())
+		{
+			if (prefilterdirty)
+				BuildPrefilter();
+			stats.AddRow(223, InspIRCd::Format("PREFILTER literals %lu unfiltered %lu texts %lu skipped %lu", static_cast<unsigned long>(prefilterliterals), static_cast<unsigned long>(unfiltered), texts, skipped));
+		}
+		if (!workers.empty())
+		{
+			stats.AddRow(223, InspIRCd::Format("THREADS %lu held %lu late %lu checking %lu", static_cast<unsigned long>(workers.size()), held, late, static_cast<unsigned long>(checking.size())));
+		}
 		for (ExemptTargetSet::const_iterator i = exemptedchans.begin(); i != exemptedchans.end(); ++i)
 		{
 			stats.AddRow(223, "EXEMPT "+(*i));
@@ -845,6 +2009,14 @@ ModResult ModuleFilter::OnStats(Stats::Context& stats)
 
 void ModuleFilter::OnUnloadModule(Module* mod)
 {
+	// Jobs which are being run might use regexes from the module which is being unloaded.
+	if (!workers.empty())
+	{
+		const size_t threads = workers.size();
+		StopWorkers();
+		StartWorkers(threads);
+	}
+
 	// If the regex engine became unavailable or has changed, remove all filters
 	if (!RegexEngine)
 	{
@@ -61,7 +61,7 @@ class FlashPDSocket : public BufferedSocket, public Timer, public insp::intrusiv
 
 	void OnDataReady() override
 	{
-		if (recvq == expected_request)
+		if (!expected_request.compare(0, std::string::npos, recvq.data(), recvq.length()))
 			WriteData(policy_reply);
 		AddToCull();
 	}
@@ -159,7 +159,7 @@ class HAProxyHook : public IOHookMiddle
 		}
 
 		// Check that the length can actually contain the TLV value.
-		std::string& recvq = GetRecvQ();
+		StreamSocket::RecvQueue& recvq = GetRecvQ();
 		uint16_t length = ntohs(recvq[start_index + 1] | (recvq[start_index + 2] << 8));
 		if (buffer_length < PP2_TLV_LENGTH + length)
 		{
@@ -199,7 +199,7 @@ class HAProxyHook : public IOHookMiddle
 			return true;
 
 		// If the client is not connecting via SSL the rest of this TLV is irrelevant.
-		std::string& recvq = GetRecvQ();
+		StreamSocket::RecvQueue& recvq = GetRecvQ();
 		if ((recvq[start_index] & PP2_CLIENT_SSL) == 0)
 			return true;
 
@@ -222,7 +222,7 @@ class HAProxyHook : public IOHookMiddle
 	int ReadProxyAddress(StreamSocket* sock)
 	{
 		// Block until we have the entire address.
-		std::string& recvq = GetRecvQ();
+		StreamSocket::RecvQueue& recvq = GetRecvQ();
 		if (recvq.length() < address_length)
 			return 0;
 
@@ -230,7 +230,7 @@ class HAProxyHook : public IOHookMiddle
 		{
 			case HPC_LOCAL:
 				// Skip the address completely.
-				recvq.erase(0, address_length);
+				recvq.erase_front(address_length);
 				break;
 
 			case HPC_PROXY:
@@ -275,7 +275,7 @@ class HAProxyHook : public IOHookMiddle
 				}
 
 				// Erase the processed proxy information from the receive queue.
-				recvq.erase(0, address_length);
+				recvq.erase_front(address_length);
 		}
 
 		// We're done!
@@ -286,14 +286,14 @@ class HAProxyHook : public IOHookMiddle
 	int ReadProxyHeader(StreamSocket* sock)
 	{
 		// Block until we have a header.
-		std::string& recvq = GetRecvQ();
+		StreamSocket::RecvQueue& recvq = GetRecvQ();
 		if (recvq.length() < PP2_HEADER_LENGTH)
 			return 0;
 
 		// Read the header.
 		HAProxyHeader header;
-		memcpy(&header, recvq.c_str(), PP2_HEADER_LENGTH);
-		recvq.erase(0, PP2_HEADER_LENGTH);
+		memcpy(&header, recvq.data(), PP2_HEADER_LENGTH);
+		recvq.erase_front(PP2_HEADER_LENGTH);
 
 		// Check we are actually parsing a HAProxy header.
 		if (memcmp(&header.signature, proxy_signature, PP2_SIGNATURE_LENGTH) != 0)
@@ -378,7 +378,7 @@ class HAProxyHook : public IOHookMiddle
 		return 1;
 	}
 
-	int OnStreamSocketRead(StreamSocket* sock, std::string& destrecvq) override
+	int OnStreamSocketRead(StreamSocket* sock, StreamSocket::RecvQueue& destrecvq) override
 	{
 		switch (state)
 		{
@@ -389,8 +389,8 @@ class HAProxyHook : public IOHookMiddle
 				return ReadProxyAddress(sock);
 
 			case HPS_CONNECTED:
-				std::string& recvq = GetRecvQ();
-				destrecvq.append(recvq);
+				StreamSocket::RecvQueue& recvq = GetRecvQ();
+				destrecvq.append(recvq.data(), recvq.length());
 				recvq.clear();
 				return 1;
 		}
@@ -26,6 +26,7 @@
    by Chernov-Phoenix Alexey (Phoenix@RusNet) mailto:phoenix /email address separator/ pravmail.ru */
 
 #include "inspircd.h"
+#include "listmode.h"
 #include <fstream>
 
 class lwbNickHandler
@@ -244,6 +245,12 @@ class ModuleNationalChars : public Module
 		RehashHashmap(ServerInstance->Users.clientlist);
 		RehashHashmap(ServerInstance->Users.uuidlist);
 		RehashHashmap(ServerInstance->chanlist);
+
+		// The case map is changed in place so the list mode indexes and the ban results cached
+		// for members would otherwise keep using the old one.
+		const ModeParser::ListModeList& listmodes = ServerInstance->Modes->GetListModes();
+		for (ModeParser::ListModeList::const_iterator i = listmodes.begin(); i != listmodes.end(); ++i)
+			(*i)->ChangeGenerations();
 	}
 
  public:
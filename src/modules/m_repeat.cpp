@@ -18,6 +18,7 @@
 
 
 #include "inspircd.h"
+#include "editdistance.h"
 #include "modules/exemption.h"
 
 class ChannelSettings
@@ -61,11 +62,18 @@ class ChannelSettings
 class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 {
  private:
+	/** The number of characters in a line, counted in buckets. An edit changes the counts by
+	 * at most two in total so lines whose counts differ by more than twice the trigger can be
+	 * skipped without computing their edit distance.
+	 */
+	typedef std::array<uint16_t, 32> LineProfile;
+
 	struct RepeatItem
 	{
 		time_t ts;
 		std::string line;
-		RepeatItem(time_t TS, const std::string& Line) : ts(TS), line(Line) { }
+		LineProfile profile;
+		RepeatItem(time_t TS, const std::string& Line, const LineProfile& Profile) : ts(TS), line(Line), profile(Profile) { }
 	};
 
 	typedef std::deque<RepeatItem> RepeatItemList;
@@ -87,35 +95,37 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff() { }
 	};
 
-	std::vector<unsigned int> mx[2];
+	EditDistance distance;
 	ModuleSettings ms;
 
-	bool CompareLines(const std::string& message, const std::string& historyline, unsigned int trigger)
+	static void GetProfile(const std::string& line, LineProfile& profile)
 	{
-		if (message == historyline)
-			return true;
-		else if (trigger)
-			return (Levenshtein(message, historyline) <= trigger);
-
-		return false;
+		profile.fill(0);
+		for (std::string::const_iterator i = line.begin(); i != line.end(); ++i)
+			profile[static_cast<unsigned char>(*i) % profile.size()]++;
 	}
 
-	unsigned int Levenshtein(const std::string& s1, const std::string& s2)
+	/** Compares a message with a line from the history. The pattern of the edit distance
+	 * computation has to be the message if the trigger is not zero.
+	 */
+	bool CompareLines(const std::string& message, const LineProfile& profile, const RepeatItem& item, unsigned int trigger)
 	{
-		unsigned int l1 = s1.size();
-		unsigned int l2 = s2.size();
+		if (message == item.line)
+			return true;
+		else if (!trigger)
+			return false;
 
-		for (unsigned int i = 0; i < l2; i++)
-			mx[0][i] = i;
-		for (unsigned int i = 0; i < l1; i++)
-		{
-			mx[1][0] = i + 1;
-			for (unsigned int j = 0; j < l2; j++)
-				mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+		const size_t length = item.line.length();
+		if ((message.length() > length ? message.length() - length : length - message.length()) > trigger)
+			return false;
 
-			mx[0].swap(mx[1]);
-		}
-		return mx[0][l2];
+		unsigned int changes = 0;
+		for (size_t i = 0; i < profile.size(); ++i)
+			changes += std::abs(profile[i] - item.profile[i]);
+		if (changes > trigger * 2)
+			return false;
+
+		return (distance.Compute(item.line, trigger) <= trigger);
 	}
 
  public:
@@ -185,6 +195,11 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 
 		std::transform(message.begin(), message.end(), message.begin(), ::tolower);
 
+		LineProfile profile;
+		GetProfile(message, profile);
+		if (trigger && !items.empty())
+			distance.SetPattern(message);
+
 		for (std::deque<RepeatItem>::iterator it = items.begin(); it != items.end(); ++it)
 		{
 			if (it->ts < now)
@@ -194,7 +209,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 				break;
 			}
 
-			if (CompareLines(message, it->line, trigger))
+			if (CompareLines(message, profile, *it, trigger))
 			{
 				if (++matches >= rs->Lines)
 				{
@@ -215,21 +230,11 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (items.size() >= max_items)
 			items.pop_back();
 
-		items.push_front(RepeatItem(now + rs->Seconds, message));
+		items.push_front(RepeatItem(now + rs->Seconds, message, profile));
 		rp->Counter = matches;
 		return false;
 	}
 
-	void Resize(size_t size)
-	{
-		size_t newsize = size+1;
-		if (newsize <= mx[0].size())
-			return;
-		ms.MaxMessageSize = size;
-		mx[0].resize(newsize);
-		mx[1].resize(newsize);
-	}
-
 	void ReadConfig()
 	{
 		ConfigTag* conf = ServerInstance->Config->ConfValue("repeat");
@@ -241,10 +246,9 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (ms.MaxDiff > 100)
 			ms.MaxDiff = 100;
 
-		unsigned int newsize = conf->getUInt("size", 512);
-		if (newsize > ServerInstance->Config->Limits.MaxLine)
-			newsize = ServerInstance->Config->Limits.MaxLine;
-		Resize(newsize);
+		ms.MaxMessageSize = conf->getUInt("size", 512);
+		if (ms.MaxMessageSize > ServerInstance->Config->Limits.MaxLine)
+			ms.MaxMessageSize = ServerInstance->Config->Limits.MaxLine;
 	}
 
 	std::string GetModuleSettings() const
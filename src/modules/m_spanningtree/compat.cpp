@@ -27,12 +27,16 @@ static std::string newline("\n");
 void TreeSocket::WriteLineNoCompat(const std::string& line)
 {
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+	this->linessent++;
 	this->WriteData(line);
 	this->WriteData(newline);
 }
 
 void TreeSocket::WriteLine(const std::string& original_line)
 {
+	if ((burst) && (HoldLine(original_line)))
+		return;
+
 	if (LinkState == CONNECTED)
 	{
 		if (proto_version != ProtocolVersion)
@@ -47,6 +47,7 @@ ModuleSpanningTree::ModuleSpanningTree()
 	, eventprov(this, "event/server")
 	, DNS(this, "DNS")
 	, tagevprov(this, "event/messagetag")
+	, channelroutes("channelroutes", ExtensionItem::EXT_CHANNEL, this)
 	, loopCall(false)
 {
 }
@@ -467,7 +468,10 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by
 {
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
+	{
+		Utils->UpdateChannelRoutes(memb, true);
 		return;
+	}
 
 	// Assign the current membership id to the new Membership and increase it
 	memb->id = currmembid++;
@@ -527,6 +531,10 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 			params.push_last(partmessage);
 		params.Broadcast();
 	}
+	else
+	{
+		Utils->UpdateChannelRoutes(memb, false);
+	}
 }
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
@@ -540,6 +548,9 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 	}
 	else
 	{
+		for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+			Utils->UpdateChannelRoutes(*i, false);
+
 		// Hide the message if one of the following is true:
 		// - User is being quit due to a netsplit and quietbursts is on
 		// - Server is a silent uline
@@ -574,6 +585,9 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	if (!IS_LOCAL(memb->user))
+		Utils->UpdateChannelRoutes(memb, false);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
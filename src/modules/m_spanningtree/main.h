@@ -88,6 +88,10 @@ class ModuleSpanningTree
 
 	ServerCommandManager CmdManager;
 
+	/** Number of remote members of each channel behind each route
+	 */
+	SimpleExtItem<ChannelRoutes> channelroutes;
+
 	/** Set to true if inside a spanningtree call, to prevent sending
 	 * xlines and other things back to their source
 	 */
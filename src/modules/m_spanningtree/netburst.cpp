@@ -90,16 +90,84 @@ class FModeBuilder : public CmdBuilder
 	}
 };
 
+namespace
+{
+	uint64_t NowMs()
+	{
+		return ServerInstance->Time() * 1000 + (ServerInstance->Time_ns() / 1000000);
+	}
+}
+
 struct TreeSocket::BurstState
 {
+	/** The parts of the burst which are sent incrementally, in order. */
+	enum Stage
+	{
+		STAGE_USERS,
+		STAGE_CHANNELS,
+		STAGE_DONE
+	};
+
 	SpanningTreeProtocolInterface::Server server;
-	BurstState(TreeSocket* sock) : server(sock) { }
+
+	/** The part of the burst currently being sent. */
+	Stage stage;
+
+	/** The UUIDs of the users to send. Users who connect after the burst started are
+	 * introduced by the UID sent when they finish registering instead.
+	 */
+	std::vector<std::string> users;
+
+	/** The names of the channels to send. Channels created after the burst started are
+	 * introduced by the FJOIN sent when they are created instead.
+	 */
+	std::vector<std::string> chans;
+
+	/** Index of the next entry to send in users or chans depending on the stage. */
+	size_t pos;
+
+	/** The value of TreeSocket::linessent when the burst started. */
+	unsigned long startlines;
+
+	/** The time the burst started in milliseconds. */
+	uint64_t startms;
+
+	/** Whether the lines being written are part of the burst. */
+	bool sending;
+
+	/** Lines which were written to the socket while the burst is being sent. They are sent
+	 * once the burst has finished so the remote server knows about every user and channel
+	 * they refer to.
+	 */
+	std::deque<std::string> held;
+
+	/** The size of the lines in held. */
+	size_t heldbytes;
+
+	BurstState(TreeSocket* sock)
+		: server(sock)
+		, stage(STAGE_USERS)
+		, pos(0)
+		, startlines(0)
+		, startms(0)
+		, sending(true)
+		, heldbytes(0)
+	{
+	}
 };
 
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
  * users to exist. You get the idea.
+ *
+ * Servers are sent immediately. Users and channels are sent by ContinueBurst()
+ * a few at a time whenever the sendq of the socket drains so bursting a big
+ * network does not stall the server or balloon the sendq. Users and channels
+ * which have not been sent yet are sent with their state at the time they are
+ * reached. Anything else which is written to the socket in the meantime is held
+ * by HoldLine() and sent after the burst, just like it would have been queued
+ * behind a burst which was sent all at once.
  */
 void TreeSocket::DoBurst(TreeServer* s)
 {
@@ -108,26 +176,175 @@ void TreeSocket::DoBurst(TreeServer* s)
 		capab->auth_fingerprint ? "SSL certificate fingerprint and " : "",
 		capab->auth_challenge ? "challenge-response" : "plaintext password");
 	this->CleanNegotiationInfo();
+
+	burst = new BurstState(this);
+	burst->startlines = linessent;
+	burst->startms = NowMs();
+
 	this->WriteLine(CmdBuilder("BURST").push_int(ServerInstance->Time()));
 	// Introduce all servers behind us
 	this->SendServers(Utils->TreeRoot, s);
 
-	BurstState bs(this);
-	// Introduce all users
-	this->SendUsers(bs);
+	const user_hash& users = ServerInstance->Users->GetUsers();
+	burst->users.reserve(users.size());
+	for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+	{
+		if (i->second->registered == REG_ALL)
+			burst->users.push_back(i->second->uuid);
+	}
 
-	// Sync all channels
 	const chan_hash& chans = ServerInstance->GetChans();
+	burst->chans.reserve(chans.size());
 	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-		SyncChannel(i->second, bs);
+		burst->chans.push_back(i->first);
+
+	ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	BurstState& bs = *burst;
+	bs.sending = true;
+	const unsigned long maxlines = linessent + Utils->BurstLines;
+	while ((linessent < maxlines) && (getSendQSize() < Utils->BurstSendQ))
+	{
+		if (bs.stage == BurstState::STAGE_USERS)
+		{
+			if (bs.pos < bs.users.size())
+			{
+				// Skip users who quit since the burst started
+				User* user = ServerInstance->FindUUID(bs.users[bs.pos++]);
+				if ((user) && (!user->quitting))
+					SendUser(user, bs);
+				continue;
+			}
+
+			ServerInstance->SNO->WriteToSnoMask('l', "Burst to \2%s\2: sent %lu users in %lu lines, sending %lu channels.",
+				MyRoot->GetName().c_str(), (unsigned long)bs.users.size(), linessent - bs.startlines, (unsigned long)bs.chans.size());
+
+			bs.stage = BurstState::STAGE_CHANNELS;
+			bs.pos = 0;
+			std::vector<std::string>().swap(bs.users);
+		}
+		else if (bs.stage == BurstState::STAGE_CHANNELS)
+		{
+			if (bs.pos < bs.chans.size())
+			{
+				// Skip channels which were destroyed since the burst started
+				Channel* chan = ServerInstance->FindChan(bs.chans[bs.pos++]);
+				if (chan)
+					SyncChannel(chan, bs);
+				continue;
+			}
+
+			bs.stage = BurstState::STAGE_DONE;
+		}
+		else
+		{
+			FinishBurst();
+			return;
+		}
+	}
+
+	// Not finished yet. If the socket is blocked OnEventHandlerWrite() will be called once it can be
+	// written to again, otherwise ask for a write event so the main loop does not sleep in the meantime.
+	bs.sending = false;
+	if (!(GetEventMask() & FD_WRITE_WILL_BLOCK))
+		SocketEngine::ChangeEventMask(this, FD_WANT_SINGLE_WRITE);
+}
 
+void TreeSocket::FinishBurst()
+{
 	// Send all xlines
 	this->SendXLines();
-	FOREACH_MOD_CUSTOM(Utils->Creator->GetEventProvider(), ServerEventListener, OnSyncNetwork, (bs.server));
+	FOREACH_MOD_CUSTOM(Utils->Creator->GetEventProvider(), ServerEventListener, OnSyncNetwork, (burst->server));
 	this->WriteLine(CmdBuilder("ENDBURST"));
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
 
+	const unsigned long lines = linessent - burst->startlines;
+	const uint64_t duration = NowMs() - burst->startms;
+	ServerInstance->SNO->WriteToSnoMask('l', "Finished bursting to \2%s\2 (%lu lines in %lu.%03lu seconds).",
+		MyRoot->GetName().c_str(), lines, (unsigned long)(duration / 1000), (unsigned long)(duration % 1000));
+
+	// Send what was held back while the burst was being sent.
+	std::deque<std::string> held;
+	held.swap(burst->held);
+	StopBurst();
 	this->burstsent = true;
+	for (std::deque<std::string>::const_iterator i = held.begin(); i != held.end(); ++i)
+		this->WriteLine(*i);
+}
+
+bool TreeSocket::HoldLine(const std::string& line)
+{
+	if (burst->sending)
+		return false;
+
+	// Pings only refer to servers which have all been sent already and they must not be
+	// delayed by a long burst or the remote server might think we timed out.
+	std::string::size_type start = 0;
+	for (unsigned int prefixes = 0; prefixes < 2; ++prefixes)
+	{
+		if (line[start] != '@' && line[start] != ':')
+			break;
+
+		start = line.find(' ', start);
+		if (start == std::string::npos)
+			return false;
+		start++;
+	}
+
+	const std::string::size_type end = line.find(' ', start);
+	const std::string command(line, start, end == std::string::npos ? std::string::npos : end - start);
+	if (command == "PING" || command == "PONG" || command == "ERROR")
+		return false;
+
+	// Nothing more will be sent to a server which is being disconnected.
+	if (LinkState == DYING)
+		return true;
+
+	// The held lines are not in the sendq yet but they will end up there so they count towards the limit.
+	if (getSendQSize() + burst->heldbytes + line.length() > Utils->BurstMaxSendQ)
+	{
+		std::deque<std::string>().swap(burst->held);
+		burst->heldbytes = 0;
+		SendError("SendQ exceeded while bursting");
+		return true;
+	}
+
+	burst->held.push_back(line);
+	burst->heldbytes += line.length();
+	return true;
+}
+
+void TreeSocket::StopBurst()
+{
+	delete burst;
+	burst = NULL;
+}
+
+void TreeSocket::OnEventHandlerWrite()
+{
+	BufferedSocket::OnEventHandlerWrite();
+
+	if ((burst) && (LinkState == CONNECTED) && (getError().empty()))
+		ContinueBurst();
+}
+
+std::string TreeSocket::GetBurstProgress() const
+{
+	if (!burst)
+		return "not bursting";
+
+	std::string stage;
+	if (burst->stage == BurstState::STAGE_USERS)
+		stage = InspIRCd::Format("%lu/%lu users", (unsigned long)burst->pos, (unsigned long)burst->users.size());
+	else
+		stage = InspIRCd::Format("%lu/%lu channels", (unsigned long)burst->pos, (unsigned long)burst->chans.size());
+
+	const uint64_t duration = NowMs() - burst->startms;
+	return InspIRCd::Format("%s, %lu lines in %lu seconds, sendq %lu bytes, %lu lines (%lu bytes) held", stage.c_str(),
+		linessent - burst->startlines, (unsigned long)(duration / 1000), (unsigned long)getSendQSize(),
+		(unsigned long)burst->held.size(), (unsigned long)burst->heldbytes);
 }
 
 void TreeSocket::SendServerInfo(TreeServer* from)
@@ -274,33 +491,25 @@ void TreeSocket::SyncChannel(Channel* chan)
 	SyncChannel(chan, bs);
 }
 
-/** Send all users and their state, including oper and away status and global metadata */
-void TreeSocket::SendUsers(BurstState& bs)
+/** Send a user and their state, including oper and away status and global metadata */
+void TreeSocket::SendUser(User* user, BurstState& bs)
 {
-	const user_hash& users = ServerInstance->Users->GetUsers();
-	for (user_hash::const_iterator u = users.begin(); u != users.end(); ++u)
-	{
-		User* user = u->second;
-		if (user->registered != REG_ALL)
-			continue;
-
-		this->WriteLine(CommandUID::Builder(user));
+	this->WriteLine(CommandUID::Builder(user));
 
-		if (user->IsOper())
-			this->WriteLine(CommandOpertype::Builder(user));
+	if (user->IsOper())
+		this->WriteLine(CommandOpertype::Builder(user));
 
-		if (user->IsAway())
-			this->WriteLine(CommandAway::Builder(user));
-
-		const Extensible::ExtensibleStore& exts = user->GetExtList();
-		for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-			if (!value.empty())
-				this->WriteLine(CommandMetadata::Builder(user, item->name, value));
-		}
+	if (user->IsAway())
+		this->WriteLine(CommandAway::Builder(user));
 
-		FOREACH_MOD_CUSTOM(Utils->Creator->GetEventProvider(), ServerEventListener, OnSyncUser, (user, bs.server));
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, user, i->second);
+		if (!value.empty())
+			this->WriteLine(CommandMetadata::Builder(user, item->name, value));
 	}
+
+	FOREACH_MOD_CUSTOM(Utils->Creator->GetEventProvider(), ServerEventListener, OnSyncUser, (user, bs.server));
 }
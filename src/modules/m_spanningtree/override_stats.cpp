@@ -23,6 +23,8 @@
 #include "main.h"
 #include "utils.h"
 #include "link.h"
+#include "treeserver.h"
+#include "treesocket.h"
 
 ModResult ModuleSpanningTree::OnStats(Stats::Context& stats)
 {
@@ -55,5 +57,21 @@ ModResult ModuleSpanningTree::OnStats(Stats::Context& stats)
 		}
 		return MOD_RES_DENY;
 	}
+	else if (stats.GetSymbol() == 'b')
+	{
+		const TreeServer::ChildServers& children = Utils->TreeRoot->GetChildren();
+		for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
+		{
+			TreeSocket* sock = (*i)->GetSocket();
+			if (sock->IsSendingBurst())
+				stats.AddRow(249, (*i)->GetName() + ": " + sock->GetBurstProgress());
+		}
+		return MOD_RES_DENY;
+	}
+	else if (stats.GetSymbol() == 'T')
+	{
+		// The core adds the rest of the rows
+		stats.AddRow(249, InspIRCd::Format("channel route cache hits %lu rebuilds %lu", Utils->RouteCacheHits, Utils->RouteCacheBuilds));
+	}
 	return MOD_RES_PASSTHRU;
 }
@@ -187,6 +187,10 @@ void TreeServer::SQuitChild(TreeServer* server, const std::string& reason)
 	if (server->IsLocal())
 		server->GetSocket()->Close();
 
+	// The route is gone so channel route caches which were built while the split was in progress must not be used
+	if (IsRoot())
+		Utils->RouteGeneration++;
+
 	// Add the server to the cull list, the servers behind it are handled by cull() and the destructor
 	ServerInstance->GlobalCulls.AddItem(server);
 }
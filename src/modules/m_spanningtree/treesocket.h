@@ -103,6 +103,33 @@ class TreeSocket : public BufferedSocket
 	 */
 	bool burstsent;
 
+	/** State of the burst we are sending, NULL if we are not sending one.
+	 */
+	BurstState* burst;
+
+	/** Number of lines written to this socket.
+	 */
+	unsigned long linessent;
+
+	/** Send as much of the burst as the flow control settings allow, finishing it if everything has been sent.
+	 */
+	void ContinueBurst();
+
+	/** Send the last part of the burst and free the burst state.
+	 */
+	void FinishBurst();
+
+	/** Abandon the burst we are sending, if any, and free the burst state.
+	 */
+	void StopBurst();
+
+	/** Hold a line which is written while we are sending a burst so it is sent after the burst.
+	 * The link is dropped if the held lines and the sendq grow beyond the configured limit.
+	 * @param line The line to hold
+	 * @return True if the line was held or dropped, false if it should be sent now
+	 */
+	bool HoldLine(const std::string& line);
+
 	/** Checks if the given servername and sid are both free
 	 */
 	bool CheckDuplicate(const std::string& servername, const std::string& sid);
@@ -114,8 +141,8 @@ class TreeSocket : public BufferedSocket
 	/** Send all known information about a channel */
 	void SyncChannel(Channel* chan, BurstState& bs);
 
-	/** Send all users and their oper state, away state and metadata */
-	void SendUsers(BurstState& bs);
+	/** Send a user and their oper state, away state and metadata */
+	void SendUser(User* user, BurstState& bs);
 
 	/** Send all additional info about the given server to this server */
 	void SendServerInfo(TreeServer* from);
@@ -272,6 +299,15 @@ class TreeSocket : public BufferedSocket
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Returns true if we are in the middle of sending a burst on this socket
+	 */
+	bool IsSendingBurst() const { return (burst != NULL); }
+
+	/** Describe how far the burst we are sending on this socket got
+	 * @return Progress of the burst, suitable for showing to opers
+	 */
+	std::string GetBurstProgress() const;
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -309,6 +345,10 @@ class TreeSocket : public BufferedSocket
 	/** Handle socket timeout from connect()
 	 */
 	void OnTimeout() override;
+
+	/** Send more of the burst when the sendq has drained
+	 */
+	void OnEventHandlerWrite() override;
 	/** Handle server quit on close
 	 */
 	void Close() override;
@@ -22,6 +22,7 @@
 
 #include "inspircd.h"
 #include "iohook.h"
+#include "linescan.h"
 
 #include "main.h"
 #include "modules/server.h"
@@ -38,7 +39,7 @@
  */
 TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 	: linkID(link->Name), LinkState(CONNECTING), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burstsent(false), burst(NULL), linessent(0), age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->link = link;
@@ -55,7 +56,7 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const std::string& ipaddr)
 TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 	: BufferedSocket(newfd)
 	, linkID("inbound from " + client->addr()), LinkState(WAIT_AUTH_1), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burstsent(false), burst(NULL), linessent(0), age(ServerInstance->Time())
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
@@ -99,6 +100,7 @@ CullResult TreeSocket::cull()
 
 TreeSocket::~TreeSocket()
 {
+	StopBurst();
 	delete capab;
 }
 
@@ -181,13 +183,17 @@ void TreeSocket::OnDataReady()
 	std::string line;
 	while (GetNextLine(line))
 	{
-		std::string::size_type rline = line.find('\r');
-		if (rline != std::string::npos)
-			line.erase(rline);
-		if (line.find('\0') != std::string::npos)
+		// Everything after a \r is dropped but a \0 anywhere before it is an error
+		const char* const end = line.data() + line.length();
+		const char* const special = LineScan::Find(line.data(), end, '\r', '\0');
+		if (special != end)
 		{
-			SendError("Read null character from socket");
-			break;
+			if (*special == '\0')
+			{
+				SendError("Read null character from socket");
+				break;
+			}
+			line.erase(special - line.data());
 		}
 
 		try
@@ -106,6 +106,12 @@ TreeServer* SpanningTreeUtilities::FindRouteTarget(const std::string& target)
 SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C)
 	: Creator(C), TreeRoot(NULL)
 	, PingFreq(60) // XXX: TreeServer constructor reads this and TreeRoot is created before the config is read, so init it to something (value doesn't matter) to avoid a valgrind warning in TimerManager on unload
+	, BurstLines(1000)
+	, BurstSendQ(256*1024)
+	, BurstMaxSendQ(32*1024*1024)
+	, RouteGeneration(1)
+	, RouteCacheHits(0)
+	, RouteCacheBuilds(0)
 {
 	ServerInstance->Timers.AddTimer(&RefreshTimer);
 }
@@ -135,7 +141,7 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 }
 
 // Returns a list of DIRECT servers for a specific channel
-void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list)
+void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketList& list, char status, const CUList& exempt_list)
 {
 	unsigned int minrank = 0;
 	if (status)
@@ -145,36 +151,117 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 			minrank = mh->GetPrefixRank();
 	}
 
-	TreeServer::ChildServers children = TreeRoot->GetChildren();
-	const Channel::MemberMap& ulist = c->GetUsers();
-	for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+	insp::flat_set<TreeServer*> routes;
+	if (minrank)
 	{
-		if (IS_LOCAL(i->first))
-			continue;
+		// Only members with a high enough rank are relevant, check each of them
+		const Channel::MemberMap& ulist = c->GetUsers();
+		for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+		{
+			if (IS_LOCAL(i->first))
+				continue;
 
-		if (minrank && i->second->getRank() < minrank)
-			continue;
+			if (i->second->getRank() < minrank)
+				continue;
 
-		if (exempt_list.find(i->first) == exempt_list.end())
+			if (exempt_list.find(i->first) == exempt_list.end())
+				routes.insert(TreeServer::Get(i->first)->GetRoute());
+		}
+	}
+	else
+	{
+		// Every member is relevant so the route counts are enough, a route
+		// needs the message unless all of its members on the channel are exempt
+		insp::flat_map<TreeServer*, size_t> exempt_counts;
+		for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
 		{
-			TreeServer* best = TreeServer::Get(i->first);
-			list.insert(best->GetSocket());
+			User* user = *i;
+			if (!IS_LOCAL(user) && c->HasUser(user))
+				exempt_counts[TreeServer::Get(user)->GetRoute()]++;
+		}
 
-			TreeServer::ChildServers::iterator citer = std::find(children.begin(), children.end(), best);
-			if (citer != children.end())
-				children.erase(citer);
+		const ChannelRoutes::RouteCounts& counts = GetChannelRoutes(c);
+		for (ChannelRoutes::RouteCounts::const_iterator i = counts.begin(); i != counts.end(); ++i)
+		{
+			insp::flat_map<TreeServer*, size_t>::const_iterator exempt = exempt_counts.find(i->first);
+			if ((exempt == exempt_counts.end()) || (exempt->second < i->second))
+				routes.insert(i->first);
 		}
 	}
 
+	for (insp::flat_set<TreeServer*>::const_iterator i = routes.begin(); i != routes.end(); ++i)
+		list.push_back((*i)->GetSocket());
+
 	// Check whether the servers which do not have users in the channel might need this message. This
 	// is used to keep the chanhistory module synchronised between servers.
+	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
 	{
+		if (routes.count(*i))
+			continue;
+
 		ModResult result;
 		FIRST_MOD_RESULT_CUSTOM(Creator->GetEventProvider(), ServerEventListener, OnBroadcastMessage, result, (c, *i));
 		if (result == MOD_RES_ALLOW)
-			list.insert((*i)->GetSocket());
+			list.push_back((*i)->GetSocket());
+	}
+}
+
+const ChannelRoutes::RouteCounts& SpanningTreeUtilities::GetChannelRoutes(Channel* c)
+{
+	// The counts are kept up to date by UpdateChannelRoutes() so they only need to be rebuilt
+	// if they were never built, a direct link split or a membership change was missed.
+	const size_t remote = c->GetUserCounter() - c->GetLocalMembers().size();
+	ChannelRoutes* routes = Creator->channelroutes.get(c);
+	if ((routes) && (routes->total == remote) && (routes->generation == RouteGeneration))
+	{
+		RouteCacheHits++;
+		return routes->counts;
 	}
+
+	if (!routes)
+	{
+		routes = new ChannelRoutes;
+		Creator->channelroutes.set(c, routes);
+	}
+
+	routes->counts.clear();
+	routes->total = remote;
+	routes->generation = RouteGeneration;
+
+	const Channel::ServerMemberCount& servers = c->GetServerMemberCounts();
+	for (Channel::ServerMemberCount::const_iterator i = servers.begin(); i != servers.end(); ++i)
+		routes->counts[static_cast<TreeServer*>(i->first)->GetRoute()] += i->second;
+
+	RouteCacheBuilds++;
+	return routes->counts;
+}
+
+void SpanningTreeUtilities::UpdateChannelRoutes(Membership* memb, bool adding)
+{
+	ChannelRoutes* routes = Creator->channelroutes.get(memb->chan);
+	if (!routes)
+		return;
+
+	TreeServer* route = TreeServer::Get(memb->user)->GetRoute();
+	if (adding)
+	{
+		routes->counts[route]++;
+		routes->total++;
+		return;
+	}
+
+	ChannelRoutes::RouteCounts::iterator it = routes->counts.find(route);
+	if (it == routes->counts.end())
+	{
+		// Out of sync, make GetChannelRoutes() rebuild the counts
+		routes->generation = 0;
+		return;
+	}
+
+	if (--it->second == 0)
+		routes->counts.erase(it);
+	routes->total--;
 }
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
@@ -244,7 +331,11 @@ void SpanningTreeUtilities::ReadConfiguration()
 	HideSplits = security->getBool("hidesplits");
 	AnnounceTSChange = options->getBool("announcets");
 	AllowOptCommon = options->getBool("allowmismatch");
-	quiet_bursts = ServerInstance->Config->ConfValue("performance")->getBool("quietbursts");
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	quiet_bursts = performance->getBool("quietbursts");
+	BurstLines = performance->getUInt("burstlines", 1000, 1);
+	BurstSendQ = performance->getUInt("burstsendq", 256*1024, 1024);
+	BurstMaxSendQ = performance->getUInt("burstmaxsendq", 32*1024*1024, BurstSendQ);
 	PingWarnTime = options->getDuration("pingwarning", 15);
 	PingFreq = options->getDuration("serverpingfreq", 60, 1);
 
@@ -363,9 +454,9 @@ void SpanningTreeUtilities::SendChannelMessage(const std::string& prefix, Channe
 	if (!text.empty())
 		msg.push_last(text);
 
-	TreeSocketSet list;
+	TreeSocketList list;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
-	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
+	for (TreeSocketList::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
@@ -39,6 +39,27 @@ extern SpanningTreeUtilities* Utils;
  */
 typedef std::unordered_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
 
+/** Number of remote members of a channel reachable through each directly connected server
+ */
+struct ChannelRoutes
+{
+	typedef insp::flat_map<TreeServer*, size_t> RouteCounts;
+
+	/** Number of members behind each route, routes without members are not in the map
+	 */
+	RouteCounts counts;
+
+	/** Total number of remote members, used to detect when the counts are out of date
+	 */
+	size_t total;
+
+	/** Value of SpanningTreeUtilities::RouteGeneration when the counts were built
+	 */
+	unsigned long generation;
+
+	ChannelRoutes() : total(0), generation(0) { }
+};
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -47,7 +68,7 @@ class SpanningTreeUtilities : public classbase
 	CacheRefreshTimer RefreshTimer;
 
  public:
- 	typedef std::set<TreeSocket*> TreeSocketSet;
+ 	typedef std::vector<TreeSocket*> TreeSocketList;
 	typedef std::map<TreeSocket*, std::pair<std::string, unsigned int> > TimeoutList;
 
 	/** Creator module
@@ -107,6 +128,30 @@ class SpanningTreeUtilities : public classbase
 	 */
 	unsigned int PingFreq;
 
+	/** Maximum number of lines sent to a server we are bursting to in one go
+	 */
+	unsigned long BurstLines;
+
+	/** Size the sendq of a server we are bursting to must drain below before more of the burst is sent
+	 */
+	unsigned long BurstSendQ;
+
+	/** Maximum size of the sendq of a server we are bursting to plus the lines held back until the burst is finished
+	 */
+	unsigned long BurstMaxSendQ;
+
+	/** Incremented when a directly connected server splits, invalidates every channel route cache
+	 */
+	unsigned long RouteGeneration;
+
+	/** Number of channel messages routed using an up to date route cache
+	 */
+	unsigned long RouteCacheHits;
+
+	/** Number of times a channel route cache had to be built from the member list of the channel
+	 */
+	unsigned long RouteCacheBuilds;
+
 	/** Initialise utility class
 	 */
 	SpanningTreeUtilities(ModuleSpanningTree* Creator);
@@ -143,7 +188,19 @@ class SpanningTreeUtilities : public classbase
 
 	/** Compile a list of servers which contain members of channel c
 	 */
-	void GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list);
+	void GetListOfServersForChannel(Channel* c, TreeSocketList& list, char status, const CUList& exempt_list);
+
+	/** Get the route counts of a channel, building them if they are missing or out of date
+	 * @param c The channel to get the route counts of
+	 * @return The route counts of the channel
+	 */
+	const ChannelRoutes::RouteCounts& GetChannelRoutes(Channel* c);
+
+	/** Update the route counts of a channel when a remote user joins or leaves it
+	 * @param memb The membership of the remote user
+	 * @param adding True if the user joined the channel, false if they are leaving it
+	 */
+	void UpdateChannelRoutes(Membership* memb, bool adding);
 
 	/** Find a server by name or SID
 	 */
@@ -149,12 +149,12 @@ class WebSocketHook : public IOHookMiddle
 
 	int HandleAppData(StreamSocket* sock, std::string& appdataout, bool allowlarge)
 	{
-		std::string& myrecvq = GetRecvQ();
+		StreamSocket::RecvQueue& myrecvq = GetRecvQ();
 		// Need 1 byte opcode, minimum 1 byte len, 4 bytes masking key
 		if (myrecvq.length() < 6)
 			return 0;
 
-		const std::string& cmyrecvq = myrecvq;
+		const StreamSocket::RecvQueue& cmyrecvq = myrecvq;
 		unsigned char len1 = (unsigned char)cmyrecvq[1];
 		if (!(len1 & WS_MASKBIT))
 		{
@@ -206,15 +206,15 @@ class WebSocketHook : public IOHookMiddle
 			return 0;
 
 		unsigned int maskkeypos = 0;
-		const std::string::iterator endit = myrecvq.begin() + payloadstartoffset + len;
-		for (std::string::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
+		const StreamSocket::RecvQueue::const_iterator endit = myrecvq.begin() + payloadstartoffset + len;
+		for (StreamSocket::RecvQueue::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
 		{
 			const unsigned char c = (unsigned char)*i;
 			appdataout.push_back(c ^ maskkey[maskkeypos++]);
 			maskkeypos %= 4;
 		}
 
-		myrecvq.erase(myrecvq.begin(), endit);
+		myrecvq.erase_front(payloadstartoffset + len);
 		return 1;
 	}
 
@@ -234,20 +234,19 @@ class WebSocketHook : public IOHookMiddle
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
-		elem.append(appdata);
-		GetSendQ().push_back(elem);
+		GetSendQ().push_back(PrepareSendQElem(appdata.length(), OP_PONG));
+		GetSendQ().push_back(std::move(appdata));
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
 		return 1;
 	}
 
-	int HandleWS(StreamSocket* sock, std::string& destrecvq)
+	int HandleWS(StreamSocket* sock, StreamSocket::RecvQueue& destrecvq)
 	{
 		if (GetRecvQ().empty())
 			return 0;
 
-		unsigned char opcode = (unsigned char)GetRecvQ().c_str()[0];
+		unsigned char opcode = (unsigned char)GetRecvQ()[0];
 		switch (opcode & ~WS_FINBIT)
 		{
 			case OP_CONTINUATION:
@@ -268,7 +267,7 @@ class WebSocketHook : public IOHookMiddle
 
 				// If we are on the final message of this block append a line terminator.
 				if (opcode & WS_FINBIT)
-					destrecvq.append("\r\n");
+					destrecvq.append("\r\n", 2);
 
 				return 1;
 			}
@@ -308,11 +307,13 @@ class WebSocketHook : public IOHookMiddle
 
 	int HandleHTTPReq(StreamSocket* sock)
 	{
-		std::string& recvq = GetRecvQ();
-		const std::string::size_type reqend = recvq.find("\r\n\r\n");
-		if (reqend == std::string::npos)
+		StreamSocket::RecvQueue& myrecvq = GetRecvQ();
+		const std::string::size_type reqend = myrecvq.find("\r\n\r\n");
+		if (reqend == StreamSocket::RecvQueue::npos)
 			return 0;
 
+		const std::string recvq(myrecvq.data(), reqend + 4);
+
 		bool allowedorigin = false;
 		HTTPHeaderFinder originheader;
 		if (originheader.Find(recvq, "Origin:", 7, reqend))
@@ -358,7 +359,7 @@ class WebSocketHook : public IOHookMiddle
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
 
-		recvq.erase(0, reqend + 4);
+		myrecvq.erase_front(reqend + 4);
 
 		return 1;
 	}
@@ -425,7 +426,7 @@ class WebSocketHook : public IOHookMiddle
 		return 1;
 	}
 
-	int OnStreamSocketRead(StreamSocket* sock, std::string& destrecvq) override
+	int OnStreamSocketRead(StreamSocket* sock, StreamSocket::RecvQueue& destrecvq) override
 	{
 		if (state == STATE_HTTPREQ)
 		{
@@ -248,6 +248,13 @@ int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
 	return nbRecvd;
 }
 
+int SocketEngine::ReadV(EventHandler* fd, const IOVector* iovec, int count)
+{
+	int nbRecvd = readv(fd->GetFd(), iovec, count);
+	stats.UpdateReadCounters(nbRecvd);
+	return nbRecvd;
+}
+
 int SocketEngine::SendTo(EventHandler* fd, const void* buf, size_t len, int flags, const irc::sockets::sockaddrs& address)
 {
 	int nbSent = sendto(fd->GetFd(), (const char*)buf, len, flags, &address.sa, address.sa_size());
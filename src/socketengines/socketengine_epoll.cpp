@@ -20,7 +20,9 @@
 
 #include "inspircd.h"
 
+#include <atomic>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
 
 /** A specialisation of the SocketEngine class, designed to use linux 2.6 epoll().
@@ -32,6 +34,369 @@ namespace
 	/** These are used by epoll() to hold socket events
 	 */
 	std::vector<struct epoll_event> events(1);
+
+	/** The epoll state of a file descriptor which is in the socket engine.
+	 */
+	struct FdState
+	{
+		/** The events the kernel currently has registered for the fd. */
+		unsigned events;
+
+		/** True if the fd is in DirtyFds. */
+		bool dirty;
+
+		FdState() : events(0), dirty(false) { }
+	};
+
+	/** State of every fd, indexed by fd.
+	 */
+	std::vector<FdState> fdstates;
+
+	/** File descriptors whose event mask changed since the last call to epoll_wait().
+	 * The changes are applied in one go before waiting so a mask which flips back
+	 * and forth multiple times in one loop iteration costs at most one epoll_ctl().
+	 */
+	std::vector<int> DirtyFds;
+
+	class IOThread;
+
+	/** A socket which is read from by an I/O thread.
+	 */
+	struct ThreadedSocket
+	{
+		/** The socket, only used on the main thread. */
+		StreamSocket* const sock;
+
+		/** The file descriptor of the socket. */
+		const int fd;
+
+		/** The I/O thread reading from the socket. */
+		IOThread* const thread;
+
+		/** Number of bytes read by the I/O thread which have not been processed by the main thread yet. */
+		std::atomic<size_t> pending;
+
+		/** True if the I/O thread stopped reading because too much data is pending, guarded by IOThread::sockmutex. */
+		bool paused;
+
+		/** True if the socket has been removed from its I/O thread, only used on the main thread. */
+		bool detached;
+
+		ThreadedSocket(StreamSocket* s, IOThread* t)
+			: sock(s)
+			, fd(s->GetFd())
+			, thread(t)
+			, pending(0)
+			, paused(false)
+			, detached(false)
+		{
+		}
+	};
+
+	/** Data or an error read by an I/O thread, waiting to be processed on the main thread.
+	 */
+	struct ThreadedRead
+	{
+		/** The socket the data was read from. */
+		std::shared_ptr<ThreadedSocket> tsock;
+
+		/** The data which was read, NULL if the connection was closed or on error. */
+		std::unique_ptr<char[]> data;
+
+		/** The number of bytes in data. */
+		size_t length;
+
+		/** The error code if reading failed or 0. */
+		int error;
+
+		ThreadedRead(const std::shared_ptr<ThreadedSocket>& ts, std::unique_ptr<char[]> buf, size_t len, int err)
+			: tsock(ts)
+			, data(std::move(buf))
+			, length(len)
+			, error(err)
+		{
+		}
+	};
+
+	/** Wakes up the main thread when an I/O thread has read data.
+	 */
+	class IOThreadNotifier : public EventHandler
+	{
+	 public:
+		/** Whether any I/O thread has read data since the last time they were checked. */
+		bool pending;
+
+		IOThreadNotifier()
+			: pending(false)
+		{
+			SetFd(eventfd(0, EFD_NONBLOCK));
+			if (fd < 0)
+				throw CoreException("Unable to create eventfd for the I/O threads: " + std::string(strerror(errno)));
+			SocketEngine::AddFd(this, FD_WANT_FAST_READ | FD_WANT_NO_WRITE);
+		}
+
+		void Notify()
+		{
+			eventfd_write(fd, 1);
+		}
+
+		void OnEventHandlerRead() override
+		{
+			eventfd_t dummy;
+			eventfd_read(fd, &dummy);
+			pending = true;
+		}
+	};
+
+	IOThreadNotifier* Notifier = NULL;
+
+	/** A thread which reads from a partition of the sockets of the server using its own epoll instance.
+	 */
+	class IOThread final : public Thread
+	{
+		/** Handle of the epoll instance of this thread. */
+		int epollfd;
+
+		/** Used to wake this thread up when it should exit. */
+		int wakefd;
+
+		/** The size of the buffers data is read into. */
+		const size_t bufsize;
+
+		/** Buffer that data is read into. A mostly full buffer is handed to the main thread as it
+		 * is and replaced, smaller reads are copied out of it. Either way the main thread copies
+		 * the data into the receive queue of the socket.
+		 */
+		std::unique_ptr<char[]> buffer;
+
+	 public:
+		/** Guards sockets and ThreadedSocket::paused. Held by the thread while it reads from a socket so
+		 * a socket is never read from after it has been removed from the thread.
+		 */
+		Mutex sockmutex;
+
+		/** Sockets read from by this thread. */
+		std::unordered_map<ThreadedSocket*, std::shared_ptr<ThreadedSocket> > sockets;
+
+		/** Guards reads. */
+		Mutex readmutex;
+
+		/** Reads which are waiting to be processed on the main thread. */
+		std::vector<ThreadedRead> reads;
+
+		/** Maximum number of bytes read from a socket which may be waiting to be processed by the main thread. */
+		const size_t maxpending;
+
+		IOThread(size_t size)
+			: bufsize(size)
+			, buffer(new char[size])
+			, maxpending(size * 4)
+		{
+			epollfd = epoll_create(128);
+			wakefd = eventfd(0, EFD_NONBLOCK);
+			if (epollfd < 0 || wakefd < 0)
+				throw CoreException("Unable to create I/O thread: " + std::string(strerror(errno)));
+
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev);
+		}
+
+		~IOThread()
+		{
+			SocketEngine::Close(wakefd);
+			SocketEngine::Close(epollfd);
+		}
+
+		/** Ask the epoll instance of this thread for one read event on a socket.
+		 * @param tsock Socket to watch.
+		 * @param op Either EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+		 */
+		void Arm(ThreadedSocket* tsock, int op)
+		{
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = static_cast<void*>(tsock);
+			epoll_ctl(epollfd, op, tsock->fd, &ev);
+		}
+
+		/** Stop watching a socket.
+		 * @param tsock Socket to remove.
+		 */
+		void Disarm(ThreadedSocket* tsock)
+		{
+			struct epoll_event ev;
+			epoll_ctl(epollfd, EPOLL_CTL_DEL, tsock->fd, &ev);
+		}
+
+		void SetExitFlag() override
+		{
+			Thread::SetExitFlag();
+			eventfd_write(wakefd, 1);
+		}
+
+		/** Read as much data as possible from a socket without exceeding the pending data limit.
+		 * The caller must hold sockmutex.
+		 * @param tsock Socket to read from.
+		 * @param out Reads are appended to this list.
+		 */
+		void ReadSocket(const std::shared_ptr<ThreadedSocket>& tsock, std::vector<ThreadedRead>& out)
+		{
+			while (true)
+			{
+				const ssize_t n = recv(tsock->fd, buffer.get(), bufsize, 0);
+				if (n > 0)
+				{
+					// Every queued read keeps its buffer until the main thread is done with it so
+					// copying small reads keeps the memory used by them in proportion to the data.
+					std::unique_ptr<char[]> data;
+					if (static_cast<size_t>(n) < bufsize / 4)
+					{
+						data.reset(new char[n]);
+						memcpy(data.get(), buffer.get(), n);
+					}
+					else
+					{
+						data = std::move(buffer);
+						buffer.reset(new char[bufsize]);
+					}
+					out.push_back(ThreadedRead(tsock, std::move(data), n, 0));
+					if (tsock->pending.fetch_add(n) + n >= maxpending)
+					{
+						// The main thread will ask for more data once it has caught up.
+						tsock->paused = true;
+						return;
+					}
+
+					if (static_cast<size_t>(n) < bufsize)
+						break;
+				}
+				else if (n == 0)
+				{
+					out.push_back(ThreadedRead(tsock, NULL, 0, 0));
+					return;
+				}
+				else if (SocketEngine::IgnoreError())
+				{
+					break;
+				}
+				else if (errno != EINTR)
+				{
+					out.push_back(ThreadedRead(tsock, NULL, 0, errno));
+					return;
+				}
+			}
+
+			Arm(tsock.get(), EPOLL_CTL_MOD);
+		}
+
+		void Run() override
+		{
+			std::vector<struct epoll_event> threadevents(128);
+			std::vector<ThreadedRead> newreads;
+			while (!GetExitFlag())
+			{
+				const int count = epoll_wait(epollfd, &threadevents[0], threadevents.size(), 1000);
+				for (int i = 0; i < count; i++)
+				{
+					ThreadedSocket* const ptr = static_cast<ThreadedSocket*>(threadevents[i].data.ptr);
+					if (!ptr)
+					{
+						eventfd_t dummy;
+						eventfd_read(wakefd, &dummy);
+						continue;
+					}
+
+					sockmutex.Lock();
+					// The socket may have been removed since epoll_wait() returned
+					std::unordered_map<ThreadedSocket*, std::shared_ptr<ThreadedSocket> >::const_iterator it = sockets.find(ptr);
+					if (it != sockets.end())
+						ReadSocket(it->second, newreads);
+					sockmutex.Unlock();
+				}
+
+				if (!newreads.empty())
+				{
+					readmutex.Lock();
+					std::move(newreads.begin(), newreads.end(), std::back_inserter(reads));
+					readmutex.Unlock();
+					newreads.clear();
+					Notifier->Notify();
+				}
+			}
+		}
+	};
+
+	/** The I/O threads, empty if they are disabled or have not been started yet. */
+	std::vector<IOThread*> IOThreads;
+
+	/** Sockets read from by an I/O thread, indexed by file descriptor. Only used on the main thread. */
+	std::vector<std::shared_ptr<ThreadedSocket> > ThreadedSockets;
+
+	/** Remove a socket from its I/O thread, if it has one.
+	 * @param eh The socket to remove.
+	 */
+	void DetachFromIOThread(EventHandler* eh)
+	{
+		const int fd = eh->GetFd();
+		if (static_cast<size_t>(fd) >= ThreadedSockets.size() || !ThreadedSockets[fd])
+			return;
+
+		std::shared_ptr<ThreadedSocket> tsock;
+		tsock.swap(ThreadedSockets[fd]);
+
+		IOThread* const thread = tsock->thread;
+		thread->sockmutex.Lock();
+		thread->sockets.erase(tsock.get());
+		thread->Disarm(tsock.get());
+		thread->sockmutex.Unlock();
+
+		// Reads which are already queued for this socket will be discarded
+		tsock->detached = true;
+	}
+
+	/** Start the I/O threads if they are enabled in the config.
+	 */
+	void StartIOThreads()
+	{
+		if (!IOThreads.empty() || !ServerInstance->Config->IOThreads)
+			return;
+
+		if (!Notifier)
+			Notifier = new IOThreadNotifier;
+
+		for (unsigned int i = 0; i < ServerInstance->Config->IOThreads; ++i)
+		{
+			IOThread* thread = new IOThread(ServerInstance->Config->NetBufferSize);
+			ServerInstance->Threads.Start(thread);
+			IOThreads.push_back(thread);
+		}
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Started %lu I/O threads", (unsigned long)IOThreads.size());
+	}
+
+	/** Stop and destroy the I/O threads.
+	 */
+	void StopIOThreads()
+	{
+		for (std::vector<IOThread*>::const_iterator i = IOThreads.begin(); i != IOThreads.end(); ++i)
+		{
+			IOThread* thread = *i;
+			ServerInstance->Threads.Stop(thread);
+			delete thread;
+		}
+		IOThreads.clear();
+		ThreadedSockets.clear();
+
+		if (Notifier)
+		{
+			SocketEngine::Close(Notifier);
+			delete Notifier;
+			Notifier = NULL;
+		}
+	}
 }
 
 void SocketEngine::Init()
@@ -51,6 +416,7 @@ void SocketEngine::RecoverFromFork()
 
 void SocketEngine::Deinit()
 {
+	StopIOThreads();
 	Close(EngineHandle);
 }
 
@@ -103,7 +469,12 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 		return false;
 	}
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	if (static_cast<size_t>(fd) >= fdstates.size())
+		fdstates.resize(fd + 1);
+	fdstates[fd].events = ev.events;
+	fdstates[fd].dirty = false;
 
 	eh->SetEventMask(event_mask);
 	ResizeDouble(events);
@@ -113,16 +484,20 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 
 void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 {
-	unsigned old_events = mask_to_epoll(old_mask);
-	unsigned new_events = mask_to_epoll(new_mask);
-	if (old_events != new_events)
+	if (mask_to_epoll(old_mask) == mask_to_epoll(new_mask))
+		return;
+
+	const int fd = eh->GetFd();
+	if ((fd < 0) || (static_cast<size_t>(fd) >= fdstates.size()))
+		return;
+
+	// Tell the kernel about the new mask right before the next epoll_wait()
+	stats.MaskChanges++;
+	FdState& state = fdstates[fd];
+	if (!state.dirty)
 	{
-		// ok, we actually have something to tell the kernel about
-		struct epoll_event ev;
-		memset(&ev, 0, sizeof(ev));
-		ev.events = new_events;
-		ev.data.ptr = static_cast<void*>(eh);
-		epoll_ctl(EngineHandle, EPOLL_CTL_MOD, eh->GetFd(), &ev);
+		state.dirty = true;
+		DirtyFds.push_back(fd);
 	}
 }
 
@@ -135,6 +510,8 @@ void SocketEngine::DelFd(EventHandler* eh)
 		return;
 	}
 
+	DetachFromIOThread(eh);
+
 	// Do not initialize epoll_event because for EPOLL_CTL_DEL operations the event is ignored and can be NULL.
 	// In kernel versions before 2.6.9, the EPOLL_CTL_DEL operation required a non-NULL pointer in event,
 	// even though this argument is ignored. Since Linux 2.6.9, event can be specified as NULL when using EPOLL_CTL_DEL.
@@ -147,13 +524,43 @@ void SocketEngine::DelFd(EventHandler* eh)
 	}
 
 	SocketEngine::DelFdRef(eh);
+	if (static_cast<size_t>(fd) < fdstates.size())
+		fdstates[fd].dirty = false;
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
 }
 
 int SocketEngine::DispatchEvents()
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	for (std::vector<int>::const_iterator it = DirtyFds.begin(); it != DirtyFds.end(); ++it)
+	{
+		// The fd may have been removed, or removed and reused, since it was marked dirty
+		const int fd = *it;
+		FdState& state = fdstates[fd];
+		if (!state.dirty)
+			continue;
+
+		state.dirty = false;
+		EventHandler* const eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		// Nothing to do if the mask is back to what the kernel already has
+		const unsigned new_events = mask_to_epoll(eh->GetEventMask());
+		if (new_events == state.events)
+			continue;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = new_events;
+		ev.data.ptr = static_cast<void*>(eh);
+		epoll_ctl(EngineHandle, EPOLL_CTL_MOD, fd, &ev);
+		state.events = new_events;
+		stats.MaskUpdates++;
+	}
+	DirtyFds.clear();
+
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), ServerInstance->Timers.GetTimeout(1000));
 	ServerInstance->UpdateTime();
 
 	stats.TotalEvents += i;
@@ -214,5 +621,80 @@ int SocketEngine::DispatchEvents()
 		}
 	}
 
+	if (Notifier && Notifier->pending)
+	{
+		Notifier->pending = false;
+		DispatchThreadedReads();
+	}
+
 	return i;
 }
+
+bool SocketEngine::DelegateRead(StreamSocket* sock)
+{
+	const int fd = sock->GetFd();
+	if (GetRef(fd) != sock)
+		return false;
+
+	StartIOThreads();
+	if (IOThreads.empty())
+		return false;
+
+	if (static_cast<size_t>(fd) >= ThreadedSockets.size())
+		ThreadedSockets.resize(fd + 1);
+	else if (ThreadedSockets[fd])
+		return true;
+
+	// Stop reading on this thread; a pending trial read would race with the I/O thread
+	sock->event_mask &= ~FD_ADD_TRIAL_READ;
+	ChangeEventMask(sock, FD_WANT_NO_READ);
+
+	IOThread* const thread = IOThreads[fd % IOThreads.size()];
+	std::shared_ptr<ThreadedSocket> tsock = std::make_shared<ThreadedSocket>(sock, thread);
+	ThreadedSockets[fd] = tsock;
+
+	thread->sockmutex.Lock();
+	thread->sockets[tsock.get()] = tsock;
+	thread->Arm(tsock.get(), EPOLL_CTL_ADD);
+	thread->sockmutex.Unlock();
+	return true;
+}
+
+void SocketEngine::DispatchThreadedReads()
+{
+	std::vector<ThreadedRead> reads;
+	for (std::vector<IOThread*>::const_iterator i = IOThreads.begin(); i != IOThreads.end(); ++i)
+	{
+		IOThread* const thread = *i;
+		thread->readmutex.Lock();
+		reads.swap(thread->reads);
+		thread->readmutex.Unlock();
+
+		for (std::vector<ThreadedRead>::const_iterator j = reads.begin(); j != reads.end(); ++j)
+		{
+			const ThreadedRead& read = *j;
+			ThreadedSocket* const tsock = read.tsock.get();
+			if (tsock->detached)
+				continue;
+
+			stats.UpdateReadCounters(read.error ? -1 : read.length);
+
+			const size_t len = read.length;
+			const size_t oldpending = tsock->pending.fetch_sub(len);
+			if (oldpending >= thread->maxpending && oldpending - len < thread->maxpending)
+			{
+				// The I/O thread may have stopped reading because we fell behind
+				thread->sockmutex.Lock();
+				if (tsock->paused)
+				{
+					tsock->paused = false;
+					thread->Arm(tsock, EPOLL_CTL_MOD);
+				}
+				thread->sockmutex.Unlock();
+			}
+
+			tsock->sock->OnThreadedRead(read.data.get(), read.length, read.error);
+		}
+		reads.clear();
+	}
+}
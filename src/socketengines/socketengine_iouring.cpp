@@ -0,0 +1,634 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/** A specialisation of the SocketEngine class, designed to use Linux io_uring.
+ *
+ * Sockets are watched using one-shot poll requests. Requests to start and stop
+ * watching sockets are only queued in the submission ring when the event mask
+ * of a socket changes and are submitted to the kernel together with waiting for
+ * new events, so each call to DispatchEvents() only makes a single system call
+ * no matter how many sockets changed their event mask.
+ *
+ * Sockets which are handed over with DelegateRead() are not polled for reading.
+ * Instead, a recv request is always outstanding for them and the data it reads
+ * is passed to StreamSocket::OnThreadedRead(). The kernel picks the buffer each
+ * recv request reads into from a shared pool of provided buffers, so sockets do
+ * not need a buffer of their own while they are idle.
+ */
+namespace
+{
+	/** Set in the user data of requests whose completions should be ignored. */
+	const uint64_t IGNORE_COMPLETION = 1ULL << 63;
+
+	/** Set in the user data of recv requests. */
+	const uint64_t RECV_REQUEST = 1ULL << 62;
+
+	/** The number of buffers in the pool recv requests read into. */
+	const unsigned int RECV_BUFFERS = 512;
+
+	/** The buffer group of the pool recv requests read into. */
+	const uint16_t RECV_BUFFER_GROUP = 0;
+
+	/** Per file descriptor state. */
+	struct FdState
+	{
+		/** The events the outstanding poll request is waiting for or 0 if there is no outstanding request. */
+		unsigned int armed;
+
+		/** Changed whenever the outstanding poll request of the fd is cancelled to allow
+		 * recognizing the completions of cancelled requests.
+		 */
+		uint32_t generation;
+
+		/** The socket if it is read from with recv requests or NULL if it is polled for reading. */
+		StreamSocket* recvsock;
+
+		/** Whether a recv request is outstanding. */
+		bool recving;
+
+		/** Like generation but for the recv requests of the fd. */
+		uint32_t recvgeneration;
+
+		FdState()
+			: armed(0)
+			, generation(0)
+			, recvsock(NULL)
+			, recving(false)
+			, recvgeneration(0)
+		{
+		}
+	};
+
+	/** Handle of the io_uring instance. */
+	int EngineHandle = -1;
+
+	/** The parameters the io_uring instance was created with. */
+	struct io_uring_params params;
+
+	/** Mapping of the submission and completion rings. */
+	void* RingMap = MAP_FAILED;
+	size_t RingMapSize;
+
+	/** Mapping of the submission queue entries. */
+	struct io_uring_sqe* SQEs = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+	size_t SQEsSize;
+
+	/** Pointers to the fields of the submission ring. */
+	unsigned int* SQHead;
+	unsigned int* SQTail;
+	unsigned int SQMask;
+
+	/** Pointers to the fields of the completion ring. */
+	unsigned int* CQHead;
+	unsigned int* CQTail;
+	unsigned int CQMask;
+	struct io_uring_cqe* CQEs;
+
+	/** Poll state of file descriptors, indexed by fd. */
+	std::vector<FdState> fdstates;
+
+	/** Completions copied out of the completion ring by DispatchEvents(). */
+	std::vector<struct io_uring_cqe> completions;
+
+	/** The pool of buffers which recv requests read into. */
+	std::vector<char> recvbuffers;
+
+	/** The size of each buffer in the pool. */
+	size_t recvbuffersize;
+
+	template <typename T>
+	T* RingField(unsigned int offset)
+	{
+		return reinterpret_cast<T*>(static_cast<char*>(RingMap) + offset);
+	}
+
+	int Setup(unsigned int entries, struct io_uring_params* p)
+	{
+		return syscall(__NR_io_uring_setup, entries, p);
+	}
+
+	int Enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsize)
+	{
+		return syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, arg, argsize);
+	}
+
+	/** Get the number of queued entries which have not been consumed by the kernel yet. */
+	unsigned int GetUnsubmitted()
+	{
+		return *SQTail - __atomic_load_n(SQHead, __ATOMIC_ACQUIRE);
+	}
+
+	/** The number of times the submission ring was full and had to be submitted early. */
+	unsigned long EarlySubmits = 0;
+
+	/** Get a free submission queue entry, submitting the queued ones if the ring is full.
+	 * The returned entry is cleared and will be submitted along with the others the next time
+	 * the kernel is entered.
+	 */
+	struct io_uring_sqe* GetSQE()
+	{
+		while (GetUnsubmitted() >= params.sq_entries)
+		{
+			EarlySubmits++;
+			if (Enter(GetUnsubmitted(), 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				break;
+		}
+
+		const unsigned int tail = *SQTail;
+		struct io_uring_sqe* sqe = &SQEs[tail & SQMask];
+		memset(sqe, 0, sizeof(*sqe));
+		__atomic_store_n(SQTail, tail + 1, __ATOMIC_RELEASE);
+		return sqe;
+	}
+
+	uint64_t MakeUserData(int fd, uint32_t generation)
+	{
+		return static_cast<uint32_t>(fd) | (static_cast<uint64_t>(generation & 0x3FFFFFFF) << 32);
+	}
+
+	uint64_t MakeUserData(int fd, const FdState& state)
+	{
+		return MakeUserData(fd, state.generation);
+	}
+
+	uint64_t MakeRecvUserData(int fd, const FdState& state)
+	{
+		return MakeUserData(fd, state.recvgeneration) | RECV_REQUEST;
+	}
+
+	/** Queue a poll request for a file descriptor.
+	 * @param fd File descriptor to watch.
+	 * @param events Events to wait for, must not be 0.
+	 */
+	void Arm(int fd, unsigned int events)
+	{
+		FdState& state = fdstates[fd];
+		struct io_uring_sqe* sqe = GetSQE();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		sqe->poll32_events = (events << 16) | (events >> 16);
+#else
+		sqe->poll32_events = events;
+#endif
+		sqe->user_data = MakeUserData(fd, state);
+		state.armed = events;
+	}
+
+	/** Queue the cancellation of the outstanding poll request of a file descriptor, if any.
+	 * @param fd File descriptor to stop watching.
+	 */
+	void Disarm(int fd)
+	{
+		FdState& state = fdstates[fd];
+		if (state.armed)
+		{
+			struct io_uring_sqe* sqe = GetSQE();
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = MakeUserData(fd, state);
+			sqe->user_data = IGNORE_COMPLETION;
+			state.armed = 0;
+		}
+
+		// Completions of the old request must not be mistaken for the results of a new one
+		state.generation++;
+	}
+
+	/** Get the events a file descriptor should be polled for.
+	 * @param fd File descriptor to get the events for.
+	 * @param mask Event mask of the event handler of the fd.
+	 */
+	unsigned int GetPollEvents(int fd, int mask)
+	{
+		unsigned int events = 0;
+		if ((mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ)) && !fdstates[fd].recvsock)
+			events |= POLLIN;
+		if (mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+			events |= POLLOUT;
+		return events;
+	}
+
+	/** Give buffers to the pool recv requests read into.
+	 * @param bid The id of the first buffer.
+	 * @param count The number of buffers.
+	 */
+	void ProvideBuffers(unsigned int bid, unsigned int count)
+	{
+		struct io_uring_sqe* sqe = GetSQE();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = count;
+		sqe->addr = reinterpret_cast<uintptr_t>(&recvbuffers[bid * recvbuffersize]);
+		sqe->len = recvbuffersize;
+		sqe->off = bid;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		sqe->user_data = IGNORE_COMPLETION;
+	}
+
+	/** Queue a recv request for a socket which is read from with recv requests.
+	 * @param fd File descriptor to read from.
+	 */
+	void QueueRecv(int fd)
+	{
+		FdState& state = fdstates[fd];
+		struct io_uring_sqe* sqe = GetSQE();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->len = recvbuffersize;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		sqe->user_data = MakeRecvUserData(fd, state);
+		state.recving = true;
+	}
+
+	/** Stop reading from a file descriptor with recv requests.
+	 * @param fd File descriptor to stop reading from.
+	 */
+	void StopRecv(int fd)
+	{
+		FdState& state = fdstates[fd];
+		if (state.recving)
+		{
+			struct io_uring_sqe* sqe = GetSQE();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = MakeRecvUserData(fd, state);
+			sqe->user_data = IGNORE_COMPLETION;
+			state.recving = false;
+		}
+
+		state.recvsock = NULL;
+		state.recvgeneration++;
+	}
+
+	void DestroyRing()
+	{
+		if (SQEs != MAP_FAILED)
+			munmap(SQEs, SQEsSize);
+		if (RingMap != MAP_FAILED)
+			munmap(RingMap, RingMapSize);
+		if (EngineHandle >= 0)
+			SocketEngine::Close(EngineHandle);
+
+		SQEs = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+		RingMap = MAP_FAILED;
+		EngineHandle = -1;
+	}
+
+	bool CreateRing()
+	{
+		memset(&params, 0, sizeof(params));
+		EngineHandle = Setup(4096, &params);
+		if (EngineHandle < 0)
+			return false;
+
+		// Waiting for completions with a timeout requires IORING_ENTER_EXT_ARG (Linux 5.11)
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+		{
+			errno = ENOSYS;
+			return false;
+		}
+
+		RingMapSize = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+			params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+		RingMap = mmap(NULL, RingMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+		if (RingMap == MAP_FAILED)
+			return false;
+
+		SQEsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		SQEs = static_cast<struct io_uring_sqe*>(mmap(NULL, SQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES));
+		if (SQEs == MAP_FAILED)
+			return false;
+
+		SQHead = RingField<unsigned int>(params.sq_off.head);
+		SQTail = RingField<unsigned int>(params.sq_off.tail);
+		SQMask = *RingField<unsigned int>(params.sq_off.ring_mask);
+
+		// Submission queue entries are always used in order
+		unsigned int* const array = RingField<unsigned int>(params.sq_off.array);
+		for (unsigned int i = 0; i < params.sq_entries; ++i)
+			array[i] = i;
+
+		CQHead = RingField<unsigned int>(params.cq_off.head);
+		CQTail = RingField<unsigned int>(params.cq_off.tail);
+		CQMask = *RingField<unsigned int>(params.cq_off.ring_mask);
+		CQEs = RingField<struct io_uring_cqe>(params.cq_off.cqes);
+
+		// Completions must not be dropped as the buffers recv requests read into are only given
+		// back to the pool once their completion has been seen.
+		if (!(params.features & IORING_FEAT_NODROP))
+		{
+			errno = ENOSYS;
+			return false;
+		}
+		return true;
+	}
+}
+
+void SocketEngine::Init()
+{
+	LookupMaxFds();
+	RecoverFromFork();
+}
+
+void SocketEngine::RecoverFromFork()
+{
+	// The rings are shared with the parent process, create our own
+	DestroyRing();
+	if (!CreateRing())
+		InitError();
+
+	if (!recvbuffers.empty())
+		ProvideBuffers(0, RECV_BUFFERS);
+
+	// Watch the file descriptors which were added before the fork again
+	for (size_t fd = 0; fd < fdstates.size(); ++fd)
+	{
+		FdState& state = fdstates[fd];
+		if (state.recving)
+		{
+			state.recvgeneration++;
+			QueueRecv(fd);
+		}
+
+		if (!state.armed)
+			continue;
+
+		state.generation++;
+		Arm(fd, state.armed);
+	}
+}
+
+void SocketEngine::Deinit()
+{
+	DestroyRing();
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d)", fd);
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	if (static_cast<size_t>(fd) >= fdstates.size())
+		fdstates.resize(fd + 1);
+
+	const unsigned int events = GetPollEvents(fd, event_mask);
+	if (events)
+		Arm(fd, events);
+
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	eh->SetEventMask(event_mask);
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	const int fd = eh->GetFd();
+	if (fd < 0 || static_cast<size_t>(fd) >= fdstates.size())
+		return;
+
+	const unsigned int events = GetPollEvents(fd, new_mask);
+	if (fdstates[fd].armed == events)
+		return;
+
+	// The new requests are submitted along with everything else right before waiting for events
+	// so no system call is made for them unless the submission ring is full.
+	stats.MaskChanges++;
+	Disarm(fd);
+	if (events)
+		Arm(fd, events);
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d)", fd);
+		return;
+	}
+
+	if (static_cast<size_t>(fd) < fdstates.size())
+	{
+		Disarm(fd);
+		StopRecv(fd);
+	}
+
+	SocketEngine::DelFdRef(eh);
+
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents()
+{
+	const int wait = ServerInstance->Timers.GetTimeout(1000);
+	struct __kernel_timespec timeout;
+	timeout.tv_sec = wait / 1000;
+	timeout.tv_nsec = (wait % 1000) * 1000000L;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uintptr_t>(&timeout);
+
+	// Submit all queued changes and wait for events in one go
+	Enter(GetUnsubmitted(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	ServerInstance->UpdateTime();
+
+	stats.MaskUpdates += EarlySubmits;
+	EarlySubmits = 0;
+
+	// Copy the completions out of the ring first so that it has room for new ones while we dispatch
+	const unsigned int head = *CQHead;
+	const unsigned int tail = __atomic_load_n(CQTail, __ATOMIC_ACQUIRE);
+	completions.clear();
+	for (unsigned int i = head; i != tail; ++i)
+		completions.push_back(CQEs[i & CQMask]);
+	__atomic_store_n(CQHead, tail, __ATOMIC_RELEASE);
+
+	int processed = 0;
+	for (std::vector<struct io_uring_cqe>::const_iterator i = completions.begin(); i != completions.end(); ++i)
+	{
+		const struct io_uring_cqe& cqe = *i;
+		if (cqe.user_data & IGNORE_COMPLETION)
+			continue;
+
+		if (cqe.user_data & RECV_REQUEST)
+		{
+			const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+			const bool hasbuffer = (cqe.flags & IORING_CQE_F_BUFFER);
+			const unsigned int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+			// The request might belong to a socket which has been removed since it was submitted
+			FdState& state = fdstates[fd];
+			if (!state.recving || cqe.user_data != MakeRecvUserData(fd, state))
+			{
+				if (hasbuffer)
+					ProvideBuffers(bid, 1);
+				continue;
+			}
+
+			state.recving = false;
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN || cqe.res == -ENOBUFS)
+			{
+				// Nothing was read this time, try again. If the pool ran out of buffers
+				// then it has some again by the time the new request is submitted.
+				QueueRecv(fd);
+				continue;
+			}
+
+			processed++;
+			StreamSocket* const sock = state.recvsock;
+			stats.UpdateReadCounters(cqe.res < 0 ? -1 : cqe.res);
+			if (cqe.res > 0)
+				sock->OnThreadedRead(&recvbuffers[bid * recvbuffersize], cqe.res, 0);
+			else
+				sock->OnThreadedRead(NULL, 0, -cqe.res);
+
+			if (hasbuffer)
+				ProvideBuffers(bid, 1);
+
+			// Keep reading unless the socket was removed or has failed
+			// The handler may have added fds so fdstates must not be cached across the call above
+			if (cqe.res > 0 && fdstates[fd].recvsock == sock && sock->getError().empty())
+				QueueRecv(fd);
+			continue;
+		}
+
+		const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+		EventHandler* const eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		if (cqe.user_data != MakeUserData(fd, fdstates[fd]))
+			continue; // Result of a cancelled request
+
+		// The one-shot request is done
+		fdstates[fd].armed = 0;
+		if (cqe.res < 0)
+		{
+			stats.ErrorEvents++;
+			const int errcode = -cqe.res;
+			if (errcode == EINTR || errcode == EAGAIN || errcode == ENOMEM)
+			{
+				// The poll could not be started this time, try again with the current mask
+				const unsigned int events = GetPollEvents(fd, eh->GetEventMask());
+				if (events)
+					Arm(fd, events);
+			}
+			else
+			{
+				// The fd can not be polled, let the handler close it
+				eh->OnEventHandlerError(errcode);
+			}
+			continue;
+		}
+
+		processed++;
+		const unsigned int revents = cqe.res;
+		if (revents & POLLHUP)
+		{
+			stats.ErrorEvents++;
+			eh->OnEventHandlerError(0);
+			continue;
+		}
+
+		if (revents & POLLERR)
+		{
+			stats.ErrorEvents++;
+			// Get error number
+			socklen_t codesize = sizeof(int);
+			int errcode;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->OnEventHandlerError(errcode);
+			continue;
+		}
+
+		if (revents & POLLIN)
+		{
+			eh->SetEventMask(eh->GetEventMask() & ~FD_READ_WILL_BLOCK);
+			eh->OnEventHandlerRead();
+			if (eh != GetRef(fd))
+				// whoops, deleted out from under us
+				continue;
+		}
+
+		if (revents & POLLOUT)
+		{
+			int mask = eh->GetEventMask();
+			mask &= ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE);
+			eh->SetEventMask(mask);
+			eh->OnEventHandlerWrite();
+			if (eh != GetRef(fd))
+				continue;
+		}
+
+		// Keep watching the fd unless the handler already asked for something else
+		// The handlers may have added fds so fdstates must not be cached across the calls above
+		const unsigned int events = GetPollEvents(fd, eh->GetEventMask());
+		if (!fdstates[fd].armed && events)
+			Arm(fd, events);
+	}
+
+	stats.TotalEvents += processed;
+	return processed;
+}
+
+bool SocketEngine::DelegateRead(StreamSocket* sock)
+{
+	const int fd = sock->GetFd();
+	if (fd < 0 || GetRef(fd) != sock)
+		return false;
+
+	FdState& state = fdstates[fd];
+	if (state.recvsock)
+		return true;
+
+	if (recvbuffers.empty())
+	{
+		// The size of the buffers can only be changed by restarting
+		recvbuffersize = ServerInstance->Config->NetBufferSize;
+		recvbuffers.resize(RECV_BUFFERS * recvbuffersize);
+		ProvideBuffers(0, RECV_BUFFERS);
+	}
+
+	// Stop polling for reads, the socket is read from with recv requests from now on
+	state.recvsock = sock;
+	sock->event_mask &= ~FD_ADD_TRIAL_READ;
+	ChangeEventMask(sock, FD_WANT_NO_READ);
+	QueueRecv(fd);
+	return true;
+}
@@ -89,7 +89,7 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 	struct kevent* ke = GetChangeKE();
 	EV_SET(ke, fd, EVFILT_READ, EV_ADD, 0, 0, static_cast<void*>(eh));
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
 
 	eh->SetEventMask(event_mask);
 	OnSetEvent(eh, 0, event_mask);
@@ -119,7 +119,7 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 	SocketEngine::DelFdRef(eh);
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
 }
 
 void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
@@ -145,9 +145,10 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SocketEngine::DispatchEvents()
 {
+	const int timeout = ServerInstance->Timers.GetTimeout(1000);
 	struct timespec ts;
-	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
 
 	int i = kevent(EngineHandle, &changelist.front(), ChangePos, &ke_list.front(), ke_list.size(), &ts);
 	ChangePos = 0;
@@ -196,3 +197,9 @@ int SocketEngine::DispatchEvents()
 
 	return i;
 }
+
+bool SocketEngine::DelegateRead(StreamSocket* sock)
+{
+	// This socket engine does not support I/O threads.
+	return false;
+}
@@ -92,7 +92,7 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 	events[index].fd = fd;
 	events[index].events = mask_to_poll(event_mask);
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d (%d; index %d)", fd, events[index].events, index);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "New file descriptor: %d (%d; index %d)", fd, events[index].events, index);
 	eh->SetEventMask(event_mask);
 	return true;
 }
@@ -148,13 +148,13 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 	SocketEngine::DelFdRef(eh);
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d (index: %d) "
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Remove file descriptor: %d (index: %d) "
 			"(Filled gap with: %d (index: %d))", fd, index, last_fd, last_index);
 }
 
 int SocketEngine::DispatchEvents()
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, ServerInstance->Timers.GetTimeout(1000));
 	int processed = 0;
 	ServerInstance->UpdateTime();
 
@@ -213,3 +213,9 @@ int SocketEngine::DispatchEvents()
 
 	return i;
 }
+
+bool SocketEngine::DelegateRead(StreamSocket* sock)
+{
+	// This socket engine does not support I/O threads.
+	return false;
+}
@@ -69,7 +69,7 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 	if (fd > MaxFD)
 		MaxFD = fd;
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
 	return true;
 }
 
@@ -91,7 +91,7 @@ void SocketEngine::DelFd(EventHandler* eh)
 	if (fd == MaxFD)
 		--MaxFD;
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+	LOG_IF_ENABLED("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
 }
 
 void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
@@ -117,9 +117,10 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SocketEngine::DispatchEvents()
 {
+	const int timeout = ServerInstance->Timers.GetTimeout(1000);
 	timeval tval;
-	tval.tv_sec = 1;
-	tval.tv_usec = 0;
+	tval.tv_sec = timeout / 1000;
+	tval.tv_usec = (timeout % 1000) * 1000;
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
@@ -171,3 +172,9 @@ int SocketEngine::DispatchEvents()
 
 	return sresult;
 }
+
+bool SocketEngine::DelegateRead(StreamSocket* sock)
+{
+	// This socket engine does not support I/O threads.
+	return false;
+}
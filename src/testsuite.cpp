@@ -23,7 +23,12 @@
 
 #include "inspircd.h"
 #include "testsuite.h"
+#include "editdistance.h"
+#include "linescan.h"
+#include <chrono>
 #include <iostream>
+#include <random>
+#include <thread>
 
 class TestSuiteThread : public Thread
 {
@@ -63,6 +68,11 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Line scanner tests and benchmark\n";
+		std::cout << "(A) Compiled wildcard mask tests and benchmark\n";
+		std::cout << "(B) Timer wheel tests and benchmark\n";
+		std::cout << "(C) Log level tests and benchmark\n";
+		std::cout << "(D) Edit distance tests and benchmark\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -110,6 +120,21 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoLineScanTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoWildcardMaskTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoTimerTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'C':
+				std::cout << (DoLogLevelTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'D':
+				std::cout << (DoEditDistanceTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -394,6 +419,675 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+/** Splits client traffic into lines and cleans them up one byte at a time like the line reader used to.
+ * @return The number of bytes in the cleaned lines.
+ */
+static size_t ReadLinesBytewise(const std::string& traffic)
+{
+	size_t total = 0;
+	std::string line;
+	for (std::string::const_iterator i = traffic.begin(); i != traffic.end(); ++i)
+	{
+		switch (*i)
+		{
+			case '\n':
+				total += line.length();
+				line.clear();
+				break;
+			case '\r':
+				break;
+			case '\0':
+				line.push_back(' ');
+				break;
+			default:
+				line.push_back(*i);
+				break;
+		}
+	}
+	return total;
+}
+
+/** Splits client traffic into lines and cleans them up using a line scanner.
+ * @return The number of bytes in the cleaned lines.
+ */
+static size_t ReadLinesWith(const LineScan::Implementation& impl, const std::string& traffic)
+{
+	size_t total = 0;
+	std::string line;
+	const char* const end = traffic.data() + traffic.length();
+	for (const char* pos = traffic.data(); pos != end; )
+	{
+		const char* const eol = impl.find(pos, end, '\n', '\n', '\n', '\n');
+		if (eol == end)
+			break;
+
+		for (const char* run = pos; ; ++run)
+		{
+			const char* const special = impl.find(run, eol, '\r', '\0', '\0', '\0');
+			line.append(run, special);
+			if (special == eol)
+				break;
+			if (*special == '\0')
+				line.push_back(' ');
+			run = special;
+		}
+		total += line.length();
+		line.clear();
+		pos = eol + 1;
+	}
+	return total;
+}
+
+bool TestSuite::DoLineScanTests()
+{
+	std::cout << "\n\nLine scanner tests\n\n";
+
+	const std::vector<LineScan::Implementation>& impls = LineScan::GetSupported();
+	std::cout << "Selected implementation: " << LineScan::GetBest().name << std::endl;
+
+	// Every implementation must agree with the scalar one regardless of length and alignment.
+	std::string buffer;
+	for (size_t i = 0; i < 200; ++i)
+		buffer.push_back(static_cast<char>('a' + (i % 26)));
+	const char delims[] = { '\0', '\r', '\n', ' ' };
+	for (size_t d = 0; d < sizeof(delims); ++d)
+	{
+		for (size_t at = 0; at < 100; ++at)
+		{
+			std::string haystack(buffer);
+			haystack[at + 50] = delims[d];
+			for (size_t start = 0; start < 40; ++start)
+			{
+				const char* const begin = haystack.data() + start;
+				const char* const end = haystack.data() + haystack.length() - (start / 2);
+				const char* const expected = impls[0].find(begin, end, delims[d], '\x01', '\x01', '\x01');
+				for (std::vector<LineScan::Implementation>::const_iterator i = impls.begin(); i != impls.end(); ++i)
+				{
+					if (i->find(begin, end, '\x01', delims[d], '\x02', '\x03') != expected)
+					{
+						std::cout << "LINESCAN: " << i->name << " disagrees with " << impls[0].name << " at offset " << (at + 50) << std::endl;
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	// Benchmark on a synthetic capture of typical client traffic.
+	static const char* const samples[] = {
+		"PRIVMSG #inspircd :has anyone tried the new release yet? upgrading the test network tonight\r\n",
+		"@+draft/reply=f3a9;+typing=done PRIVMSG #chat :sure, sounds good to me\r\n",
+		"PING :irc.example.net\r\n",
+		"MODE #chat +o somebody\r\n",
+		"WHO #chat %tcuhnfdar,743\r\n",
+		"PRIVMSG NickServ :IDENTIFY account hunter2\r\n",
+		"@+typing=active TAGMSG #chat\r\n",
+		"PRIVMSG #chat :\x01" "ACTION waves at everyone in the channel and then leaves for lunch\x01\r\n",
+	};
+	std::string traffic;
+	while (traffic.length() < 4 * 1024 * 1024)
+	{
+		for (size_t i = 0; i < sizeof(samples) / sizeof(*samples); ++i)
+			traffic.append(samples[i]);
+	}
+
+	const unsigned int rounds = 20;
+	const size_t total = traffic.length() * rounds;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	size_t expected = 0;
+	for (unsigned int round = 0; round < rounds; ++round)
+		expected = ReadLinesBytewise(traffic);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+	std::cout << "Line reading, bytewise: " << (total / elapsed.count() / (1024 * 1024)) << " MiB/s" << std::endl;
+
+	for (std::vector<LineScan::Implementation>::const_iterator i = impls.begin(); i != impls.end(); ++i)
+	{
+		size_t cleaned = 0;
+		started = std::chrono::steady_clock::now();
+		for (unsigned int round = 0; round < rounds; ++round)
+			cleaned = ReadLinesWith(*i, traffic);
+		elapsed = std::chrono::steady_clock::now() - started;
+		std::cout << "Line reading, " << i->name << ": " << (total / elapsed.count() / (1024 * 1024)) << " MiB/s" << std::endl;
+
+		if (cleaned != expected)
+		{
+			std::cout << "LINESCAN: " << i->name << " read " << cleaned << " bytes instead of " << expected << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool TestSuite::DoWildcardMaskTests()
+{
+	std::cout << "\n\nCompiled wildcard mask tests\n\n";
+
+	// Every mask built from a small alphabet must give the same result as InspIRCd::Match()
+	// for every string built from it.
+	const char alphabet[] = { 'a', 'B', '*', '?' };
+	std::vector<std::string> masks(1);
+	for (size_t length = 1; length <= 5; ++length)
+	{
+		const size_t first = masks.size();
+		for (size_t i = 0; i < first; ++i)
+		{
+			if (masks[i].length() != length - 1)
+				continue;
+			for (size_t c = 0; c < sizeof(alphabet); ++c)
+				masks.push_back(masks[i] + alphabet[c]);
+		}
+	}
+	std::vector<std::string> strings;
+	for (std::vector<std::string>::const_iterator i = masks.begin(); i != masks.end(); ++i)
+	{
+		if (i->find_first_of("*?") == std::string::npos)
+		{
+			strings.push_back(*i);
+			std::string upper(*i);
+			std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+			strings.push_back(upper);
+		}
+	}
+	for (std::vector<std::string>::const_iterator mask = masks.begin(); mask != masks.end(); ++mask)
+	{
+		const WildcardMask compiled(*mask, ascii_case_insensitive_map);
+		for (std::vector<std::string>::const_iterator str = strings.begin(); str != strings.end(); ++str)
+		{
+			if (compiled.Match(*str) != InspIRCd::Match(*str, *mask, ascii_case_insensitive_map))
+			{
+				std::cout << "WILDCARDMASK: \"" << *mask << "\" disagrees with match() for \"" << *str << "\"" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	if (!WildcardMask("*@1.2.0.0/16").MatchCIDR("brain@1.2.3.4") || WildcardMask("1.2.4.0/24").MatchCIDR("1.2.3.4"))
+	{
+		std::cout << "WILDCARDMASK: CIDR masks do not match like MatchCIDR()" << std::endl;
+		return false;
+	}
+
+	// Benchmark on a synthetic set of host bans, since none is recorded in the tree.
+	static const char* const domains[] = { "example.com", "example.net", "users.irc.example.org", "dynamic.isp.example", "cloud.example.io" };
+	const size_t domaincount = sizeof(domains) / sizeof(*domains);
+	std::vector<std::string> hostmasks;
+	for (size_t i = 0; hostmasks.size() < 10000; ++i)
+	{
+		const std::string id = ConvToStr(i);
+		switch (i % 4)
+		{
+			case 0:
+				hostmasks.push_back("*." + id + "." + domains[i % domaincount]);
+				break;
+			case 1:
+				hostmasks.push_back("host-" + id + ".*");
+				break;
+			case 2:
+				hostmasks.push_back("node" + id + "." + domains[i % domaincount]);
+				break;
+			default:
+				hostmasks.push_back("*-" + id + "-*." + domains[i % domaincount]);
+				break;
+		}
+	}
+	std::vector<std::string> hosts;
+	for (size_t i = 0; i < 1000; ++i)
+		hosts.push_back("client-" + ConvToStr(i * 7) + "-static." + ConvToStr(i * 4) + "." + domains[(i * 4) % domaincount]);
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	size_t expected = 0;
+	for (std::vector<std::string>::const_iterator host = hosts.begin(); host != hosts.end(); ++host)
+	{
+		for (std::vector<std::string>::const_iterator mask = hostmasks.begin(); mask != hostmasks.end(); ++mask)
+		{
+			if (InspIRCd::Match(*host, *mask, ascii_case_insensitive_map))
+				expected++;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+	std::cout << "Matching " << hosts.size() << " hosts against " << hostmasks.size() << " masks, match(): " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	std::vector<WildcardMask> compiled;
+	compiled.reserve(hostmasks.size());
+	for (std::vector<std::string>::const_iterator mask = hostmasks.begin(); mask != hostmasks.end(); ++mask)
+		compiled.push_back(WildcardMask(*mask, ascii_case_insensitive_map));
+
+	started = std::chrono::steady_clock::now();
+	size_t matched = 0;
+	for (std::vector<std::string>::const_iterator host = hosts.begin(); host != hosts.end(); ++host)
+	{
+		for (std::vector<WildcardMask>::const_iterator mask = compiled.begin(); mask != compiled.end(); ++mask)
+		{
+			if (mask->Match(*host))
+				matched++;
+		}
+	}
+	elapsed = std::chrono::steady_clock::now() - started;
+	std::cout << "Matching " << hosts.size() << " hosts against " << hostmasks.size() << " masks, WildcardMask: " << (elapsed.count() * 1000) << " ms" << std::endl;
+	if (matched != expected)
+	{
+		std::cout << "WILDCARDMASK: matched " << matched << " times instead of " << expected << std::endl;
+		return false;
+	}
+
+	WildcardIndex<size_t> index(ascii_case_insensitive_map);
+	for (size_t i = 0; i < compiled.size(); ++i)
+		index.Add(compiled[i], i);
+
+	started = std::chrono::steady_clock::now();
+	matched = 0;
+	std::vector<size_t> found;
+	for (std::vector<std::string>::const_iterator host = hosts.begin(); host != hosts.end(); ++host)
+	{
+		found.clear();
+		index.Find(*host, found);
+		matched += found.size();
+	}
+	elapsed = std::chrono::steady_clock::now() - started;
+	std::cout << "Matching " << hosts.size() << " hosts against " << hostmasks.size() << " masks, WildcardIndex: " << (elapsed.count() * 1000) << " ms" << std::endl;
+	if (matched != expected)
+	{
+		std::cout << "WILDCARDMASK: index matched " << matched << " times instead of " << expected << std::endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < compiled.size(); ++i)
+	{
+		if (!index.Remove(compiled[i], i))
+		{
+			std::cout << "WILDCARDMASK: failed to remove \"" << compiled[i].GetMask() << "\" from the index" << std::endl;
+			return false;
+		}
+	}
+
+	return index.empty();
+}
+
+namespace
+{
+	uint64_t GetTestMilliseconds()
+	{
+		ServerInstance->UpdateTime();
+		return uint64_t(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+
+	class TestTimer : public Timer
+	{
+	 public:
+		uint64_t due;
+		uint64_t fired;
+
+		TestTimer()
+			: Timer(0)
+			, due(0)
+			, fired(0)
+		{
+		}
+
+		bool Tick(time_t) override
+		{
+			fired = GetTestMilliseconds();
+			return true;
+		}
+	};
+
+	class ChangingTimer : public Timer
+	{
+	 public:
+		unsigned int ticks;
+
+		ChangingTimer()
+			: Timer(0, true)
+			, ticks(0)
+		{
+		}
+
+		bool Tick(time_t) override
+		{
+			ticks++;
+			SetIntervalMs(ticks * 20);
+			return true;
+		}
+	};
+}
+
+bool TestSuite::DoTimerTests()
+{
+	std::cout << "\n\nTimer wheel tests\n\n";
+
+	// Sub-second timers have to tick in order and never before they are due.
+	std::vector<TestTimer*> timers;
+	for (unsigned long i = 0; i < 150; ++i)
+	{
+		TestTimer* timer = new TestTimer;
+		timer->due = GetTestMilliseconds() + (i * 37) % 1500;
+		timer->SetIntervalMs((i * 37) % 1500);
+		timers.push_back(timer);
+	}
+
+	// Cancelled timers must never tick.
+	for (size_t i = 0; i < timers.size(); i += 3)
+		ServerInstance->Timers.DelTimer(timers[i]);
+
+	const uint64_t started = GetTestMilliseconds();
+	size_t pending = timers.size() - (timers.size() + 2) / 3;
+	while (pending && GetTestMilliseconds() < started + 3000)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(ServerInstance->Timers.GetTimeout(100)));
+		ServerInstance->UpdateTime();
+		ServerInstance->Timers.TickTimers(ServerInstance->Time());
+
+		pending = 0;
+		for (size_t i = 0; i < timers.size(); ++i)
+		{
+			if (i % 3 && !timers[i]->fired)
+				pending++;
+		}
+	}
+
+	bool passed = true;
+	for (size_t i = 0; i < timers.size(); ++i)
+	{
+		TestTimer* timer = timers[i];
+		if (i % 3 == 0 && timer->fired)
+		{
+			std::cout << "TIMER: cancelled timer " << i << " ticked" << std::endl;
+			passed = false;
+		}
+		else if (i % 3 && !timer->fired)
+		{
+			std::cout << "TIMER: timer " << i << " due in " << timer->GetIntervalMs() << " ms never ticked" << std::endl;
+			passed = false;
+		}
+		else if (timer->fired && timer->fired < timer->due)
+		{
+			std::cout << "TIMER: timer " << i << " ticked " << (timer->due - timer->fired) << " ms early" << std::endl;
+			passed = false;
+		}
+		delete timer;
+	}
+	std::cout << "Sub-second timers: " << (passed ? "SUCCESS!" : "FAILURE") << std::endl;
+
+	// A repeating timer which changes its interval while it ticks must stay scheduled once.
+	ChangingTimer changing;
+	const size_t scheduled = ServerInstance->Timers.GetCount();
+	changing.SetIntervalMs(10);
+	const uint64_t changestarted = GetTestMilliseconds();
+	while (changing.ticks < 4 && GetTestMilliseconds() < changestarted + 1000)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(ServerInstance->Timers.GetTimeout(100)));
+		ServerInstance->UpdateTime();
+		ServerInstance->Timers.TickTimers(ServerInstance->Time());
+		if (ServerInstance->Timers.GetCount() != scheduled + 1)
+		{
+			std::cout << "TIMER: repeating timer scheduled " << ServerInstance->Timers.GetCount() - scheduled << " times" << std::endl;
+			passed = false;
+			break;
+		}
+	}
+
+	if (changing.ticks < 4)
+	{
+		std::cout << "TIMER: repeating timer ticked " << changing.ticks << " times instead of 4" << std::endl;
+		passed = false;
+	}
+	ServerInstance->Timers.DelTimer(&changing);
+
+	// Adding and removing lots of timers should take constant time per timer.
+	const size_t count = 200000;
+	std::vector<TestTimer*> many;
+	many.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+		many.push_back(new TestTimer);
+
+	const size_t before = ServerInstance->Timers.GetCount();
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i)
+		many[i]->SetInterval(30 + (i * 7919) % 86400);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+	std::cout << "Adding " << count << " timers: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	if (ServerInstance->Timers.GetCount() != before + count)
+	{
+		std::cout << "TIMER: " << ServerInstance->Timers.GetCount() - before << " timers scheduled instead of " << count << std::endl;
+		passed = false;
+	}
+
+	begin = std::chrono::steady_clock::now();
+	for (size_t i = count; i-- > 0; )
+		ServerInstance->Timers.DelTimer(many[i]);
+	elapsed = std::chrono::steady_clock::now() - begin;
+	std::cout << "Removing " << count << " timers: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	if (ServerInstance->Timers.GetCount() != before)
+	{
+		std::cout << "TIMER: " << ServerInstance->Timers.GetCount() - before << " timers left after removing them" << std::endl;
+		passed = false;
+	}
+
+	stdalgo::delete_all(many);
+	return passed;
+}
+
+namespace
+{
+	class TestLogStream : public LogStream
+	{
+	 public:
+		unsigned long logged;
+
+		TestLogStream(LogLevel loglevel)
+			: LogStream(loglevel)
+			, logged(0)
+		{
+		}
+
+		void OnLog(LogLevel loglevel, const std::string& type, const std::string& msg) override
+		{
+			if (loglevel >= this->loglvl)
+				logged++;
+		}
+	};
+}
+
+bool TestSuite::DoLogLevelTests()
+{
+	std::cout << "\n\nLog level tests\n\n";
+
+	bool passed = true;
+	LogManager& logs = ServerInstance->Logs;
+	TestLogStream stream(LOG_SPARSE);
+
+	// The streams from the config might log these types as well so only check that
+	// they are enabled whenever the test stream wants them.
+	logs.AddLogTypes("TESTSUITE", &stream, false);
+	if (!logs.IsEnabled("TESTSUITE", LOG_SPARSE))
+	{
+		std::cout << "LOG: sparse messages are not enabled for a sparse stream" << std::endl;
+		passed = false;
+	}
+
+	stream.ChangeLevel(LOG_DEBUG);
+	if (!logs.IsEnabled(LOG_DEBUG) || !logs.IsEnabled("TESTSUITE", LOG_DEBUG))
+	{
+		std::cout << "LOG: debug messages are not enabled after changing the level to debug" << std::endl;
+		passed = false;
+	}
+
+	logs.Log("TESTSUITE", LOG_DEBUG, "log level test %d", 1);
+	LOG_IF_ENABLED("TESTSUITE", LOG_DEBUG, "log level test %d", 2);
+	if (stream.logged != 2)
+	{
+		std::cout << "LOG: " << stream.logged << " messages logged instead of 2" << std::endl;
+		passed = false;
+	}
+
+	logs.DelLogStream(&stream);
+	std::cout << "Log level table: " << (passed ? "SUCCESS!" : "FAILURE") << std::endl;
+
+	// Skipping a message which nothing logs should be much cheaper than formatting it.
+	const std::string type = "TESTSUITE-DISABLED";
+	if (logs.IsEnabled(type, LOG_RAWIO))
+	{
+		std::cout << "Raw I/O messages are logged, skipping the benchmark" << std::endl;
+		return passed;
+	}
+
+	const size_t count = 1000000;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i)
+		logs.Log(type, LOG_RAWIO, "%s %lu", type.c_str(), static_cast<unsigned long>(i));
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+	std::cout << "Logging " << count << " disabled messages: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i)
+		LOG_IF_ENABLED(type, LOG_RAWIO, "%s %s", type.c_str(), ConvToStr(i).c_str());
+	elapsed = std::chrono::steady_clock::now() - begin;
+	std::cout << "Logging " << count << " disabled messages with LOG_IF_ENABLED: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	return passed;
+}
+
+/** Computes the edit distance between two strings with the dynamic programming algorithm
+ * which the repeat module used to use.
+ */
+static size_t EditDistanceByMatrix(const std::string& s1, const std::string& s2, std::vector<size_t> (&mx)[2])
+{
+	const size_t l1 = s1.length();
+	const size_t l2 = s2.length();
+	mx[0].resize(l2 + 1);
+	mx[1].resize(l2 + 1);
+
+	for (size_t i = 0; i <= l2; i++)
+		mx[0][i] = i;
+	for (size_t i = 0; i < l1; i++)
+	{
+		mx[1][0] = i + 1;
+		for (size_t j = 0; j < l2; j++)
+			mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+
+		mx[0].swap(mx[1]);
+	}
+	return mx[0][l2];
+}
+
+bool TestSuite::DoEditDistanceTests()
+{
+	std::cout << "\n\nEdit distance tests\n\n";
+
+	// Random strings from small alphabets, some of them edited copies of each other, must
+	// give the same distance as the matrix, or max + 1 if that is larger than max.
+	std::minstd_rand rng(1);
+	std::vector<size_t> mx[2];
+	EditDistance distance;
+	for (size_t round = 0; round < 20000; ++round)
+	{
+		const size_t alphabet = 2 + rng() % 6;
+		std::string s1;
+		for (size_t length = rng() % 300; s1.length() < length; )
+			s1.push_back(static_cast<char>('a' + rng() % alphabet));
+
+		std::string s2(s1);
+		if (round % 2)
+		{
+			s2.clear();
+			for (size_t length = rng() % 300; s2.length() < length; )
+				s2.push_back(static_cast<char>('a' + rng() % alphabet));
+		}
+		for (size_t edits = rng() % 20; edits && !s2.empty(); --edits)
+		{
+			const size_t pos = rng() % s2.length();
+			switch (rng() % 3)
+			{
+				case 0:
+					s2[pos] = static_cast<char>('a' + rng() % alphabet);
+					break;
+				case 1:
+					s2.erase(pos, 1);
+					break;
+				default:
+					s2.insert(pos, 1, static_cast<char>('a' + rng() % alphabet));
+					break;
+			}
+		}
+
+		const size_t max = (round % 5) ? rng() % 40 : 1000;
+		const size_t expected = std::min(EditDistanceByMatrix(s1, s2, mx), max + 1);
+		distance.SetPattern(s1);
+		const size_t computed = distance.Compute(s2, max);
+		if (computed != expected)
+		{
+			std::cout << "EDITDISTANCE: distance between \"" << s1 << "\" and \"" << s2 << "\" up to " << max << " is " << computed << " instead of " << expected << std::endl;
+			return false;
+		}
+	}
+
+	// Benchmark on a synthetic channel backlog like the repeat module keeps for each member
+	// of a channel with +E set: every message is compared with the last 50 lines of its
+	// sender with a trigger of 10% of its length.
+	static const char* const words[] = { "the", "server", "channel", "is", "lagging", "again", "anyone", "know",
+		"why", "netsplit", "happened", "tonight", "upgrade", "soon", "please", "check", "config", "thanks" };
+	const size_t wordcount = sizeof(words) / sizeof(*words);
+	std::vector<std::string> lines;
+	for (size_t i = 0; i < 250; ++i)
+	{
+		std::string line;
+		if (i >= 10 && !(i % 4))
+		{
+			// Repeat an earlier line with a few characters changed.
+			line = lines[i - 1 - rng() % 9];
+			for (size_t edits = rng() % (line.length() / 8); edits; --edits)
+				line[rng() % line.length()] = static_cast<char>('a' + rng() % 26);
+		}
+		else
+		{
+			for (size_t length = 40 + rng() % 400; line.length() < length; )
+				line.append(words[rng() % wordcount]).push_back(' ');
+		}
+		lines.push_back(line);
+	}
+
+	const size_t backlog = 50;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	size_t expected = 0;
+	for (size_t i = backlog; i < lines.size(); ++i)
+	{
+		const size_t trigger = lines[i].length() / 10;
+		for (size_t j = i - backlog; j < i; ++j)
+		{
+			if (EditDistanceByMatrix(lines[i], lines[j], mx) <= trigger)
+				expected++;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+	const size_t comparisons = (lines.size() - backlog) * backlog;
+	std::cout << "Comparing " << comparisons << " lines, matrix: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	started = std::chrono::steady_clock::now();
+	size_t matched = 0;
+	for (size_t i = backlog; i < lines.size(); ++i)
+	{
+		const size_t trigger = lines[i].length() / 10;
+		distance.SetPattern(lines[i]);
+		for (size_t j = i - backlog; j < i; ++j)
+		{
+			if (distance.Compute(lines[j], trigger) <= trigger)
+				matched++;
+		}
+	}
+	elapsed = std::chrono::steady_clock::now() - started;
+	std::cout << "Comparing " << comparisons << " lines, EditDistance: " << (elapsed.count() * 1000) << " ms" << std::endl;
+
+	if (matched != expected)
+	{
+		std::cout << "EDITDISTANCE: matched " << matched << " lines instead of " << expected << std::endl;
+		return false;
+	}
+	return true;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
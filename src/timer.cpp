@@ -21,19 +21,43 @@
 
 
 #include "inspircd.h"
+#include <chrono>
+
+void Timer::SetTrigger(time_t nexttrigger)
+{
+	trigger = nexttrigger;
+	deadline = TimerManager::GetMilliseconds();
+	if (nexttrigger > ServerInstance->Time())
+		deadline += uint64_t(nexttrigger - ServerInstance->Time()) * 1000;
+}
 
 void Timer::SetInterval(unsigned int newinterval)
 {
 	ServerInstance->Timers.DelTimer(this);
 	secs = newinterval;
+	msecs = newinterval * 1000UL;
 	SetTrigger(ServerInstance->Time() + newinterval);
+	deadline = TimerManager::GetMilliseconds() + msecs;
+	ServerInstance->Timers.AddTimer(this);
+}
+
+void Timer::SetIntervalMs(unsigned long newinterval)
+{
+	ServerInstance->Timers.DelTimer(this);
+	secs = newinterval / 1000;
+	msecs = newinterval;
+	deadline = TimerManager::GetMilliseconds() + msecs;
+	trigger = ServerInstance->Time() + newinterval / 1000;
 	ServerInstance->Timers.AddTimer(this);
 }
 
 Timer::Timer(unsigned int secs_from_now, bool repeating)
 	: trigger(ServerInstance->Time() + secs_from_now)
+	, deadline(TimerManager::GetMilliseconds() + secs_from_now * 1000ULL)
 	, secs(secs_from_now)
+	, msecs(secs_from_now * 1000UL)
 	, repeat(repeating)
+	, slot(NULL)
 {
 }
 
@@ -42,42 +66,233 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
+TimerManager::TimerManager()
+	: current(0)
+	, started(false)
+	, count(0)
+{
+}
+
+uint64_t TimerManager::GetMilliseconds()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t TimerManager::GetTick()
+{
+	return GetMilliseconds() / TICK_MS;
+}
+
+void TimerManager::Resync(uint64_t now)
+{
+	TimerList pending;
+	auto take = [&pending](TimerList& list)
+	{
+		while (!list.empty())
+		{
+			Timer* t = list.front();
+			list.pop_front();
+			pending.push_front(t);
+		}
+	};
+
+	for (unsigned int i = 0; i < ROOT_SIZE; ++i)
+		take(root[i]);
+	for (unsigned int level = 0; level < LEVELS; ++level)
+	{
+		for (unsigned int i = 0; i < LEVEL_SIZE; ++i)
+			take(levels[level][i]);
+	}
+
+	// Timers which are already due go in the slot for now.
+	current = now;
+	while (!pending.empty())
+	{
+		Timer* t = pending.front();
+		pending.pop_front();
+		Schedule(t);
+	}
+}
+
+void TimerManager::Schedule(Timer* t)
+{
+	// Round up so timers never tick early.
+	uint64_t expires = (t->deadline + TICK_MS - 1) / TICK_MS;
+	TimerList* list;
+	if (expires < current)
+	{
+		// Already due, run it with the next tick.
+		list = &root[current & (ROOT_SIZE - 1)];
+	}
+	else if (expires - current < ROOT_SIZE)
+	{
+		list = &root[expires & (ROOT_SIZE - 1)];
+	}
+	else
+	{
+		// Timers which are too far away for the wheel are put in the last slot and
+		// rescheduled once they are cascaded out of it.
+		const uint64_t max = (uint64_t(1) << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1;
+		if (expires - current > max)
+			expires = current + max;
+
+		unsigned int level = 0;
+		while (expires - current >= (uint64_t(1) << (ROOT_BITS + (level + 1) * LEVEL_BITS)))
+			level++;
+		list = &levels[level][(expires >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1)];
+	}
+
+	list->push_front(t);
+	t->slot = list;
+}
+
+unsigned int TimerManager::Cascade(unsigned int level, unsigned int index)
+{
+	TimerList& list = levels[level][index];
+	while (!list.empty())
+	{
+		Timer* t = list.front();
+		list.pop_front();
+		Schedule(t);
+		stats.Cascaded++;
+	}
+	return index;
+}
+
 void TimerManager::TickTimers(time_t TIME)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	const uint64_t now = GetTick();
+	if (!started || current > now)
+		return;
+
+	if (!count)
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		// Nothing to tick, skip straight to the present.
+		current = now + 1;
+		return;
+	}
 
-		Timers.erase(i++);
+	// If the server has not run for a while (e.g. the machine was suspended) then moving
+	// every timer once is cheaper than going through every tick which was missed.
+	if (now - current >= ROOT_SIZE)
+		Resync(now);
 
-		if (!t->Tick(TIME))
-			continue;
+	std::chrono::steady_clock::time_point begin;
+	unsigned long fired = stats.Fired;
+	while (current <= now)
+	{
+		const unsigned int index = current & (ROOT_SIZE - 1);
+		if (!index)
+		{
+			// The first level has turned once, move the timers from the next slot of the level above
+			// it down. Whenever that level turns as well, do the same for the level above that.
+			for (unsigned int level = 0; level < LEVELS; ++level)
+			{
+				if (Cascade(level, (current >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1)))
+					break;
+			}
+		}
+
+		// Timers which are added while the expired ones tick can go in the same slot
+		// so move the expired ones out of it first.
+		TimerList expired;
+		TimerList& list = root[index];
+		while (!list.empty())
+		{
+			Timer* t = list.front();
+			list.pop_front();
+			expired.push_front(t);
+			t->slot = &expired;
+		}
+		current++;
 
-		if (t->GetRepeat())
+		while (!expired.empty())
 		{
-			t->SetTrigger(TIME + t->GetInterval());
+			if (fired == stats.Fired)
+				begin = std::chrono::steady_clock::now();
+
+			Timer* t = expired.front();
+			expired.pop_front();
+			t->slot = NULL;
+			count--;
+
+			// A timer which was given a trigger time with SetTrigger() while it was
+			// scheduled might not be due yet.
+			if ((t->deadline + TICK_MS - 1) / TICK_MS > now)
+			{
+				Schedule(t);
+				count++;
+				continue;
+			}
+
+			stats.Fired++;
+			if (!t->Tick(TIME))
+				continue;
+
+			if (!t->GetRepeat())
+				continue;
+
+			// If Tick() changed the interval the timer has already been scheduled with it. The
+			// deadline is the same either way and AddTimer() moves timers which are scheduled.
+			t->trigger = TIME + t->GetInterval();
+			t->deadline = GetMilliseconds() + t->GetIntervalMs();
 			AddTimer(t);
 		}
 	}
+
+	if (fired != stats.Fired)
+	{
+		const unsigned long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+		stats.Runs++;
+		stats.RunTime += elapsed;
+		stats.MaxRunTime = std::max(stats.MaxRunTime, elapsed);
+	}
 }
 
 void TimerManager::DelTimer(Timer* t)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	if (!t->slot)
+		return;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	t->slot->erase(t);
+	t->slot = NULL;
+	count--;
+	stats.Cancelled++;
+}
+
+void TimerManager::AddTimer(Timer* t)
+{
+	if (!started)
 	{
-		if (i->second == t)
-		{
-			Timers.erase(i);
-			break;
-		}
+		current = GetTick();
+		started = true;
 	}
+
+	// Adding a timer which is already scheduled moves it.
+	if (t->slot)
+	{
+		t->slot->erase(t);
+		count--;
+	}
+
+	Schedule(t);
+	count++;
+	stats.Added++;
 }
 
-void TimerManager::AddTimer(Timer* t)
+int TimerManager::GetTimeout(int max) const
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	if (!count)
+		return max;
+
+	// Look for the next slot with timers in it. Timers in the higher levels are only due
+	// once the first level has turned so don't look past that.
+	const uint64_t now = GetMilliseconds();
+	const unsigned int maxticks = max / TICK_MS + 1;
+	for (uint64_t tick = current; tick < current + maxticks; ++tick)
+	{
+		if (!root[tick & (ROOT_SIZE - 1)].empty() || !(tick & (ROOT_SIZE - 1)))
+			return tick * TICK_MS > now ? std::min<uint64_t>(tick * TICK_MS - now, max) : 0;
+	}
+	return max;
 }
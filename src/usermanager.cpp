@@ -70,7 +70,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	LocalUser* const New = new LocalUser(socket, client, server);
 	UserIOHandler* eh = &New->eh;
 
-	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "New user fd: %d", socket);
+	LOG_IF_ENABLED("USERS", LOG_DEBUG, "New user fd: %d", socket);
 
 	this->unregistered_count++;
 	this->clientlist[New->nick] = New;
@@ -128,7 +128,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 		if (!b->Type.empty() && !New->exempt)
 		{
 			/* user banned */
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Positive hit for " + New->GetIPString());
+			LOG_IF_ENABLED("BANCACHE", LOG_DEBUG, "BanCache: Positive hit for " + New->GetIPString());
 			if (!ServerInstance->Config->XLineMessage.empty())
 				New->WriteNumeric(ERR_YOUREBANNEDCREEP, ServerInstance->Config->XLineMessage);
 
@@ -140,7 +140,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 		}
 		else
 		{
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Negative hit for " + New->GetIPString());
+			LOG_IF_ENABLED("BANCACHE", LOG_DEBUG, "BanCache: Negative hit for " + New->GetIPString());
 		}
 	}
 	else
@@ -181,7 +181,7 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 
 	user->quitting = true;
 
-	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "QuitUser: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
+	LOG_IF_ENABLED("USERS", LOG_DEBUG, "QuitUser: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
 	LocalUser* const localuser = IS_LOCAL(user);
 	if (localuser)
 	{
@@ -296,75 +296,6 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
 	return (res == MOD_RES_PASSTHRU);
 }
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the users, e.g. do
- * ping checks, registration timeouts, etc.
- */
-void UserManager::DoBackgroundUserStuff()
-{
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); )
-	{
-		// It's possible that we quit the user below due to ping timeout etc. and QuitUser() removes it from the list
-		LocalUser* curr = *i;
-		++i;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
-
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() >= curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-					ClientProtocol::Messages::Ping ping;
-					curr->Send(ServerInstance->GetRFCEvents().ping, ping);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
-				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
-				}
-
-				// If the user has been quit in OnCheckReady then we shouldn't
-				// quit them again for having a registration timeout.
-				if (curr->quitting)
-					continue;
-				break;
-		}
-
-		if (curr->registered != REG_ALL && curr->MyClass && (ServerInstance->Time() > (curr->signon + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
-	}
-}
-
 already_sent_t UserManager::NextAlreadySentId()
 {
 	if (++already_sent_id == 0)
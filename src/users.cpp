@@ -24,6 +24,7 @@
 
 
 #include "inspircd.h"
+#include "linescan.h"
 #include "xline.h"
 
 ClientProtocol::MessageList LocalUser::sendmsglist;
@@ -72,11 +73,12 @@ User::User(const std::string& uid, Server* srv, UserType type)
 	, server(srv)
 	, registered(REG_NONE)
 	, quitting(false)
+	, maskgeneration(0)
 	, usertype(type)
 {
 	client_sa.sa.sa_family = AF_UNSPEC;
 
-	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "New UUID for user: %s", uuid.c_str());
+	LOG_IF_ENABLED("USERS", LOG_DEBUG, "New UUID for user: %s", uuid.c_str());
 
 	// Do not insert FakeUsers into the uuidlist so FindUUID() won't return them which is the desired behavior
 	if (type != USERTYPE_SERVER)
@@ -100,9 +102,12 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	, nping(0)
 	, idle_lastmsg(0)
 	, CommandFloodPenalty(0)
+	, lastdecay(ServerInstance->Time())
+	, timer(this)
 	, already_sent(0)
 {
 	signon = ServerInstance->Time();
+	ServerInstance->Timers.AddTimer(&timer);
 	// The user's default nick is their UUID
 	nick = uuid;
 	ident = "unknown";
@@ -223,6 +228,8 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
+	user->DecayPenalty();
+
 	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
@@ -245,9 +252,6 @@ void UserIOHandler::OnDataReady()
 	// The position of the most \n character or npos if not found yet.
 	std::string::size_type eolpos;
 
-	// The position within the recvq of the current character.
-	std::string::size_type qpos;
-
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
 		// Check the newly received data for an EOL.
@@ -258,30 +262,29 @@ void UserIOHandler::OnDataReady()
 			return;
 		}
 
-		// We've found a line! Clean it up and move it to the line buffer.
+		// We've found a line! Clean it up and move it to the line buffer,
+		// copying everything between the \r and \0 characters in one go.
 		line.reserve(eolpos);
-		for (qpos = 0; qpos < eolpos; ++qpos)
+		const char* const eol = recvq.begin() + eolpos;
+		for (const char* pos = recvq.begin(); ; ++pos)
 		{
-			char c = recvq[qpos];
-			switch (c)
-			{
-				case '\0':
-					c = ' ';
-					break;
-				case '\r':
-					continue;
-			}
+			const char* const special = LineScan::Find(pos, eol, '\r', '\0');
+			line.append(pos, special);
+			if (special == eol)
+				break;
 
-			line.push_back(c);
+			if (*special == '\0')
+				line.push_back(' ');
+			pos = special;
 		}
 
 		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, eolpos + 1);
+		recvq.erase_front(eolpos + 1);
 		checked_until = 0;
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats.Recv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats.Recv += eolpos;
+		user->bytes_in += eolpos;
 		user->cmds_in++;
 
 		ServerInstance->Parser.ProcessBuffer(user, line);
@@ -293,10 +296,20 @@ void UserIOHandler::OnDataReady()
 	}
 
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
+	{
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+		return;
+	}
+
+	// Come back once enough of the penalty has worn off or the sendq has had a chance to drain.
+	time_t wait = 1;
+	const unsigned int rate = user->MyClass->GetCommandRate();
+	if (user->CommandFloodPenalty >= penaltymax)
+		wait = std::max<time_t>((user->CommandFloodPenalty - penaltymax) / rate + 1, 1);
+	user->timer.Replay(ServerInstance->Time() + wait);
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::AddWriteBuf(const StreamSocket::SendQueue::Element& data)
 {
 	if (user->quitting_sendq)
 		return;
@@ -515,6 +528,127 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nping = ServerInstance->Time() + a->GetPingTime();
+	timer.Reschedule();
+}
+
+void LocalUser::DecayPenalty()
+{
+	const time_t now = ServerInstance->Time();
+	if (now <= lastdecay)
+		return;
+
+	if (CommandFloodPenalty && MyClass)
+	{
+		const unsigned long decay = (unsigned long)(now - lastdecay) * MyClass->GetCommandRate();
+		CommandFloodPenalty = (CommandFloodPenalty > decay) ? CommandFloodPenalty - decay : 0;
+	}
+	lastdecay = now;
+}
+
+LocalUserTimer::LocalUserTimer(LocalUser* me)
+	: Timer(1, true)
+	, user(me)
+	, replay(0)
+{
+}
+
+bool LocalUserTimer::Tick(time_t currtime)
+{
+	// Nothing has to be checked for users who are quitting until they are destroyed.
+	if (!Check(currtime))
+	{
+		CancelRepeat();
+		return true;
+	}
+
+	Reschedule();
+	return true;
+}
+
+bool LocalUserTimer::Check(time_t currtime)
+{
+	if (user->quitting)
+		return false;
+
+	if (replay && currtime >= replay)
+	{
+		replay = 0;
+		user->eh.OnDataReady();
+		if (user->quitting)
+			return false;
+	}
+
+	switch (user->registered)
+	{
+		case REG_ALL:
+			if (currtime >= user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
+				{
+					time_t time = currtime - (user->nping - user->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					ServerInstance->Users->QuitUser(user, message);
+					return false;
+				}
+				ClientProtocol::Messages::Ping ping;
+				user->Send(ServerInstance->GetRFCEvents().ping, ping);
+				user->lastping = 0;
+				user->nping = currtime + user->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (ServerInstance->Users->AllModulesReportReady(user))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				if (user->quitting)
+					return false;
+				break;
+			}
+
+			// If the user has been quit in OnCheckReady then we shouldn't
+			// quit them again for having a registration timeout.
+			if (user->quitting)
+				return false;
+			break;
+	}
+
+	if (user->registered != REG_ALL && user->MyClass && (currtime > (user->signon + user->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return false;
+	}
+	return true;
+}
+
+void LocalUserTimer::Reschedule()
+{
+	const time_t now = ServerInstance->Time();
+
+	// Unregistered users are checked every second until modules are ready for them, registered
+	// users only need attention when they are due to be pinged.
+	time_t next = now + 1;
+	if (user->registered == REG_ALL)
+		next = user->nping;
+	if (replay)
+		next = std::min(next, replay);
+
+	SetInterval(next > now ? next - now : 1);
+}
+
+void LocalUserTimer::Replay(time_t when)
+{
+	if (replay && replay <= when)
+		return;
+
+	replay = when;
+	if (when < GetTrigger())
+		Reschedule();
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -572,10 +706,14 @@ void LocalUser::FullConnect()
 
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString().c_str(), this->GetRealName().c_str());
-	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
+	LOG_IF_ENABLED("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
 	ServerInstance->BanCache.AddHit(this->GetIPString(), "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
+
+	// Reading from registered users that have no I/O hook can be done by an I/O thread
+	if (!eh.GetIOHook())
+		SocketEngine::DelegateRead(&eh);
 }
 
 void User::InvalidateCache()
@@ -586,6 +724,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	maskgeneration++;
 }
 
 bool User::ChangeNick(const std::string& newnick, time_t newts)
@@ -772,8 +911,9 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa)
 	this->CheckClass();
 }
 
-void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
+void LocalUser::Write(const ClientProtocol::SharedSerializedMessage& serialized)
 {
+	const ClientProtocol::SerializedMessage& text = *serialized;
 	if (!SocketEngine::BoundsCheckFd(&eh))
 		return;
 
@@ -789,7 +929,7 @@ void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
 		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.c_str());
 	}
 
-	eh.AddWriteBuf(text);
+	eh.AddWriteBuf(serialized);
 
 	const size_t bytessent = text.length() + 2;
 	ServerInstance->stats.Sent += bytessent;
@@ -926,12 +1066,12 @@ void User::ForEachNeighbor(ForEachNeighborHandler& handler, bool include_self)
 	for (IncludeChanList::const_iterator i = include_chans.begin(); i != include_chans.end(); ++i)
 	{
 		Channel* chan = (*i)->chan;
-		const Channel::MemberMap& userlist = chan->GetUsers();
-		for (Channel::MemberMap::const_iterator j = userlist.begin(); j != userlist.end(); ++j)
+		const Channel::LocalMemberList& members = chan->GetLocalMembers();
+		for (Channel::LocalMemberList::const_iterator j = members.begin(); j != members.end(); ++j)
 		{
-			LocalUser* curr = IS_LOCAL(j->first);
+			LocalUser* curr = static_cast<LocalUser*>((*j)->user);
 			// User not yet visited?
-			if ((curr) && (curr->already_sent != newid))
+			if (curr->already_sent != newid)
 			{
 				// Mark as visited and execute function
 				curr->already_sent = newid;
@@ -1040,7 +1180,10 @@ void User::ChangeRealHost(const std::string& host, bool resetdisplay)
 	// If we are just resetting the display host then we don't need to
 	// do anything else.
 	if (!changehost)
+	{
+		this->InvalidateCache();
 		return;
+	}
 
 	realhost = host;
 	this->InvalidateCache();
@@ -1070,7 +1213,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 {
 	ConnectClass *found = NULL;
 
-	ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Setting connect class for UID %s", this->uuid.c_str());
+	LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Setting connect class for UID %s", this->uuid.c_str());
 
 	if (!explicit_name.empty())
 	{
@@ -1080,7 +1223,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 
 			if (explicit_name == c->name)
 			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Explicitly set to %s", explicit_name.c_str());
+				LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Explicitly set to %s", explicit_name.c_str());
 				found = c;
 			}
 		}
@@ -1090,7 +1233,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 		for (ServerConfig::ClassVector::const_iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); ++i)
 		{
 			ConnectClass* c = *i;
-			ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Checking %s", c->GetName().c_str());
+			LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Checking %s", c->GetName().c_str());
 
 			ModResult MOD_RESULT;
 			FIRST_MOD_RESULT(OnSetConnectClass, MOD_RESULT, (this,c));
@@ -1098,7 +1241,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 			if (MOD_RESULT == MOD_RES_ALLOW)
 			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Class forced by module to %s", c->GetName().c_str());
+				LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Class forced by module to %s", c->GetName().c_str());
 				found = c;
 				break;
 			}
@@ -1114,7 +1257,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 			if (!InspIRCd::MatchCIDR(this->GetIPString(), c->GetHost(), NULL) &&
 			    !InspIRCd::MatchCIDR(this->GetRealHost(), c->GetHost(), NULL))
 			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host match (for %s)", c->GetHost().c_str());
+				LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "No host match (for %s)", c->GetHost().c_str());
 				continue;
 			}
 
@@ -1124,7 +1267,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 			 */
 			if (c->limit && (c->GetReferenceCount() >= c->limit))
 			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "OOPS: Connect class limit (%lu) hit, denying", c->limit);
+				LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "OOPS: Connect class limit (%lu) hit, denying", c->limit);
 				continue;
 			}
 
@@ -1134,7 +1277,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				/* and our port doesn't match, fail. */
 				if (!c->ports.count(this->GetServerPort()))
 				{
-					ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Requires a different port, skipping");
+					LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Requires a different port, skipping");
 					continue;
 				}
 			}
@@ -1143,7 +1286,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 			{
 				if (!ServerInstance->PassCompare(this, c->config->getString("password"), password, c->config->getString("hash")))
 				{
-					ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Bad password, skipping");
+					LOG_IF_ENABLED("CONNECTCLASS", LOG_DEBUG, "Bad password, skipping");
 					continue;
 				}
 			}
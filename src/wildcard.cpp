@@ -71,6 +71,111 @@ static bool MatchInternal(const unsigned char* str, const unsigned char* mask, u
 	return !*wild;
 }
 
+/** Matches a range of a string against a range of a mask in the same way as MatchInternal(). */
+static bool MatchRange(const unsigned char* str, const unsigned char* strend, const unsigned char* wild, const unsigned char* wildend, unsigned const char* map)
+{
+	const unsigned char* cp = NULL;
+	const unsigned char* mp = NULL;
+
+	while ((str != strend) && ((wild == wildend) || (*wild != '*')))
+	{
+		if ((wild == wildend) || ((map[*wild] != map[*str]) && (*wild != '?')))
+			return false;
+		wild++;
+		str++;
+	}
+
+	while (str != strend)
+	{
+		if ((wild != wildend) && (*wild == '*'))
+		{
+			if (++wild == wildend)
+				return true;
+			mp = wild;
+			cp = str + 1;
+		}
+		else if ((wild != wildend) && ((map[*wild] == map[*str]) || (*wild == '?')))
+		{
+			wild++;
+			str++;
+		}
+		else
+		{
+			wild = mp;
+			str = cp++;
+		}
+	}
+
+	while ((wild != wildend) && (*wild == '*'))
+		wild++;
+
+	return (wild == wildend);
+}
+
+WildcardMask::WildcardMask(const std::string& Mask, unsigned const char* Map)
+	: mask(Mask)
+	, map(Map ? Map : national_case_insensitive_map)
+	, minlength(0)
+	, variable(false)
+	, cidr(Mask.find('/') != std::string::npos)
+{
+	const std::string::size_type first = mask.find_first_of("*?");
+	const std::string::size_type last = mask.find_last_of("*?");
+	const std::string::size_type prefixlength = (first == std::string::npos ? mask.length() : first);
+	const std::string::size_type suffixstart = (last == std::string::npos ? mask.length() : last + 1);
+
+	for (std::string::size_type i = 0; i < mask.length(); ++i)
+	{
+		const unsigned char chr = mask[i];
+		if (chr == '*')
+			variable = true;
+		else
+			minlength++;
+
+		if (i < prefixlength)
+			prefix.push_back(map[chr]);
+		else if (i >= suffixstart)
+			suffix.push_back(map[chr]);
+	}
+}
+
+bool WildcardMask::Match(const std::string& str) const
+{
+	if ((str.length() < minlength) || (!variable && str.length() != minlength))
+		return false;
+
+	const unsigned char* const begin = reinterpret_cast<const unsigned char*>(str.data());
+	const unsigned char* const end = begin + str.length();
+	for (std::string::size_type i = 0; i < prefix.length(); ++i)
+	{
+		if (map[begin[i]] != static_cast<unsigned char>(prefix[i]))
+			return false;
+	}
+
+	const unsigned char* const tail = end - suffix.length();
+	for (std::string::size_type i = 0; i < suffix.length(); ++i)
+	{
+		if (map[tail[i]] != static_cast<unsigned char>(suffix[i]))
+			return false;
+	}
+
+	// Masks without wildcards were fully checked by the prefix.
+	if (prefix.length() == mask.length())
+		return true;
+
+	const unsigned char* const wild = reinterpret_cast<const unsigned char*>(mask.data());
+	return MatchRange(begin + prefix.length(), tail, wild + prefix.length(), wild + mask.length() - suffix.length(), map);
+}
+
+bool WildcardMask::MatchCIDR(const std::string& str) const
+{
+	if (cidr && irc::sockets::MatchCIDR(str, mask, true))
+		return true;
+
+	// Fall back to regular match
+	return Match(str);
+}
+
 // Below here is all wrappers around MatchInternal
 
 bool InspIRCd::Match(const std::string& str, const std::string& mask, unsigned const char* map)
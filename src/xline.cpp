@@ -24,6 +24,7 @@
 #include "inspircd.h"
 #include "xline.h"
 #include "modules/stats.h"
+#include <chrono>
 
 /** An XLineFactory specialized to generate GLine* pointers
  */
@@ -103,6 +104,484 @@ class ZLineFactory : public XLineFactory
         }
 };
 
+namespace
+{
+	/** Parses a mask which consists of an IP address and an optional CIDR prefix length.
+	 * @param mask The mask to parse.
+	 * @param range The location to store the parsed range in.
+	 * @return True if the mask was a valid IP address or CIDR range; otherwise, false.
+	 */
+	bool ParseRange(const std::string& mask, irc::sockets::cidr_mask& range)
+	{
+		// Masks containing wildcards have to be matched as globs.
+		const std::string::size_type slash = mask.find('/');
+		const std::string address(mask, 0, slash);
+		if (address.empty() || address.find_first_not_of("0123456789abcdefABCDEF.:") != std::string::npos)
+			return false;
+
+		irc::sockets::sockaddrs sa;
+		if (!irc::sockets::aptosa(address, 0, sa))
+			return false;
+
+		unsigned int length = 128;
+		if (slash != std::string::npos)
+		{
+			const std::string prefix(mask, slash + 1);
+			if (prefix.empty() || prefix.length() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos)
+				return false;
+
+			length = ConvToNum<unsigned int>(prefix);
+			if (length > 128)
+				return false;
+		}
+
+		range = irc::sockets::cidr_mask(sa, length);
+		return true;
+	}
+
+	/** Retrieves the value of a bit in an address. */
+	unsigned int GetBit(const unsigned char* bits, unsigned int pos)
+	{
+		return (bits[pos / 8] >> (7 - (pos % 8))) & 1;
+	}
+
+	/** Retrieves the number of leading bits which are the same in two addresses, up to a limit. */
+	unsigned int CommonBits(const unsigned char* first, const unsigned char* second, unsigned int limit)
+	{
+		unsigned int pos = 0;
+		for (; pos < limit; pos += 8)
+		{
+			const unsigned char diff = first[pos / 8] ^ second[pos / 8];
+			if (diff)
+			{
+				for (unsigned char bit = 0x80; !(diff & bit); bit >>= 1)
+					pos++;
+				break;
+			}
+		}
+		return std::min(pos, limit);
+	}
+
+	/** Finds the lines in a host index which match the real host or the IP address of a user.
+	 * @param hosts The index to search.
+	 * @param user The user to find lines for.
+	 * @param lines The list to append the lines to. Every line is appended at most once.
+	 */
+	void FindHostLines(const WildcardIndex<XLine*>& hosts, User* user, std::vector<XLine*>& lines)
+	{
+		const size_t first = lines.size();
+		hosts.Find(user->GetRealHost(), lines);
+		if (user->GetIPString() == user->GetRealHost())
+			return;
+
+		// A line can match both the host and the IP address but it must only be listed once as
+		// the caller might expire and delete it.
+		hosts.Find(user->GetIPString(), lines);
+		std::vector<XLine*>::iterator begin = lines.begin() + first;
+		std::sort(begin, lines.end());
+		lines.erase(std::unique(begin, lines.end()), lines.end());
+	}
+
+	/** The minimum number of local users each thread has to be given before matching is split across threads. */
+	const size_t MIN_USERS_PER_THREAD = 1024;
+
+	/** Work which can be split into chunks of a range and done on several threads at once. */
+	class ParallelJob
+	{
+	 public:
+		virtual ~ParallelJob() { }
+
+		/** Does the work for a chunk of the range. Chunks never overlap.
+		 * @param begin The first index of the chunk.
+		 * @param end One past the last index of the chunk.
+		 */
+		virtual void Run(size_t begin, size_t end) = 0;
+	};
+
+	/** Runs chunks of ParallelJobs on a worker thread. Workers are kept between jobs so they do
+	 * not have to be started every time lines are applied.
+	 */
+	class ParallelJobThread final : public QueuedThread
+	{
+		/** The job to run a chunk of or NULL if there is nothing to do, guarded by the queue lock. */
+		ParallelJob* job;
+
+		/** The first index of the chunk to run. */
+		size_t begin;
+
+		/** One past the last index of the chunk to run. */
+		size_t end;
+
+		/** Guards pending and is signalled when it drops to zero. */
+		ThreadQueueData& done;
+
+		/** The number of chunks which have not been run yet. */
+		size_t& pending;
+
+	 public:
+		ParallelJobThread(ThreadQueueData& d, size_t& p)
+			: job(NULL)
+			, begin(0)
+			, end(0)
+			, done(d)
+			, pending(p)
+		{
+		}
+
+		/** Gives the worker a chunk of a job to run.
+		 * @param j The job to run.
+		 * @param b The first index of the chunk.
+		 * @param e One past the last index of the chunk.
+		 */
+		void Post(ParallelJob& j, size_t b, size_t e)
+		{
+			LockQueue();
+			job = &j;
+			begin = b;
+			end = e;
+			UnlockQueueWakeup();
+		}
+
+		void Run() override
+		{
+			LockQueue();
+			while (!GetExitFlag())
+			{
+				if (!job)
+				{
+					WaitForQueue();
+					continue;
+				}
+
+				ParallelJob* const current = job;
+				job = NULL;
+				UnlockQueue();
+
+				current->Run(begin, end);
+
+				done.Lock();
+				if (!--pending)
+					done.Wakeup();
+				done.Unlock();
+
+				LockQueue();
+			}
+			UnlockQueue();
+		}
+	};
+
+	/** The worker threads which are used to run ParallelJobs. */
+	class ParallelJobPool final
+	{
+		/** The worker threads. */
+		std::vector<ParallelJobThread*> workers;
+
+		/** Guards pending and is signalled when the last chunk has been run. */
+		ThreadQueueData done;
+
+		/** The number of chunks given to workers which have not been run yet. */
+		size_t pending;
+
+	 public:
+		/** Starts the worker threads. If a thread can not be started fewer workers are used.
+		 * @param threads The number of worker threads to start.
+		 */
+		ParallelJobPool(unsigned int threads)
+			: pending(0)
+		{
+			for (unsigned int i = 0; i < threads; ++i)
+			{
+				ParallelJobThread* worker = new ParallelJobThread(done, pending);
+				try
+				{
+					ServerInstance->Threads.Start(worker);
+				}
+				catch (CoreException& err)
+				{
+					ServerInstance->Logs->Log("XLINE", LOG_DEFAULT, "Unable to start a matching thread: %s", err.GetReason().c_str());
+					delete worker;
+					break;
+				}
+				workers.push_back(worker);
+			}
+		}
+
+		~ParallelJobPool()
+		{
+			for (std::vector<ParallelJobThread*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+			{
+				(*i)->join();
+				delete *i;
+			}
+		}
+
+		/** Splits a job into chunks and runs them on the workers and the main thread, then waits for
+		 * all of them to finish.
+		 * @param job The job to run.
+		 * @param count The size of the range to run the job on.
+		 * @param threads The maximum number of workers to use.
+		 * @return The number of workers which were used.
+		 */
+		unsigned int Run(ParallelJob& job, size_t count, unsigned int threads)
+		{
+			threads = std::min<size_t>(threads, workers.size());
+			const size_t chunk = (count + threads) / (threads + 1);
+			size_t begin = 0;
+			unsigned int used = 0;
+			for (; used < threads && begin + chunk < count; ++used)
+			{
+				done.Lock();
+				pending++;
+				done.Unlock();
+
+				workers[used]->Post(job, begin, begin + chunk);
+				begin += chunk;
+			}
+
+			job.Run(begin, count);
+
+			done.Lock();
+			while (pending)
+				done.Wait();
+			done.Unlock();
+			return used;
+		}
+	};
+
+	/** The workers used for matching or NULL if they have not been started yet. */
+	ParallelJobPool* JobPool = NULL;
+
+	/** The number of workers JobPool was started with. */
+	unsigned int JobPoolThreads = 0;
+
+	/** Retrieves the number of worker threads to match a number of local users on.
+	 * @param users The number of local users which will be matched.
+	 * @return The number of worker threads or 0 to match on the main thread only.
+	 */
+	unsigned int GetMatchThreads(size_t users)
+	{
+		const size_t threads = std::min<size_t>(ServerInstance->Config->XLineThreads, users / MIN_USERS_PER_THREAD);
+		return threads > 1 ? threads - 1 : 0;
+	}
+
+	/** Splits a job into chunks and runs them on worker threads and the main thread, then waits for
+	 * all of them to finish. The workers are started the first time they are needed and again when
+	 * <performance:xlinethreads> has been changed.
+	 * @param job The job to run.
+	 * @param count The size of the range to run the job on.
+	 * @param threads The number of worker threads to use.
+	 * @return The number of worker threads which were used.
+	 */
+	unsigned int RunParallelJob(ParallelJob& job, size_t count, unsigned int threads)
+	{
+		if (!threads)
+		{
+			// Stop the workers if they are no longer wanted.
+			if (JobPool && ServerInstance->Config->XLineThreads < 2)
+			{
+				delete JobPool;
+				JobPool = NULL;
+			}
+
+			job.Run(0, count);
+			return 0;
+		}
+
+		const unsigned int wanted = ServerInstance->Config->XLineThreads - 1;
+		if (!JobPool || JobPoolThreads != wanted)
+		{
+			delete JobPool;
+			JobPool = new ParallelJobPool(wanted);
+			JobPoolThreads = wanted;
+		}
+		return JobPool->Run(job, count, threads);
+	}
+
+	/** Collects the local users who are matched against X-lines. Their IP address strings are
+	 * generated here so matching threads only ever read from the users.
+	 * @param users The list to store the users in.
+	 * @param skipexempt Whether to leave out users who match an E-line.
+	 */
+	void GetMatchableUsers(std::vector<LocalUser*>& users, bool skipexempt)
+	{
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		users.reserve(list.size());
+		for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+		{
+			LocalUser* user = *i;
+			if (skipexempt && user->exempt)
+				continue;
+
+			user->GetIPString();
+			users.push_back(user);
+		}
+	}
+
+	/** Shortens the prefix length of an address range. */
+	irc::sockets::cidr_mask Truncate(const irc::sockets::cidr_mask& range, unsigned int length)
+	{
+		irc::sockets::cidr_mask result(range);
+		result.length = length;
+		for (unsigned int i = 0; i < sizeof(result.bits); ++i)
+		{
+			if (i * 8 >= length)
+				result.bits[i] = 0;
+			else if (i * 8 + 8 > length)
+				result.bits[i] &= (0xFF00 >> (length % 8)) & 0xFF;
+		}
+		return result;
+	}
+}
+
+struct XLineTrie::Node
+{
+	/** The address range covered by this node. */
+	irc::sockets::cidr_mask range;
+
+	/** The lines which were added with exactly this range. */
+	std::vector<XLine*> lines;
+
+	/** The nodes for narrower ranges which have a zero or a one after the end of this range. */
+	Node* children[2];
+
+	Node(const irc::sockets::cidr_mask& r)
+		: range(r)
+	{
+		children[0] = children[1] = NULL;
+	}
+
+	~Node()
+	{
+		delete children[0];
+		delete children[1];
+	}
+};
+
+XLineTrie::XLineTrie()
+	: count(0)
+{
+	roots[0] = roots[1] = NULL;
+}
+
+XLineTrie::~XLineTrie()
+{
+	delete roots[0];
+	delete roots[1];
+}
+
+XLineTrie::Node** XLineTrie::GetRoot(int family)
+{
+	switch (family)
+	{
+		case AF_INET:
+			return &roots[0];
+		case AF_INET6:
+			return &roots[1];
+		default:
+			return NULL;
+	}
+}
+
+bool XLineTrie::Add(const irc::sockets::cidr_mask& range, XLine* line)
+{
+	Node** slot = GetRoot(range.type);
+	if (!slot)
+		return false;
+
+	while (*slot)
+	{
+		Node* node = *slot;
+		const unsigned int common = CommonBits(node->range.bits, range.bits, std::min(node->range.length, range.length));
+		if (common == node->range.length)
+		{
+			if (common == range.length)
+			{
+				// There are already lines with this range.
+				node->lines.push_back(line);
+				count++;
+				return true;
+			}
+
+			// The node contains the range so the line belongs below it.
+			slot = &node->children[GetBit(range.bits, common)];
+			continue;
+		}
+
+		// The range diverges from the node before the end of it so a new node has to be
+		// inserted above it for either the range itself or the prefix they share.
+		Node* parent = new Node(Truncate(range, common));
+		parent->children[GetBit(node->range.bits, common)] = node;
+		*slot = parent;
+		if (common == range.length)
+		{
+			parent->lines.push_back(line);
+			count++;
+			return true;
+		}
+		slot = &parent->children[GetBit(range.bits, common)];
+	}
+
+	*slot = new Node(range);
+	(*slot)->lines.push_back(line);
+	count++;
+	return true;
+}
+
+bool XLineTrie::Remove(const irc::sockets::cidr_mask& range, XLine* line)
+{
+	Node** slot = GetRoot(range.type);
+	if (!slot)
+		return false;
+
+	Node** parentslot = NULL;
+	for (Node* node = *slot; node; node = *slot)
+	{
+		if ((node->range.length > range.length) || (CommonBits(node->range.bits, range.bits, node->range.length) != node->range.length))
+			return false;
+
+		if (node->range.length == range.length)
+			break;
+
+		parentslot = slot;
+		slot = &node->children[GetBit(range.bits, node->range.length)];
+	}
+
+	if (!*slot || !stdalgo::vector::swaperase((*slot)->lines, line))
+		return false;
+	count--;
+
+	// Remove the node and then its parent if they are no longer needed to hold lines or join two subtrees.
+	Node** const slots[] = { slot, parentslot };
+	for (size_t i = 0; i < sizeof(slots) / sizeof(*slots) && slots[i]; ++i)
+	{
+		Node* node = *slots[i];
+		if (!node->lines.empty() || (node->children[0] && node->children[1]))
+			break;
+
+		*slots[i] = node->children[0] ? node->children[0] : node->children[1];
+		node->children[0] = node->children[1] = NULL;
+		delete node;
+	}
+	return true;
+}
+
+void XLineTrie::Find(const irc::sockets::sockaddrs& addr, std::vector<XLine*>& lines)
+{
+	Node** root = GetRoot(addr.family());
+	if (!root)
+		return;
+
+	const irc::sockets::cidr_mask address(addr, 128);
+	for (Node* node = *root; node; node = node->children[GetBit(address.bits, node->range.length)])
+	{
+		if (CommonBits(node->range.bits, address.bits, node->range.length) != node->range.length)
+			break;
+
+		lines.insert(lines.end(), node->lines.begin(), node->lines.end());
+		if (node->range.length >= address.length)
+			break;
+	}
+}
 
 /*
  * This is now version 3 of the XLine subsystem, let's see if we can get it as nice and
@@ -156,26 +635,73 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
-	{
-		LocalUser* u = *u2;
-		u->exempt = false;
+	XLineLookup* others = NULL;
+	ContainerIter other = other_lines.find("E");
+	if (other != other_lines.end())
+		others = &other->second;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
+	// Lines from modules might not be safe to match on several threads at once.
+	bool threadsafe = true;
+	for (LookupIter i = ELines.begin(); i != ELines.end() && threadsafe; ++i)
+		threadsafe = i->second->IsThreadSafe();
 
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
+	class ExemptMatcher : public ParallelJob
+	{
+	 public:
+		XLineManager* manager;
+		XLineLookup* others;
+		const std::vector<LocalUser*>& users;
+		std::vector<char>& exempt;
+
+		ExemptMatcher(XLineManager* m, XLineLookup* o, const std::vector<LocalUser*>& u, std::vector<char>& e)
+			: manager(m), others(o), users(u), exempt(e)
 		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
-				u->exempt = true;
+		}
 
-			i = safei;
+		void Run(size_t begin, size_t end) override
+		{
+			std::vector<XLine*> candidates;
+			for (size_t idx = begin; idx != end; ++idx)
+			{
+				LocalUser* u = users[idx];
+
+				candidates.clear();
+				manager->FindIndexedLines("E", u, candidates);
+				if (others)
+				{
+					for (LookupIter i = others->begin(); i != others->end(); ++i)
+						candidates.push_back(i->second);
+				}
+
+				for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+				{
+					XLine *e = *i;
+					if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
+					{
+						exempt[idx] = true;
+						break;
+					}
+				}
+			}
 		}
+	};
+
+	std::vector<LocalUser*> users;
+	GetMatchableUsers(users, false);
+	std::vector<char> exempt(users.size(), false);
+
+	ExemptMatcher matcher(this, others, users, exempt);
+	const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	const unsigned int threads = RunParallelJob(matcher, users.size(), threadsafe ? GetMatchThreads(users.size()) : 0);
+	const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+
+	for (size_t i = 0; i < users.size(); ++i)
+		users[i]->exempt = exempt[i];
+
+	if (threads)
+	{
+		ServerInstance->SNO->WriteToSnoMask('x', "Matched %lu E-lines against %lu local users in %.2f ms using %u threads",
+			(unsigned long)ELines.size(), (unsigned long)users.size(), elapsed.count(), threads + 1);
 	}
 }
 
@@ -285,6 +811,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	IndexLine(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -317,6 +844,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 
 	stdalgo::erase(pending_lines, y->second);
 
+	UnindexLine(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -340,9 +868,32 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 
 	const time_t current = ServerInstance->Time();
 
+	/* Lines which match an IP range or host mask only need to be checked if the user is within it */
+	std::vector<XLine*> candidates;
+	FindIndexedLines(type, user, candidates);
+	if (!candidates.empty())
+	{
+		for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+		{
+			XLine* line = *i;
+			if (line->duration && current > line->expiry)
+			{
+				ExpireLine(x, x->second.find(line->Displayable()));
+				continue;
+			}
+
+			if (line->Matches(user))
+				return line;
+		}
+	}
+
+	ContainerIter others = other_lines.find(type);
+	if (others == other_lines.end())
+		return NULL;
+
 	LookupIter safei;
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	for (LookupIter i = others->second.begin(); i != others->second.end(); )
 	{
 		safei = i;
 		safei++;
@@ -350,7 +901,7 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 		if (i->second->duration && current > i->second->expiry)
 		{
 			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
+			ExpireLine(x, x->second.find(i->first));
 			i = safei;
 			continue;
 		}
@@ -414,31 +965,164 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	 */
 	stdalgo::erase(pending_lines, item->second);
 
+	UnindexLine(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
 
+void XLineManager::IndexLine(XLine* line)
+{
+	irc::sockets::cidr_mask range;
+	if (line->GetRange(range) && range_lines[line->type].Add(range, line))
+		return;
+
+	const WildcardMask* hostmask = line->GetHostMask();
+	if (hostmask)
+	{
+		std::map<std::string, WildcardIndex<XLine*> >::iterator index = host_lines.find(line->type);
+		if (index == host_lines.end())
+			index = host_lines.insert(std::make_pair(line->type, WildcardIndex<XLine*>(hostmask->GetMap()))).first;
+		index->second.Add(*hostmask, line);
+		return;
+	}
+
+	other_lines[line->type][line->Displayable()] = line;
+}
+
+void XLineManager::UnindexLine(XLine* line)
+{
+	irc::sockets::cidr_mask range;
+	if (line->GetRange(range))
+	{
+		std::map<std::string, XLineTrie>::iterator trie = range_lines.find(line->type);
+		if (trie != range_lines.end() && trie->second.Remove(range, line))
+			return;
+	}
+
+	const WildcardMask* hostmask = line->GetHostMask();
+	if (hostmask)
+	{
+		std::map<std::string, WildcardIndex<XLine*> >::iterator index = host_lines.find(line->type);
+		if (index != host_lines.end() && index->second.Remove(*hostmask, line))
+			return;
+	}
+
+	ContainerIter others = other_lines.find(line->type);
+	if (others != other_lines.end())
+		others->second.erase(line->Displayable());
+}
+
+void XLineManager::FindIndexedLines(const std::string& type, User* user, std::vector<XLine*>& lines)
+{
+	std::map<std::string, XLineTrie>::iterator trie = range_lines.find(type);
+	if (trie != range_lines.end())
+		trie->second.Find(user->client_sa, lines);
+
+	std::map<std::string, WildcardIndex<XLine*> >::iterator index = host_lines.find(type);
+	if (index != host_lines.end() && !index->second.empty())
+		FindHostLines(index->second, user, lines);
+}
+
 
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); ++j)
+	if (pending_lines.empty())
+		return;
+
+	// Lines which match an IP range or host mask are looked up by the address and host of each
+	// user rather than being checked against every user. This matters when a burst adds thousands
+	// of them. Lines from modules which might not be safe to match on several threads at once are
+	// only matched on the main thread.
+	XLineTrie pending_ranges;
+	WildcardIndex<XLine*> pending_hosts(ascii_case_insensitive_map);
+	std::vector<XLine*> pending_others;
+	std::vector<XLine*> pending_unsafe;
+	for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
 	{
-		LocalUser* u = *j;
+		if (!(*i)->IsThreadSafe())
+		{
+			pending_unsafe.push_back(*i);
+			continue;
+		}
 
-		// Don't ban people who are exempt.
-		if (u->exempt)
+		irc::sockets::cidr_mask range;
+		if ((*i)->GetRange(range) && pending_ranges.Add(range, *i))
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		const WildcardMask* hostmask = (*i)->GetHostMask();
+		if (hostmask && hostmask->GetMap() == ascii_case_insensitive_map)
+			pending_hosts.Add(*hostmask, *i);
+		else
+			pending_others.push_back(*i);
+	}
+
+	class PendingMatcher : public ParallelJob
+	{
+	 public:
+		XLineTrie& ranges;
+		WildcardIndex<XLine*>& hosts;
+		const std::vector<XLine*>& others;
+		const std::vector<LocalUser*>& users;
+		std::vector<std::vector<XLine*> >& matches;
+
+		PendingMatcher(XLineTrie& r, WildcardIndex<XLine*>& h, const std::vector<XLine*>& o, const std::vector<LocalUser*>& u, std::vector<std::vector<XLine*> >& m)
+			: ranges(r), hosts(h), others(o), users(u), matches(m)
+		{
+		}
+
+		void Run(size_t begin, size_t end) override
+		{
+			std::vector<XLine*> candidates;
+			for (size_t idx = begin; idx != end; ++idx)
+			{
+				LocalUser* u = users[idx];
+
+				candidates.clear();
+				ranges.Find(u->client_sa, candidates);
+				if (!hosts.empty())
+					FindHostLines(hosts, u, candidates);
+				candidates.insert(candidates.end(), others.begin(), others.end());
+
+				for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+				{
+					if ((*i)->Matches(u))
+						matches[idx].push_back(*i);
+				}
+			}
+		}
+	};
+
+	// Don't ban people who are exempt.
+	std::vector<LocalUser*> users;
+	GetMatchableUsers(users, true);
+	std::vector<std::vector<XLine*> > matches(users.size());
+
+	PendingMatcher matcher(pending_ranges, pending_hosts, pending_others, users, matches);
+	const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	const unsigned int threads = RunParallelJob(matcher, users.size(), GetMatchThreads(users.size()));
+	const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+
+	// Applying a line can change the user, e.g. a Q-line changes their nick, so lines are
+	// matched again right before they are applied.
+	for (size_t idx = 0; idx < users.size(); ++idx)
+	{
+		LocalUser* u = users[idx];
+		matches[idx].insert(matches[idx].end(), pending_unsafe.begin(), pending_unsafe.end());
+		for (std::vector<XLine *>::iterator i = matches[idx].begin(); i != matches[idx].end(); i++)
 		{
 			XLine *x = *i;
-			if (x->Matches(u))
+			if (!u->quitting && x->Matches(u))
 				x->Apply(u);
 		}
 	}
 
+	if (threads)
+	{
+		ServerInstance->SNO->WriteToSnoMask('x', "Matched %lu new X-lines against %lu local users in %.2f ms using %u threads",
+			(unsigned long)pending_lines.size(), (unsigned long)users.size(), elapsed.count(), threads + 1);
+	}
+
 	pending_lines.clear();
 }
 
@@ -510,6 +1194,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	delete JobPool;
+	JobPool = NULL;
 }
 
 void XLine::Apply(User* u)
@@ -547,10 +1234,9 @@ bool KLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->GetRealHost(), this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->GetRealHost()) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -570,10 +1256,9 @@ bool GLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->GetRealHost(), this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->GetRealHost()) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -589,10 +1274,9 @@ void GLine::Apply(User* u)
 
 bool ELine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->GetRealHost(), this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->GetRealHost()) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -709,6 +1393,41 @@ const std::string& QLine::Displayable()
 	return nick;
 }
 
+bool KLine::GetRange(irc::sockets::cidr_mask& range)
+{
+	return ParseRange(hostmask, range);
+}
+
+bool GLine::GetRange(irc::sockets::cidr_mask& range)
+{
+	return ParseRange(hostmask, range);
+}
+
+bool ELine::GetRange(irc::sockets::cidr_mask& range)
+{
+	return ParseRange(hostmask, range);
+}
+
+bool ZLine::GetRange(irc::sockets::cidr_mask& range)
+{
+	return ParseRange(ipaddr, range);
+}
+
+const WildcardMask* KLine::GetHostMask()
+{
+	return hostpattern.IsCIDR() ? NULL : &hostpattern;
+}
+
+const WildcardMask* GLine::GetHostMask()
+{
+	return hostpattern.IsCIDR() ? NULL : &hostpattern;
+}
+
+const WildcardMask* ELine::GetHostMask()
+{
+	return hostpattern.IsCIDR() ? NULL : &hostpattern;
+}
+
 bool KLine::IsBurstable()
 {
 	return false;
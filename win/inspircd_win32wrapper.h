@@ -199,6 +199,16 @@ inline ssize_t writev(int fd, const WindowsIOVec* iov, int count)
 	return -1;
 }
 
+inline ssize_t readv(int fd, const WindowsIOVec* iov, int count)
+{
+	DWORD recvd;
+	DWORD flags = 0;
+	int ret = WSARecv(fd, reinterpret_cast<LPWSABUF>(const_cast<WindowsIOVec*>(iov)), count, &recvd, &flags, NULL, NULL);
+	if (ret == 0)
+		return recvd;
+	return -1;
+}
+
 // This wrapper is just so we don't need to do #ifdef _WIN32 everywhere in the socket code. It is
 // not actually used and does not need to be the same size as sockaddr_un on UNIX systems.
 struct sockaddr_un